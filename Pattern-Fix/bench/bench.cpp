@@ -0,0 +1,389 @@
+/*
+** chadregex_bench: CHADRegex against the stock Lua matcher on E2-style
+** workloads. Prints one JSON object per line:
+**
+**   {"bench":"env", ...}      scan kernels and clock in use
+**   {"bench":"time", ...}     ns/call, steps/call, steps/s and allocations/call
+**                             of one operation of one case on one engine
+**   {"bench":"timeout", ...}  how far past its timeout a hopeless match stops
+**
+** usage: chadregex_bench [filter] [--min-ms N]
+** 'filter' keeps the cases whose name contains it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "chadregex.h"
+#include "clock.h"
+#include "lstrlib.h"
+#include "scan.h"
+
+using namespace chadregex;
+
+
+/* {====================================================== allocation counting */
+
+static std::atomic<size_t> allocations{ 0 };
+
+void* operator new(size_t n) {
+    allocations++;
+    if (void* p = malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t n) {
+    return operator new(n);
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+/* }====================================================== */
+
+
+/* {====================================================== corpus */
+
+struct Case {
+    const char* name;
+    std::string subject;
+    std::string pattern;
+    std::string repl;
+};
+
+
+static std::string repeat(const std::string& s, size_t n) {
+    std::string r;
+    r.reserve(s.size() * n);
+    while (n--) r += s;
+    return r;
+}
+
+
+static std::vector<Case> corpus() {
+    const std::string code =
+        "@name Turret\n@inputs Fire Target:entity\n@persist Angle:number Names:array\n"
+        "if (first()) { runOnTick(1) Angle = 45.5 }\n"
+        "Pos = Target:pos() + vec(0, 0, 12)\nprint(\"aim at \" + Pos:toString())\n";
+    const std::string chat =
+        "hey guys did you see that?? lol that was a Fucking great shot, gg wp "
+        "anyone up for another round on gm_construct? FUCK lag... brb ";
+    std::vector<Case> c;
+    c.push_back({ "tokenize_identifiers", repeat(code, 100), "[%a_][%w_]*", "<%0>" });
+    c.push_back({ "tokenize_numbers", repeat(code, 100), "%d+%.?%d*", "#" });
+    c.push_back({ "tokenize_strings", repeat(code, 100), "\"([^\"]*)\"", "'%1'" });
+    c.push_back({ "chat_filter_word", repeat(chat, 50), "[Ff][Uu][Cc][Kk]", "****" });
+    c.push_back({ "chat_collapse_spaces", repeat(chat + "   \t ", 50), "%s+", " " });
+    c.push_back({ "chat_command", repeat(chat, 50) + "!kick bob", "^!(%a+)%s*(.*)", "%1" });
+    c.push_back({ "balanced_parens", repeat("f(a, (b + c) * (d - (e / f))) + ", 200), "%b()", "()" });
+    c.push_back({ "key_value", repeat("health=100;armor=50;name=bob;", 200), "(%w+)=(%w+)", "%2=%1" });
+    c.push_back({ "csv_fields", repeat("12,foo,,3.5,bar baz,", 300), "([^,]*)", "[%1]" });
+    c.push_back({ "trim", std::string(2000, ' ') + "content" + std::string(2000, ' '), "^%s*(.-)%s*$", "%1" });
+    c.push_back({ "url", repeat(chat, 40) + "see https://wiki.facepunch.com/gmod/string.find ok", "https?://[%w%.%-_/]+", "<url>" });
+    c.push_back({ "literal_needle", std::string(100000, 'x') + "needle", "needle", "N" });
+    c.push_back({ "frontier_words", repeat(chat, 50), "%f[%a]%a+%f[%A]", "w" });
+    /* filters that fail on most messages */
+    c.push_back({ "filter_email_miss", repeat(chat, 2), "[%w_]+@example%.com$", "x" });
+    c.push_back({ "filter_assign_miss", repeat(chat, 2), "(%a+) = (%d+)", "%1" });
+    /* hopeless for backtracking matchers: stock lstrlib is polynomial of high degree here */
+    c.push_back({ "catastrophic_lazy", std::string(60, 'a'), "a-a-a-a-b", "x" });
+    c.push_back({ "catastrophic_greedy", std::string(40, 'a'), "a*a*a*a*a*b", "x" });
+    c.push_back({ "catastrophic_captures", std::string(40, 'a'), "(a*)(a*)(a*)(a*)b", "x" });
+    /* still quadratic with the memo; one pass for a DFA */
+    c.push_back({ "ambiguous_long", std::string(300, 'a'), "a*a*[bc]", "x" });
+    return c;
+}
+
+/* }====================================================== */
+
+
+/* {====================================================== measuring */
+
+struct Sample {
+    double ns_per_call = 0;
+    double allocs_per_call = 0;
+    size_t steps = 0;  /* per call, 0 if unknown */
+    std::string result;  /* what the call produced, to compare engines */
+    std::string error;
+};
+
+
+static uint64_t now_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/*
+** Times 'op' in batches of at least 'min_ns' and keeps the median batch.
+** 'op' returns its result and steps; a thrown stock::Error ends the run.
+*/
+static Sample measure(const std::function<std::string(size_t*)>& op, uint64_t min_ns) {
+    Sample smp;
+    try {
+        uint64_t t0 = now_ns();
+        smp.result = op(&smp.steps);  /* warm-up; also fills thread-local pools */
+        uint64_t once = now_ns() - t0;
+        size_t batch = once > 0 ? (size_t)(min_ns / once) + 1 : 1000;
+        if (batch > 1000000) batch = 1000000;
+        std::vector<double> per_call;
+        size_t a0 = allocations.load(), calls = 0;
+        int batches = once > 2 * min_ns ? 1 : 5;
+        for (int b = 0; b < batches; b++) {
+            size_t steps;
+            t0 = now_ns();
+            for (size_t i = 0; i < batch; i++)
+                op(&steps);
+            per_call.push_back((double)(now_ns() - t0) / (double)batch);
+            calls += batch;
+        }
+        std::sort(per_call.begin(), per_call.end());
+        smp.ns_per_call = per_call[per_call.size() / 2];
+        smp.allocs_per_call = (double)(allocations.load() - a0) / (double)calls;
+    } catch (const stock::Error& e) {
+        smp.error = e.message;
+    }
+    return smp;
+}
+
+
+static uint64_t fnv1a(const std::string& s) {
+    uint64_t h = 1469598103934665603ull;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+
+static std::string json_string(const std::string& s) {
+    std::string r = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') r += '\\';
+        if ((unsigned char)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            r += buf;
+        } else
+            r += c;
+    }
+    return r + "\"";
+}
+
+
+static std::string spans(const Span& whole, const Match& m, bool with_whole) {
+    std::string r = std::to_string(whole.begin) + "-" + std::to_string(whole.end);
+    if (m.ncaptures == 0 && with_whole)
+        r += "|" + std::to_string(whole.begin) + "-" + std::to_string(whole.end);
+    for (int i = 0; i < m.ncaptures; i++)
+        r += "|" + std::to_string(m.captures[i].begin) + "-" + std::to_string(m.captures[i].end);
+    return r;
+}
+
+
+static std::string stock_spans(const stock::Span& whole, const std::vector<stock::Span>& caps) {
+    std::string r = std::to_string(whole.begin) + "-" + std::to_string(whole.end);
+    for (const stock::Span& c : caps)
+        r += "|" + std::to_string(c.begin) + "-" + std::to_string(c.end);
+    return r;
+}
+
+/* }====================================================== */
+
+
+enum BenchOp { BENCH_FIND, BENCH_MATCH, BENCH_GMATCH, BENCH_GSUB };
+static const char* const op_names[] = { "find", "match", "gmatch", "gsub" };
+
+
+/* the operation on CHADRegex */
+static std::function<std::string(size_t*)> chad_op(const Case& c, BenchOp op,
+    const Program* prog, const Program* gprog) {
+    switch (op) {
+    case BENCH_FIND:
+    case BENCH_MATCH:
+        return [&c, prog](size_t* steps) {
+            Match m;
+            bool found;
+            Limits lim;
+            lim.steps = steps;
+            find(*prog, c.subject, 0, m, &found, lim);
+            return found ? spans(m.whole, m, true) : std::string("nil");
+        };
+    case BENCH_GMATCH:
+        return [&c, gprog](size_t* steps) {
+            MatchIterator it(*gprog, c.subject);
+            Match m;
+            size_t n = 0;
+            while (it.next(m)) n++;
+            *steps = it.steps();
+            return std::to_string(n);
+        };
+    default: {
+        std::shared_ptr<const Replacement> repl;  /* parsed once, as the module caches it */
+        compile_replacement(c.repl, repl);
+        return [&c, prog, repl](size_t* steps) {
+            std::string out;
+            size_t n;
+            Limits lim;
+            lim.steps = steps;
+            gsub(*prog, c.subject, *repl, c.subject.size() + 1, out, &n, lim);
+            return std::to_string(n) + ":" + std::to_string(fnv1a(out));
+        };
+    }
+    }
+}
+
+
+/* the operation on the stock matcher, with or without the baseline hook */
+static std::function<std::string(size_t*)> stock_op(const Case& c, BenchOp op, const stock::Hook* hook) {
+    switch (op) {
+    case BENCH_FIND:
+    case BENCH_MATCH:
+        return [&c, hook](size_t* steps) {
+            stock::Span whole;
+            std::vector<stock::Span> caps;
+            bool found = stock::find(c.subject, c.pattern, 0, whole, caps, hook, steps);
+            return found ? stock_spans(whole, caps) : std::string("nil");
+        };
+    case BENCH_GMATCH:
+        return [&c, hook](size_t* steps) {
+            return std::to_string(stock::gmatch_count(c.subject, c.pattern, hook, steps));
+        };
+    default:
+        return [&c, hook](size_t* steps) {
+            size_t n;
+            std::string out = stock::gsub(c.subject, c.pattern, c.repl, &n, hook, steps);
+            return std::to_string(n) + ":" + std::to_string(fnv1a(out));
+        };
+    }
+}
+
+
+static void print_time(const Case& c, BenchOp op, const char* engine, const Sample& s,
+    const std::string& reference) {
+    printf("{\"bench\":\"time\",\"case\":%s,\"op\":\"%s\",\"engine\":\"%s\"",
+        json_string(c.name).c_str(), op_names[op], engine);
+    if (!s.error.empty()) {
+        printf(",\"error\":%s}\n", json_string(s.error).c_str());
+        return;
+    }
+    printf(",\"ns_per_call\":%.1f,\"allocs_per_call\":%.2f", s.ns_per_call, s.allocs_per_call);
+    if (s.steps > 0)
+        printf(",\"steps_per_call\":%zu,\"steps_per_s\":%.4g", s.steps,
+            s.ns_per_call > 0 ? (double)s.steps * 1e9 / s.ns_per_call : 0.0);
+    printf(",\"result\":%s,\"agrees\":%s}\n", json_string(s.result).c_str(),
+        s.result == reference ? "true" : "false");
+}
+
+
+/* {====================================================== timeout overshoot */
+
+struct TimeoutCase {
+    const char* name;
+    std::string subject;
+    std::string pattern;  /* slow for both engines (back-references turn off memoization) */
+};
+
+
+static void bench_timeouts(const char* filter) {
+    /* the subjects hold the 'b' the patterns end with, so the prefilter
+       (scan.h, may_match) lets them through; it comes first, where the
+       'a' the patterns start with keeps it out of every match */
+    std::vector<TimeoutCase> cases = {
+        { "timeout_backref", "b" + std::string(3000, 'a'), "a(.-)%1%1b" },
+        { "timeout_backref_captures", "b" + std::string(2000, 'a') + "c", "a(a*)(a*)%1%2b" },
+    };
+    const uint64_t timeouts[] = { 1000000, 5000000, 20000000 };
+    const int runs = 10;
+    for (const TimeoutCase& tc : cases) {
+        if (filter && !strstr(tc.name, filter))
+            continue;
+        std::shared_ptr<const Program> prog;
+        compile(tc.pattern, prog);
+        for (uint64_t t : timeouts) {
+            for (int engine = 0; engine < 2; engine++) {
+                double sum = 0, worst = 0;
+                int stopped = 0;
+                for (int r = 0; r < runs; r++) {
+                    uint64_t t0 = now_ns();
+                    if (engine == 0) {
+                        Match m;
+                        bool found;
+                        Limits lim;
+                        lim.timeout_ns = t;
+                        stopped += find(*prog, tc.subject, 0, m, &found, lim) == STATUS_TIMEOUT;
+                    } else {
+                        stock::Hook hook;
+                        stock::Span whole;
+                        std::vector<stock::Span> caps;
+                        hook.timeout_ns = t;
+                        try {
+                            stock::find(tc.subject, tc.pattern, 0, whole, caps, &hook);
+                        } catch (const stock::Error&) {
+                            stopped++;
+                        }
+                    }
+                    double el = (double)(now_ns() - t0);
+                    sum += el;
+                    worst = std::max(worst, el);
+                }
+                printf("{\"bench\":\"timeout\",\"case\":%s,\"engine\":\"%s\",\"timeout_ns\":%llu,"
+                    "\"runs\":%d,\"stopped\":%d,\"mean_ns\":%.0f,\"max_ns\":%.0f,"
+                    "\"mean_overshoot\":%.4f,\"max_overshoot\":%.4f}\n",
+                    json_string(tc.name).c_str(), engine == 0 ? "chadregex" : "lstrlib_hook",
+                    (unsigned long long)t, runs, stopped, sum / runs, worst,
+                    (sum / runs - (double)t) / (double)t, (worst - (double)t) / (double)t);
+                fflush(stdout);
+            }
+        }
+    }
+}
+
+/* }====================================================== */
+
+
+int main(int argc, char** argv) {
+    const char* filter = NULL;
+    uint64_t min_ns = 20000000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--min-ms") == 0 && i + 1 < argc)
+            min_ns = (uint64_t)(atof(argv[++i]) * 1e6);
+        else
+            filter = argv[i];
+    }
+    printf("{\"bench\":\"env\",\"scan\":\"%s\",\"clock\":\"%s\",\"step_ns\":%.3f}\n",
+        scan_impl_name(), clock_source(), get_step_ns());
+
+    stock::Hook baseline_hook;  /* ticks like the baseline module, no timeout */
+    for (const Case& c : corpus()) {
+        if (filter && !strstr(c.name, filter))
+            continue;
+        std::shared_ptr<const Program> prog, gprog;
+        compile(c.pattern, prog);
+        compile(c.pattern, gprog, CF_NOANCHOR);
+        for (BenchOp op : { BENCH_FIND, BENCH_MATCH, BENCH_GMATCH, BENCH_GSUB }) {
+            Sample ref = measure(stock_op(c, op, NULL), min_ns);
+            Sample hooked = measure(stock_op(c, op, &baseline_hook), min_ns);
+            Sample chad = measure(chad_op(c, op, prog.get(), gprog.get()), min_ns);
+            ref.steps = 0;  /* the plain stock matcher does not count */
+            print_time(c, op, "lstrlib", ref, ref.result);
+            print_time(c, op, "lstrlib_hook", hooked, ref.result);
+            print_time(c, op, "chadregex", chad, ref.result);
+            fflush(stdout);
+        }
+    }
+    bench_timeouts(filter);
+    return 0;
+}
@@ -0,0 +1,498 @@
+#include "lstrlib.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <chrono>
+
+namespace stock {
+
+#define CAP_UNFINISHED	(-1)
+#define CAP_POSITION	(-2)
+#define MAXCAPTURES	32
+
+/* maximum recursion depth for 'match' */
+#if !defined(MAXCCALLS)
+#define MAXCCALLS	200
+#endif
+
+#define L_ESC		'%'
+#define uchar(c)	((unsigned char)(c))
+
+
+typedef struct MatchState {
+    const char* src_init;  /* init of source string */
+    const char* src_end;  /* end ('\0') of source string */
+    const char* p_end;  /* end ('\0') of pattern */
+    int matchdepth;  /* control for recursive depth (to avoid C stack overflow) */
+    unsigned char level;  /* total number of captures (finished or unfinished) */
+    struct {
+        const char* init;
+        ptrdiff_t len;
+    } capture[MAXCAPTURES];
+
+    const Hook* hook;
+    size_t steps;
+    size_t countdown;  /* steps until the next clock check */
+    std::chrono::high_resolution_clock::time_point start;
+} MatchState;
+
+
+static void error(const char* msg) {
+    throw Error{ msg };
+}
+
+
+/* the baseline's 'tick_lua_match_hook' */
+static inline void tick(MatchState* ms) {
+    ms->steps++;
+    if (--ms->countdown == 0) {
+        ms->countdown = ms->hook->every;
+        if (ms->hook->timeout_ns > 0 &&
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::high_resolution_clock::now() - ms->start).count()
+            > (long long)ms->hook->timeout_ns)
+            error("Time limit exended");
+    }
+}
+
+
+template <bool H>
+static const char* match(MatchState* ms, const char* s, const char* p);
+
+
+static int check_capture(MatchState* ms, int l) {
+    l -= '1';
+    if (l < 0 || l >= ms->level || ms->capture[l].len == CAP_UNFINISHED)
+        error("invalid capture index");
+    return l;
+}
+
+
+static int capture_to_close(MatchState* ms) {
+    int level = ms->level;
+    for (level--; level >= 0; level--)
+        if (ms->capture[level].len == CAP_UNFINISHED) return level;
+    error("invalid pattern capture");
+    return 0;
+}
+
+
+static const char* classend(MatchState* ms, const char* p) {
+    switch (*p++) {
+    case L_ESC: {
+        if (p == ms->p_end)
+            error("malformed pattern (ends with '%')");
+        return p + 1;
+    }
+    case '[': {
+        if (*p == '^') p++;
+        do {  /* look for a ']' */
+            if (p == ms->p_end)
+                error("malformed pattern (missing ']')");
+            if (*(p++) == L_ESC && p < ms->p_end)
+                p++;  /* skip escapes (e.g. '%]') */
+        } while (*p != ']');
+        return p + 1;
+    }
+    default: {
+        return p;
+    }
+    }
+}
+
+
+static int match_class(int c, int cl) {
+    int res;
+    switch (tolower(cl)) {
+    case 'a': res = isalpha(c); break;
+    case 'c': res = iscntrl(c); break;
+    case 'd': res = isdigit(c); break;
+    case 'g': res = isgraph(c); break;
+    case 'l': res = islower(c); break;
+    case 'p': res = ispunct(c); break;
+    case 's': res = isspace(c); break;
+    case 'u': res = isupper(c); break;
+    case 'w': res = isalnum(c); break;
+    case 'x': res = isxdigit(c); break;
+    case 'z': res = (c == 0); break;  /* deprecated option */
+    default: return (cl == c);
+    }
+    return (islower(cl) ? res : !res);
+}
+
+
+static int matchbracketclass(int c, const char* p, const char* ec) {
+    int sig = 1;
+    if (*(p + 1) == '^') {
+        sig = 0;
+        p++;  /* skip the '^' */
+    }
+    while (++p < ec) {
+        if (*p == L_ESC) {
+            p++;
+            if (match_class(c, uchar(*p)))
+                return sig;
+        } else if ((*(p + 1) == '-') && (p + 2 < ec)) {
+            p += 2;
+            if (uchar(*(p - 2)) <= c && c <= uchar(*p))
+                return sig;
+        } else if (uchar(*p) == c) return sig;
+    }
+    return !sig;
+}
+
+
+template <bool H>
+static int singlematch(MatchState* ms, const char* s, const char* p,
+    const char* ep) {
+    if (H)
+        tick(ms);
+    if (s >= ms->src_end)
+        return 0;
+    else {
+        int c = uchar(*s);
+        switch (*p) {
+        case '.': return 1;  /* matches any char */
+        case L_ESC: return match_class(c, uchar(*(p + 1)));
+        case '[': return matchbracketclass(c, p, ep - 1);
+        default:  return (uchar(*p) == c);
+        }
+    }
+}
+
+
+static const char* matchbalance(MatchState* ms, const char* s,
+    const char* p) {
+    if (p >= ms->p_end - 1)
+        error("malformed pattern (missing arguments to '%b')");
+    if (*s != *p) return NULL;
+    else {
+        int b = *p;
+        int e = *(p + 1);
+        int cont = 1;
+        while (++s < ms->src_end) {
+            if (*s == e) {
+                if (--cont == 0) return s + 1;
+            } else if (*s == b) cont++;
+        }
+    }
+    return NULL;  /* string ends out of balance */
+}
+
+
+template <bool H>
+static const char* max_expand(MatchState* ms, const char* s,
+    const char* p, const char* ep) {
+    ptrdiff_t i = 0;  /* counts maximum expand for item */
+    while (singlematch<H>(ms, s + i, p, ep))
+        i++;
+    /* keeps trying to match with the maximum repetitions */
+    while (i >= 0) {
+        const char* res = match<H>(ms, (s + i), ep + 1);
+        if (res) return res;
+        i--;  /* else didn't match; reduce 1 repetition to try again */
+    }
+    return NULL;
+}
+
+
+template <bool H>
+static const char* min_expand(MatchState* ms, const char* s,
+    const char* p, const char* ep) {
+    for (;;) {
+        const char* res = match<H>(ms, s, ep + 1);
+        if (res != NULL)
+            return res;
+        else if (singlematch<H>(ms, s, p, ep))
+            s++;  /* try with one more repetition */
+        else return NULL;
+    }
+}
+
+
+template <bool H>
+static const char* start_capture(MatchState* ms, const char* s,
+    const char* p, int what) {
+    const char* res;
+    unsigned char level = (unsigned char)ms->level;
+    if (level >= MAXCAPTURES) error("too many captures");
+    ms->capture[level].init = s;
+    ms->capture[level].len = what;
+    ms->level = level + 1;
+    if ((res = match<H>(ms, s, p)) == NULL)  /* match failed? */
+        ms->level--;  /* undo capture */
+    return res;
+}
+
+
+template <bool H>
+static const char* end_capture(MatchState* ms, const char* s,
+    const char* p) {
+    int l = capture_to_close(ms);
+    const char* res;
+    ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
+    if ((res = match<H>(ms, s, p)) == NULL)  /* match failed? */
+        ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
+    return res;
+}
+
+
+static const char* match_capture(MatchState* ms, const char* s, int l) {
+    size_t len;
+    l = check_capture(ms, l);
+    len = ms->capture[l].len;
+    if ((size_t)(ms->src_end - s) >= len &&
+        memcmp(ms->capture[l].init, s, len) == 0)
+        return s + len;
+    else return NULL;
+}
+
+
+template <bool H>
+static const char* match(MatchState* ms, const char* s, const char* p) {
+    if (ms->matchdepth-- == 0)
+        error("pattern too complex");
+init: /* using goto's to optimize tail recursion */
+    if (p != ms->p_end) {  /* end of pattern? */
+        switch (*p) {
+        case '(': {  /* start capture */
+            if (*(p + 1) == ')')  /* position capture? */
+                s = start_capture<H>(ms, s, p + 2, CAP_POSITION);
+            else
+                s = start_capture<H>(ms, s, p + 1, CAP_UNFINISHED);
+            break;
+        }
+        case ')': {  /* end capture */
+            s = end_capture<H>(ms, s, p + 1);
+            break;
+        }
+        case '$': {
+            if ((p + 1) != ms->p_end)  /* is the '$' the last char in pattern? */
+                goto dflt;  /* no; go to default */
+            s = (s == ms->src_end) ? s : NULL;  /* check end of string */
+            break;
+        }
+        case L_ESC: {  /* escaped sequences not in the format class[*+?-]? */
+            switch (*(p + 1)) {
+            case 'b': {  /* balanced string? */
+                s = matchbalance(ms, s, p + 2);
+                if (s != NULL) {
+                    p += 4; goto init;  /* return match(ms, s, p + 4); */
+                }  /* else fail (s == NULL) */
+                break;
+            }
+            case 'f': {  /* frontier? */
+                const char* ep; char previous;
+                p += 2;
+                if (*p != '[')
+                    error("missing '[' after '%f' in pattern");
+                ep = classend(ms, p);  /* points to what is next */
+                previous = (s == ms->src_init) ? '\0' : *(s - 1);
+                if (!matchbracketclass(uchar(previous), p, ep - 1) &&
+                    matchbracketclass(uchar(*s), p, ep - 1)) {
+                    p = ep; goto init;  /* return match(ms, s, ep); */
+                }
+                s = NULL;  /* match failed */
+                break;
+            }
+            case '0': case '1': case '2': case '3':
+            case '4': case '5': case '6': case '7':
+            case '8': case '9': {  /* capture results (%0-%9)? */
+                s = match_capture(ms, s, uchar(*(p + 1)));
+                if (s != NULL) {
+                    p += 2; goto init;  /* return match(ms, s, p + 2) */
+                }
+                break;
+            }
+            default: goto dflt;
+            }
+            break;
+        }
+        default: dflt: {  /* pattern class plus optional suffix */
+            const char* ep = classend(ms, p);  /* points to optional suffix */
+            /* does not match at least once? */
+            if (!singlematch<H>(ms, s, p, ep)) {
+                if (*ep == '*' || *ep == '?' || *ep == '-') {  /* accept empty? */
+                    p = ep + 1; goto init;  /* return match(ms, s, ep + 1); */
+                } else  /* '+' or no suffix */
+                    s = NULL;  /* fail */
+            } else {  /* matched once */
+                switch (*ep) {  /* handle optional suffix */
+                case '?': {  /* optional */
+                    const char* res;
+                    if ((res = match<H>(ms, s + 1, ep + 1)) != NULL)
+                        s = res;
+                    else {
+                        p = ep + 1; goto init;  /* else return match(ms, s, ep + 1); */
+                    }
+                    break;
+                }
+                case '+':  /* 1 or more repetitions */
+                    s++;  /* 1 match already done */
+                    /* FALLTHROUGH */
+                case '*':  /* 0 or more repetitions */
+                    s = max_expand<H>(ms, s, p, ep);
+                    break;
+                case '-':  /* 0 or more repetitions (minimum) */
+                    s = min_expand<H>(ms, s, p, ep);
+                    break;
+                default:  /* no suffix */
+                    s++; p = ep; goto init;  /* return match(ms, s + 1, ep); */
+                }
+            }
+            break;
+        }
+        }
+    }
+    ms->matchdepth++;
+    return s;
+}
+
+
+static void prepstate(MatchState* ms, std::string_view s, const char* p_end, const Hook* hook) {
+    ms->src_init = s.data();
+    ms->src_end = s.data() + s.size();
+    ms->p_end = p_end;
+    ms->hook = hook;
+    ms->steps = 0;
+    ms->countdown = hook ? hook->every : 0;
+    ms->start = std::chrono::high_resolution_clock::now();
+}
+
+
+static void reprepstate(MatchState* ms) {
+    ms->level = 0;
+    ms->matchdepth = MAXCCALLS;
+}
+
+
+static inline const char* do_match(MatchState* ms, const char* s, const char* p) {
+    return ms->hook ? match<true>(ms, s, p) : match<false>(ms, s, p);
+}
+
+
+/* the captures of 's'..'e' as 'push_captures' would push them */
+static void get_captures(MatchState* ms, const char* s, const char* e, std::vector<Span>& caps) {
+    int nlevels = (ms->level == 0 && s) ? 1 : ms->level;
+    caps.clear();
+    for (int i = 0; i < nlevels; i++) {
+        if (i >= ms->level)
+            caps.push_back(Span{ (size_t)(s - ms->src_init), (size_t)(e - ms->src_init), false });
+        else {
+            ptrdiff_t l = ms->capture[i].len;
+            size_t b = ms->capture[i].init - ms->src_init;
+            if (l == CAP_UNFINISHED)
+                error("unfinished capture");
+            caps.push_back(Span{ b, l == CAP_POSITION ? b : b + l, l == CAP_POSITION });
+        }
+    }
+}
+
+
+bool find(std::string_view s, std::string_view p, size_t init, Span& whole,
+    std::vector<Span>& caps, const Hook* hook, size_t* steps) {
+    MatchState ms;
+    const char* pat = p.data();
+    const char* s1 = s.data() + init;
+    int anchor = (!p.empty() && *pat == '^');
+    if (init > s.size())
+        return false;
+    if (anchor)
+        pat++;
+    prepstate(&ms, s, p.data() + p.size(), hook);
+    do {
+        const char* res;
+        reprepstate(&ms);
+        if ((res = do_match(&ms, s1, pat)) != NULL) {
+            whole = Span{ (size_t)(s1 - s.data()), (size_t)(res - s.data()), false };
+            get_captures(&ms, s1, res, caps);
+            if (steps) *steps = ms.steps;
+            return true;
+        }
+    } while (s1++ < ms.src_end && !anchor);
+    if (steps) *steps = ms.steps;
+    return false;
+}
+
+
+size_t gmatch_count(std::string_view s, std::string_view p, const Hook* hook, size_t* steps) {
+    MatchState ms;
+    const char* lastmatch = NULL;
+    size_t n = 0;
+    prepstate(&ms, s, p.data() + p.size(), hook);
+    const char* src = s.data();
+    while (src <= ms.src_end) {
+        const char* e;
+        reprepstate(&ms);
+        if ((e = do_match(&ms, src, p.data())) != NULL && e != lastmatch) {
+            n++;
+            src = lastmatch = e;
+        } else
+            src++;
+    }
+    if (steps) *steps = ms.steps;
+    return n;
+}
+
+
+static void add_s(MatchState* ms, std::string& b, const char* s, const char* e,
+    std::string_view news) {
+    std::vector<Span> caps;
+    for (size_t i = 0; i < news.size(); i++) {
+        if (news[i] != L_ESC) {
+            b += news[i];
+            continue;
+        }
+        i++;  /* skip ESC */
+        if (i == news.size())
+            error("invalid use of '%' in replacement string");
+        char c = news[i];
+        if (c == L_ESC)  /* '%%' */
+            b += c;
+        else if (c == '0')  /* '%0' */
+            b.append(s, e - s);
+        else if (isdigit(uchar(c))) {  /* '%n' */
+            int l = c - '1';
+            get_captures(ms, s, e, caps);
+            if (l >= (int)caps.size())
+                error("invalid capture index");
+            if (caps[l].position)
+                b += std::to_string(caps[l].begin + 1);
+            else
+                b.append(ms->src_init + caps[l].begin, caps[l].end - caps[l].begin);
+        } else
+            error("invalid use of '%' in replacement string");
+    }
+}
+
+
+std::string gsub(std::string_view s, std::string_view p, std::string_view repl,
+    size_t* n, const Hook* hook, size_t* steps) {
+    MatchState ms;
+    const char* src = s.data();
+    const char* pat = p.data();
+    const char* lastmatch = NULL;
+    int anchor = (!p.empty() && *pat == '^');
+    std::string b;
+    *n = 0;
+    if (anchor)
+        pat++;
+    prepstate(&ms, s, p.data() + p.size(), hook);
+    for (;;) {
+        const char* e;
+        reprepstate(&ms);
+        if ((e = do_match(&ms, src, pat)) != NULL && e != lastmatch) {
+            (*n)++;
+            add_s(&ms, b, src, e, repl);
+            src = lastmatch = e;
+        } else if (src < ms.src_end)
+            b += *src++;
+        else break;
+        if (anchor) break;
+    }
+    b.append(src, ms.src_end - src);
+    if (steps) *steps = ms.steps;
+    return b;
+}
+
+}  // namespace stock
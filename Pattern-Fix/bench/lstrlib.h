@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+** The stock Lua matcher (lstrlib's recursive 'match', as this module
+** shipped it before the engine rewrite) without the Lua API, to compare
+** against. Errors are thrown as stock::Error. With a Hook, every
+** 'singlematch' ticks the baseline's hook: a step counter and, every
+** 'every' steps, a clock check against 'timeout_ns'.
+*/
+namespace stock {
+
+struct Error {
+    const char* message;
+};
+
+struct Hook {
+    size_t every = 100000;  /* the baseline's everySimpleStep default */
+    uint64_t timeout_ns = 0;  /* 0 for none */
+};
+
+struct Span {
+    size_t begin, end;
+    bool position;
+};
+
+/* first match at or after 'init'; captures (or the whole match) in 'caps' */
+bool find(std::string_view s, std::string_view p, size_t init, Span& whole,
+    std::vector<Span>& caps, const Hook* hook = NULL, size_t* steps = NULL);
+
+/* number of gmatch matches */
+size_t gmatch_count(std::string_view s, std::string_view p,
+    const Hook* hook = NULL, size_t* steps = NULL);
+
+/* gsub with a replacement string */
+std::string gsub(std::string_view s, std::string_view p, std::string_view repl,
+    size_t* n, const Hook* hook = NULL, size_t* steps = NULL);
+
+}  // namespace stock
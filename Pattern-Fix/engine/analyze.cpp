@@ -0,0 +1,214 @@
+#include "analyze.h"
+
+#include <algorithm>
+
+#include "matcher.h"
+
+namespace chadregex {
+
+/* the bytes a single-char item accepts ('.', and anything else, all of them) */
+static CharSet item_bytes(const Program& prog, const Item& it) {
+    CharSet cs = {};
+    switch (it.op) {
+    case OP_CHAR: cs.add(it.a); break;
+    case OP_CLASS: case OP_SET: cs = prog.sets[it.set]; break;
+    default: cs.invert(); break;
+    }
+    return cs;
+}
+
+
+/* 'a' &= 'b' (the bitmap only); false if nothing is left */
+static bool intersect(CharSet& a, const CharSet& b) {
+    uint32_t any = 0;
+    for (int i = 0; i < 8; i++)
+        any |= (a.bits[i] &= b.bits[i]);
+    return any != 0;
+}
+
+
+static bool is_single(const Item& it) {
+    return it.op == OP_CHAR || it.op == OP_ANY || it.op == OP_CLASS || it.op == OP_SET;
+}
+
+
+static bool is_repeat(const Item& it) {
+    return is_single(it) && (it.quant == Q_STAR || it.quant == Q_PLUS || it.quant == Q_LAZY);
+}
+
+
+/* can match empty and never fails: once the matcher gets past it, it matched */
+static bool always_matches(const Item& it) {
+    switch (it.op) {
+    case OP_OPEN: case OP_POSITION: case OP_CLOSE:
+        return true;
+    default:
+        return is_single(it) && it.quant != Q_ONE && it.quant != Q_PLUS;
+    }
+}
+
+
+/*
+** Walks from the repeat at 'i' while some byte is accepted by everything
+** passed, counting the repeats (and the final '%b' or back-reference)
+** that could all share a run of that byte. Only the repeats before the
+** last item that can fail count: past it, the rest of the pattern always
+** matches ('tail' on), so the first split that gets there wins. Sets
+** '*last' to the last item counted and '*kind' to what the run ends with.
+*/
+static int chain_from(const Program& prog, size_t i, size_t tail, size_t* last,
+    FindingKind* kind) {
+    const std::vector<Item>& items = prog.items;
+    CharSet common = item_bytes(prog, items[i]);
+    int len = 1;
+    int failing = 0;  /* 'len' at the last item that can fail */
+    size_t failing_last = i;
+    *last = i;
+    *kind = FINDING_AMBIGUOUS;
+    for (size_t j = i + 1; j < tail; j++) {
+        const Item& it = items[j];
+        switch (it.op) {
+        case OP_OPEN: case OP_POSITION: case OP_CLOSE:
+            continue;
+        case OP_FRONTIER:  /* zero width, but can fail */
+            failing = len;
+            failing_last = *last;
+            continue;
+        case OP_BALANCE:
+            if (common.test(it.a)) {  /* can open inside the run */
+                len++;
+                *last = j;
+                *kind = FINDING_BALANCE;
+            }
+            return len;
+        case OP_BACKREF:  /* the capture may be a piece of the run */
+            len++;
+            *last = j;
+            return len;
+        case OP_EOS:
+            return len;
+        default: {
+            CharSet both = common;
+            bool overlap = intersect(both, item_bytes(prog, it));
+            if (it.quant == Q_OPT)
+                continue;  /* can be skipped, at most a factor of 2 */
+            if (it.quant == Q_ONE) {
+                if (!overlap)
+                    return len;
+                common = both;
+                failing = len;
+                failing_last = *last;
+                continue;
+            }
+            if (overlap) {
+                common = both;
+                len++;
+                *last = j;
+            } else if (it.quant == Q_PLUS)
+                return len;  /* needs a byte outside the run */
+            continue;
+        }
+        }
+    }
+    *last = failing_last;
+    return failing;
+}
+
+
+Analysis analyze(const Program& prog) {
+    Analysis a;
+    const std::vector<Item>& items = prog.items;
+    a.memoized = !prog.backrefs;
+    size_t tail = items.size() - 1;  /* OP_MATCH */
+    while (tail > 0 && always_matches(items[tail - 1]))
+        tail--;
+    size_t covered = 0;  /* items before this are in a reported chain */
+    for (size_t i = 0; i < items.size(); i++) {
+        const Item& it = items[i];
+        if (it.op == OP_BALANCE || it.op == OP_BACKREF)
+            a.scans++;
+        if (it.op == OP_BACKREF)
+            a.findings.push_back(Finding{ FINDING_BACKREF, prog.offsets[i], prog.offsets[i + 1], 0 });
+        if (!is_repeat(it))
+            continue;
+        a.repeats++;
+        size_t last;
+        FindingKind kind;
+        int len = i < tail ? chain_from(prog, i, tail, &last, &kind) : 0;
+        a.attempt_degree = std::max(a.attempt_degree, len);
+        if (len >= 2 && i >= covered) {
+            a.findings.push_back(Finding{ kind, prog.offsets[i], prog.offsets[last + 1], len });
+            covered = last + 1;
+        }
+    }
+    if (a.attempt_degree == 0 && a.scans > 0)
+        a.attempt_degree = 1;  /* a lone scan is linear */
+    std::sort(a.findings.begin(), a.findings.end(), [](const Finding& x, const Finding& y) {
+        return x.from < y.from;
+    });
+    a.degree = a.attempt_degree + (prog.anchor ? 0 : 1);
+    if (a.degree == 0 && a.repeats > 0)
+        a.degree = 1;  /* the match that succeeds still scans its runs */
+    a.memo_degree = a.memoized ? std::min(a.degree, 2) : a.degree;
+    return a;
+}
+
+
+/* binomial coefficient (n + k choose k), as a double */
+static double choose(double n, int k) {
+    double r = 1;
+    for (int i = 1; i <= k; i++)
+        r = r * (n + i) / i;
+    return r;
+}
+
+
+/*
+** Without the memo an attempt tries every split of the subject between
+** its k ambiguous items, (n + k choose k) of them at two steps each (one
+** forward, one back), and a search makes an attempt at each offset:
+** (n + k + 1 choose k + 1) splits in all. With it, each item runs at
+** most once per offset, but a repeat scans on to the end of its run
+** each time: about n^2 / 2 per repeat or scan item. A '%b' or a
+** back-reference scans bytes without counting steps, so for those this
+** is the work rather than what the hook sees.
+*/
+double worst_steps(const Program& prog, const Analysis& a, size_t n) {
+    double dn = (double)n;
+    double items = (double)prog.items.size();
+    double attempts = prog.anchor ? 1 : dn + 1;
+    int k = a.attempt_degree;
+    double steps = items * attempts + (a.repeats > 0 ? dn : 0);
+    if (k > 0)
+        steps += 2 * (prog.anchor ? choose(dn, k) : choose(dn, k + 1));
+    size_t cols = prog.items.size();
+    if (a.memoized && n < get_max_memo_bytes() * 8 / cols) {
+        double memo = items * (dn + 1) +
+            (double)(a.repeats + a.scans) * (dn + 1) * (dn + 2) / 2;
+        steps = std::min(steps, memo);
+    }
+    return steps;
+}
+
+
+const char* complexity_class(int degree) {
+    switch (degree) {
+    case 0: return "constant";
+    case 1: return "linear";
+    case 2: return "quadratic";
+    case 3: return "cubic";
+    default: return "polynomial";
+    }
+}
+
+
+const char* finding_name(FindingKind kind) {
+    switch (kind) {
+    case FINDING_AMBIGUOUS: return "ambiguous";
+    case FINDING_BALANCE: return "balance";
+    case FINDING_BACKREF: return "backref";
+    }
+    return "?";
+}
+
+}  // namespace chadregex
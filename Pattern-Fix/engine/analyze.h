@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "pattern.h"
+
+namespace chadregex {
+
+/*
+** Static cost analysis of a program, for admission control: how the
+** worst-case work of a search grows with the subject length 'n', and
+** which parts of the pattern make it grow.
+**
+** Lua patterns cannot nest quantifiers ('(%a*)*' is a literal '*'), so
+** the ambiguity comes from neighbours instead: repeated items separated
+** only by items that can match the same bytes, like '.-.-' or
+** '%a*x%a*'. On a run of a byte they all accept, each of them can stop
+** anywhere, and an attempt that fails tries every split: about n^k
+** steps for k of them. '%b' and back-references scan on from wherever
+** the repetition before them stopped, which adds one more factor of n.
+*/
+
+enum FindingKind : unsigned char {
+    FINDING_AMBIGUOUS,  /* repeated items splitting the same bytes */
+    FINDING_BALANCE,    /* the same, ending with a '%b' scan */
+    FINDING_BACKREF,    /* a '%1'..'%9' (keeps the memo off) */
+};
+
+struct Finding {
+    FindingKind kind;
+    size_t from, to;  /* the span in Program::source, [from, to) */
+    int degree;       /* factors of n it adds to one attempt (0 for a backref) */
+};
+
+struct Analysis {
+    int attempt_degree = 0;  /* one attempt at one offset costs about n^attempt_degree */
+    int degree = 0;          /* a whole search, without the memo */
+    int memo_degree = 0;     /* a whole search, with it (as 'degree' when backrefs keep it off) */
+    bool memoized = false;   /* no back-references, so the memo can cut the backtracking */
+    size_t repeats = 0;      /* '*', '+' and '-' items */
+    size_t scans = 0;        /* '%b' and back-reference items */
+    std::vector<Finding> findings;  /* in pattern order */
+};
+
+Analysis analyze(const Program& prog);
+
+/*
+** Worst-case steps of one search over 'n' bytes (a rough upper bound,
+** taking the memo into account when the subject fits in it).
+*/
+double worst_steps(const Program& prog, const Analysis& a, size_t n);
+
+/* "constant", "linear", "quadratic", "cubic" or "polynomial" */
+const char* complexity_class(int degree);
+
+/* "ambiguous", "balance" or "backref" */
+const char* finding_name(FindingKind kind);
+
+}  // namespace chadregex
@@ -0,0 +1,236 @@
+#include "async.h"
+
+#include <condition_variable>
+#include <string_view>
+#include <thread>
+
+#include "batch.h"
+
+namespace chadregex {
+
+struct Queued {
+    std::shared_ptr<AsyncInbox> inbox;
+    AsyncTask task;
+};
+
+static std::mutex pool_mutex;
+static std::condition_variable pool_cv;
+static std::deque<Queued> queue;
+
+/*
+** Joined by async_shutdown when the module closes. Exiting without that
+** (no gmod13_close) must not std::terminate, so leftovers are detached.
+*/
+struct Workers : std::vector<std::thread> {
+    ~Workers() {
+        for (std::thread& w : *this)
+            if (w.joinable())
+                w.detach();
+    }
+};
+
+static Workers workers;
+static bool stopping = false;
+static size_t nthreads = 0;  /* 0 until first asked: half the cores, 1 to 4 */
+
+
+static size_t default_threads() {
+    size_t n = std::thread::hardware_concurrency() / 2;
+    return n < 1 ? 1 : n > 4 ? 4 : n;
+}
+
+
+/* stops the match once the inbox it reports to is closed */
+static Status async_cancelled(void* ud, size_t steps) {
+    (void)steps;
+    return ((AsyncInbox*)ud)->closed.load(std::memory_order_relaxed) ? STATUS_STOPPED : STATUS_OK;
+}
+
+
+/*
+** The task's limits, plus a stop once the inbox it reports to is closed
+** or its cancel flag is set.
+*/
+static Limits async_limits(const AsyncTask& t, AsyncInbox* inbox) {
+    Limits limits;
+    limits.timeout_ns = t.timeout_ns;
+    limits.cancel = t.cancel.get();
+    limits.callback = async_cancelled;
+    limits.ud = inbox;
+    return limits;
+}
+
+
+/* appends the captures of 'm' (or the whole match if it has none and 'whole' is set) */
+static void add_captures(const Match& m, bool whole, AsyncResult& r) {
+    if (m.ncaptures == 0 && whole) {
+        r.width = 1;
+        r.caps.push_back(m.whole);
+    } else {
+        r.width = m.ncaptures;
+        r.caps.insert(r.caps.end(), m.captures, m.captures + m.ncaptures);
+    }
+}
+
+
+static void run_find(const AsyncTask& t, AsyncInbox* inbox, AsyncResult& r) {
+    if (!t.prog) {  /* plain search */
+        size_t at = find_plain(r.subject, t.pattern, t.init);
+        if (at != std::string_view::npos) {
+            r.found = true;
+            r.whole = Span{ at, at + t.pattern.size(), false };
+        }
+        return;
+    }
+    Match m;
+    r.status = find(*t.prog, r.subject, t.init, m, &r.found, async_limits(t, inbox));
+    if (r.status == STATUS_OK && r.found) {
+        r.whole = m.whole;
+        add_captures(m, t.kind == ASYNC_MATCH, r);
+    }
+}
+
+
+static void run_gmatch(const AsyncTask& t, AsyncInbox* inbox, AsyncResult& r) {
+    MatchIterator it(*t.prog, r.subject, t.init, async_limits(t, inbox));
+    Match m;
+    r.width = t.prog->ncaptures > 0 ? t.prog->ncaptures : 1;
+    while (it.next(m)) {
+        add_captures(m, true, r);
+        r.n++;
+    }
+    r.status = it.status();
+}
+
+
+static void run_gsub(const AsyncTask& t, AsyncInbox* inbox, AsyncResult& r) {
+    r.status = gsub(*t.prog, r.subject, *t.repl, t.max_s, r.out, &r.n,
+        async_limits(t, inbox), &r.status_arg);
+}
+
+
+static void run_task(Queued& q, AsyncResult& r) {
+    AsyncTask& t = q.task;
+    r.kind = t.kind;
+    r.ref = t.ref;
+    r.subject = std::move(t.subject);
+    if (t.cancel && t.cancel->load(std::memory_order_relaxed)) {  /* cancelled while queued */
+        r.status = STATUS_STOPPED;
+        return;
+    }
+    switch (t.kind) {
+    case ASYNC_FIND:
+    case ASYNC_MATCH: run_find(t, q.inbox.get(), r); break;
+    case ASYNC_GMATCH: run_gmatch(t, q.inbox.get(), r); break;
+    case ASYNC_GSUB: run_gsub(t, q.inbox.get(), r); break;
+    }
+}
+
+
+static void worker_main() {
+    for (;;) {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        pool_cv.wait(lock, [] { return stopping || !queue.empty(); });
+        if (stopping)
+            return;
+        Queued q = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+        AsyncInbox& inbox = *q.inbox;
+        if (!inbox.closed.load()) {
+            AsyncResult r;
+            run_task(q, r);
+            q.task.prog.reset();  /* may free the program; not under any lock */
+            q.task.repl.reset();
+            q.task.cancel.reset();
+            if (!inbox.closed.load()) {
+                std::lock_guard<std::mutex> in(inbox.mutex);
+                inbox.done.push_back(std::move(r));
+            }
+        }
+        inbox.pending--;
+    }
+}
+
+
+/* call with 'pool_mutex' held */
+static void start_workers() {
+    if (nthreads == 0)
+        nthreads = default_threads();
+    while (workers.size() < nthreads)
+        workers.emplace_back(worker_main);
+}
+
+
+/* lets the workers finish their current task and joins them; queued tasks stay */
+static void stop_workers() {
+    std::vector<std::thread> old;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        stopping = true;
+        old.swap(workers);
+    }
+    pool_cv.notify_all();
+    for (std::thread& w : old)
+        w.join();
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    stopping = false;
+}
+
+
+void async_submit(const std::shared_ptr<AsyncInbox>& inbox, AsyncTask&& t) {
+    inbox->pending++;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        queue.push_back(Queued{ inbox, std::move(t) });
+        start_workers();
+    }
+    pool_cv.notify_one();
+}
+
+
+bool async_take(AsyncInbox& inbox, AsyncResult& r) {
+    std::lock_guard<std::mutex> lock(inbox.mutex);
+    if (inbox.done.empty())
+        return false;
+    r = std::move(inbox.done.front());
+    inbox.done.pop_front();
+    return true;
+}
+
+
+void async_shutdown() {
+    stop_workers();
+    batch_shutdown();
+    std::deque<Queued> dropped;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        dropped.swap(queue);
+    }
+    for (Queued& q : dropped)
+        q.inbox->pending--;
+}
+
+
+size_t get_async_threads() {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    return nthreads > 0 ? nthreads : default_threads();
+}
+
+
+void set_async_threads(size_t n) {
+    bool running;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        nthreads = n > 0 ? n : 1;
+        running = !workers.empty();
+        if (!running || workers.size() == nthreads)
+            return;
+    }
+    stop_workers();  /* restart with the new count */
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (!queue.empty())
+        start_workers();
+}
+
+}  // namespace chadregex
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "chadregex.h"
+
+namespace chadregex {
+
+/*
+** Matching off the game thread. A task carries its own copy of the
+** subject, a shared reference to the compiled program and plain numbers,
+** so workers never touch a lua_State; finished tasks come back as
+** AsyncResults in the inbox they were submitted with, and the binding
+** turns them into Lua values when it polls.
+*/
+
+enum AsyncKind { ASYNC_FIND, ASYNC_MATCH, ASYNC_GSUB, ASYNC_GMATCH };
+
+struct AsyncTask {
+    AsyncKind kind;
+    std::string subject;
+    std::shared_ptr<const Program> prog;
+    std::string pattern;  /* plain find only (prog is NULL) */
+    std::shared_ptr<const Replacement> repl;  /* gsub replacement template */
+    size_t init = 0;  /* start offset (find/match/gmatch) */
+    size_t max_s = 0;  /* gsub: max replacements */
+    uint64_t timeout_ns = 0;  /* 0 for none */
+    std::shared_ptr<const std::atomic<bool>> cancel;  /* stops the task once set; may be NULL */
+    int ref = 0;  /* opaque to the pool (the binding's callback reference) */
+};
+
+struct AsyncResult {
+    AsyncKind kind;
+    int ref;
+    Status status = STATUS_OK;  /* STATUS_OK or why matching failed */
+    int status_arg = 0;  /* capture number for STATUS_CAPTURE_INDEX */
+    std::string subject;  /* the task's subject, the spans point into it */
+    bool found = false;  /* find/match */
+    Span whole;  /* find: the match */
+    size_t width = 0;  /* captures per match */
+    std::vector<Span> caps;  /* 'width' per match, matches in order */
+    std::string out;  /* gsub */
+    size_t n = 0;  /* gsub: replacements; gmatch: matches */
+};
+
+/*
+** Where finished tasks of one Lua state go. Once closed, queued tasks of
+** this inbox are dropped and running ones are stopped at their next check.
+*/
+struct AsyncInbox {
+    std::mutex mutex;
+    std::deque<AsyncResult> done;
+    std::atomic<bool> closed{ false };
+    std::atomic<size_t> pending{ 0 };  /* submitted, not yet in 'done' */
+};
+
+/* queues 't'; its result will be put in 'inbox' */
+void async_submit(const std::shared_ptr<AsyncInbox>& inbox, AsyncTask&& t);
+
+/* pops the oldest finished result of 'inbox'; false if there is none */
+bool async_take(AsyncInbox& inbox, AsyncResult& r);
+
+/* stops the workers (they finish their current task first), and the batch pool's threads */
+void async_shutdown();
+
+/* worker count; takes effect from the next submit */
+size_t get_async_threads();
+void set_async_threads(size_t n);
+
+}  // namespace chadregex
@@ -0,0 +1,238 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "clock.h"
+
+namespace chadregex {
+
+#if !defined(BATCH_CHUNK)
+#define BATCH_CHUNK	16  /* subjects a thread takes at a time */
+#endif
+
+#if !defined(BATCH_BYTES_PER_THREAD)
+#define BATCH_BYTES_PER_THREAD	(64 * 1024)  /* less subject than this does not pay for a thread */
+#endif
+
+struct Batch {
+    const Program* prog;
+    const std::string_view* subjects;
+    size_t n;
+    ptrdiff_t init;
+    BatchResults* r;
+    const Limits* limits;
+    uint64_t deadline;  /* clock_ns() value; 0 for none */
+    std::atomic<size_t> next{ 0 };  /* first subject no thread has taken */
+    std::atomic<bool> stop{ false };
+    std::atomic<size_t> decided{ 0 };
+    std::atomic<size_t> steps{ 0 };
+    std::atomic<uint64_t> busy_ns{ 0 };
+    std::mutex mutex;  /* guards 'status' */
+    Status status = STATUS_OK;
+    size_t running = 0;  /* helpers working on it; guarded by 'pool_mutex' */
+};
+
+
+/*
+** Helper threads, started on first use and kept until batch_shutdown;
+** never more than one less than the cores, as the calling thread works
+** too. A batch queues one entry per helper it wants. Entries no helper
+** has taken when the caller runs out of subjects are withdrawn, so the
+** caller only waits for helpers that are still working on its chunks.
+*/
+struct Helpers : std::vector<std::thread> {
+    ~Helpers() {  /* no batch_shutdown (see async.cpp): must not std::terminate */
+        for (std::thread& h : *this)
+            if (h.joinable())
+                h.detach();
+    }
+};
+
+static std::mutex pool_mutex;
+static std::condition_variable pool_cv;  /* an entry was queued, or stopping */
+static std::condition_variable idle_cv;  /* a helper left a batch */
+static std::deque<Batch*> queue;
+static Helpers helpers;
+static bool stopping = false;
+
+
+/* stops the matches of the other threads once one failed, then asks the caller's callback */
+static Status batch_check(void* ud, size_t steps) {
+    Batch* b = (Batch*)ud;
+    if (b->stop.load(std::memory_order_relaxed))
+        return STATUS_STOPPED;
+    const Limits* limits = b->limits;
+    return limits->callback != NULL ? limits->callback(limits->ud, steps) : STATUS_OK;
+}
+
+
+/* keeps the first failure (later ones are mostly the stop it causes) and stops everyone */
+static void batch_fail(Batch* b, Status st) {
+    {
+        std::lock_guard<std::mutex> lock(b->mutex);
+        if (b->status == STATUS_OK)
+            b->status = st;
+    }
+    b->stop.store(true, std::memory_order_relaxed);
+}
+
+
+static size_t subject_init(std::string_view s, ptrdiff_t init) {
+    if (init >= 0)
+        return (size_t)init;
+    return (size_t)-init > s.size() ? 0 : s.size() + init;
+}
+
+
+/* takes chunks of subjects until there are none left or the batch stops */
+static void batch_run(Batch* b) {
+    const Limits& limits = *b->limits;
+    BatchResults& r = *b->r;
+    size_t steps = 0, total_steps = 0, decided = 0;
+    Limits sub;
+    sub.every = limits.every;
+    sub.callback = batch_check;
+    sub.ud = b;
+    sub.cancel = limits.cancel;
+    sub.steps = &steps;
+    uint64_t start = clock_ns();
+    Match m;
+    for (;;) {
+        size_t i = b->next.fetch_add(BATCH_CHUNK, std::memory_order_relaxed);
+        if (i >= b->n)
+            break;
+        size_t end = i + BATCH_CHUNK < b->n ? i + BATCH_CHUNK : b->n;
+        for (; i < end; i++) {
+            bool found;
+            if (b->stop.load(std::memory_order_relaxed))
+                goto done;
+            if (limits.cancel != NULL && limits.cancel->load(std::memory_order_relaxed)) {
+                batch_fail(b, STATUS_STOPPED);
+                goto done;
+            }
+            if (b->deadline != 0) {
+                uint64_t now = clock_ns();
+                if (now >= b->deadline) {
+                    batch_fail(b, STATUS_TIMEOUT);
+                    goto done;
+                }
+                sub.timeout_ns = b->deadline - now;
+            }
+            std::string_view s = b->subjects[i];
+            Status st = find(*b->prog, s, subject_init(s, b->init), m, &found, sub);
+            total_steps += steps;
+            if (st != STATUS_OK) {
+                batch_fail(b, st);
+                goto done;
+            }
+            if (found) {
+                Span* out = &r.spans[i * r.width];
+                out[0] = m.whole;
+                for (int k = 0; k < m.ncaptures && (size_t)k + 1 < r.width; k++)
+                    out[k + 1] = m.captures[k];
+                r.outcome[i] = BATCH_MATCH;
+            } else
+                r.outcome[i] = BATCH_NOMATCH;
+            decided++;
+        }
+    }
+done:
+    b->decided += decided;
+    b->steps += total_steps;
+    b->busy_ns += clock_ns() - start;
+}
+
+
+static void helper_main() {
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    for (;;) {
+        pool_cv.wait(lock, [] { return stopping || !queue.empty(); });
+        if (stopping)
+            return;
+        Batch* b = queue.front();
+        queue.pop_front();
+        b->running++;
+        lock.unlock();
+        batch_run(b);
+        lock.lock();
+        if (--b->running == 0)
+            idle_cv.notify_all();
+    }
+}
+
+
+/* threads worth using: at most 'threads' and the cores, and one per BATCH_BYTES_PER_THREAD of subject */
+static size_t batch_threads(const std::string_view* subjects, size_t n, size_t threads) {
+    if (threads <= 1 || n <= BATCH_CHUNK)  /* one chunk (or none) is the caller's */
+        return 1;
+    size_t cores = std::thread::hardware_concurrency();
+    if (cores > 0 && threads > cores)
+        threads = cores;
+    size_t chunks = (n + BATCH_CHUNK - 1) / BATCH_CHUNK;
+    if (threads > chunks)
+        threads = chunks;
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; i++)
+        bytes += subjects[i].size();
+    size_t by_size = 1 + bytes / BATCH_BYTES_PER_THREAD;
+    return threads < by_size ? threads : by_size;
+}
+
+
+Status find_many(const Program& prog, const std::string_view* subjects, size_t n,
+    ptrdiff_t init, BatchResults& r, size_t threads, const Limits& limits) {
+    r.width = 1 + (size_t)prog.ncaptures;
+    r.spans.assign(n * r.width, Span());
+    r.outcome.assign(n, BATCH_UNDECIDED);
+    Batch b;
+    b.prog = &prog;
+    b.subjects = subjects;
+    b.n = n;
+    b.init = init;
+    b.r = &r;
+    b.limits = &limits;
+    b.deadline = limits.timeout_ns > 0 ? clock_ns() + limits.timeout_ns : 0;
+    size_t want = batch_threads(subjects, n, threads) - 1;  /* helpers */
+    if (want > 0) {
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            while (helpers.size() < want)
+                helpers.emplace_back(helper_main);
+            queue.insert(queue.end(), want, &b);
+        }
+        pool_cv.notify_all();
+    }
+    batch_run(&b);
+    if (want > 0) {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        queue.erase(std::remove(queue.begin(), queue.end(), &b), queue.end());
+        idle_cv.wait(lock, [&b] { return b.running == 0; });
+    }
+    r.decided = b.decided;
+    r.busy_ns = b.busy_ns;
+    if (limits.steps != NULL)
+        *limits.steps = b.steps;
+    return b.status;
+}
+
+
+void batch_shutdown() {
+    std::vector<std::thread> old;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        stopping = true;
+        old.swap(helpers);
+    }
+    pool_cv.notify_all();
+    for (std::thread& h : old)
+        h.join();
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    stopping = false;
+}
+
+}  // namespace chadregex
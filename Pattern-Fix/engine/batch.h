@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+#include "chadregex.h"
+
+namespace chadregex {
+
+/*
+** One program over many subjects in one call. Subjects are handed out
+** in small chunks to the calling thread and, for batches large enough to
+** pay for them, up to 'threads - 1' threads of a pool kept between calls;
+** the subjects must stay valid and unchanged until it returns.
+**
+** The limits hold for the whole batch: 'timeout_ns' is one deadline
+** shared by every subject, 'steps' receives the sum. Once the deadline
+** passes, 'cancel' is set or a subject fails, the other threads stop at
+** their next check and the subjects not finished are left undecided.
+** 'callback' may be called from several threads at once.
+*/
+
+enum BatchOutcome : unsigned char {
+    BATCH_UNDECIDED,  /* not reached, or stopped before it was decided */
+    BATCH_NOMATCH,
+    BATCH_MATCH,
+};
+
+struct BatchResults {
+    size_t width = 0;  /* spans per subject: the whole match, then each capture */
+    std::vector<Span> spans;  /* 'width' per subject, set for BATCH_MATCH */
+    std::vector<unsigned char> outcome;  /* a BatchOutcome per subject */
+    size_t decided = 0;
+    uint64_t busy_ns = 0;  /* time spent matching, summed over the threads */
+};
+
+/*
+** 'find' of 'prog' in each of the 'n' subjects from 'init' (negative
+** counts from the end, as Lua's init; a subject shorter than a negative
+** 'init' is searched from its start). Returns STATUS_OK, or why the
+** batch stopped: the first failure of any subject.
+*/
+Status find_many(const Program& prog, const std::string_view* subjects, size_t n,
+    ptrdiff_t init, BatchResults& r, size_t threads = 1, const Limits& limits = Limits());
+
+/* stops the pool's threads (async_shutdown calls it); the next batch starts them again */
+void batch_shutdown();
+
+}  // namespace chadregex
@@ -0,0 +1,114 @@
+#include "budget.h"
+
+#include <mutex>
+#include <unordered_map>
+
+#include "clock.h"
+
+namespace chadregex {
+
+#if !defined(BUDGET_NS)
+#define BUDGET_NS	10000000  /* 10 ms ... */
+#endif
+
+#if !defined(BUDGET_PERIOD_NS)
+#define BUDGET_PERIOD_NS	15000000  /* ... per 15 ms, one tick at 66 ticks/s */
+#endif
+
+
+struct Bucket {
+    int64_t tokens;  /* ns left; negative while in debt */
+    uint64_t stamp;  /* clock_ns() of the last refill */
+};
+
+static std::mutex budget_mutex;
+static std::unordered_map<long long, Bucket> buckets;
+static uint64_t budget_ns = BUDGET_NS;
+static uint64_t budget_period_ns = BUDGET_PERIOD_NS;
+static uint64_t last_sweep = 0;  /* clock_ns() of the last 'sweep' */
+
+
+/* adds what 'b' gained since its last refill, up to a full bucket */
+static void top_up(Bucket& b, uint64_t now) {
+    double gained = (double)(now - b.stamp) * (double)budget_ns / (double)budget_period_ns;
+    if (gained >= (double)budget_ns - (double)b.tokens)
+        b.tokens = (int64_t)budget_ns;
+    else
+        b.tokens += (int64_t)gained;
+    b.stamp = now;
+}
+
+
+/*
+** Drops the buckets that are full again, at most once per period: a
+** full bucket is what an unknown owner gets, so owners that stopped
+** matching (or ids that were only queried) cost nothing for long.
+** Call with the mutex held.
+*/
+static void sweep(uint64_t now) {
+    if (now - last_sweep < budget_period_ns)
+        return;
+    last_sweep = now;
+    for (auto it = buckets.begin(); it != buckets.end();) {
+        top_up(it->second, now);
+        if (it->second.tokens >= (int64_t)budget_ns)
+            it = buckets.erase(it);
+        else
+            ++it;
+    }
+}
+
+
+uint64_t budget_available(long long owner) {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    uint64_t now = clock_ns();
+    sweep(now);
+    auto it = buckets.find(owner);
+    if (it == buckets.end())
+        return budget_ns;  /* full; not stored until it is charged */
+    Bucket& b = it->second;
+    top_up(b, now);
+    return b.tokens > 0 ? (uint64_t)b.tokens : 0;
+}
+
+
+void budget_charge(long long owner, uint64_t ns) {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    uint64_t now = clock_ns();
+    sweep(now);
+    auto it = buckets.find(owner);
+    if (it == buckets.end())
+        it = buckets.emplace(owner, Bucket{ (int64_t)budget_ns, now }).first;
+    else
+        top_up(it->second, now);
+    it->second.tokens -= (int64_t)ns;
+}
+
+
+void budget_reset(long long owner) {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    buckets.erase(owner);
+}
+
+
+uint64_t get_budget_ns() {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    return budget_ns;
+}
+
+void set_budget_ns(uint64_t ns) {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    budget_ns = ns;
+}
+
+uint64_t get_budget_period_ns() {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    return budget_period_ns;
+}
+
+void set_budget_period_ns(uint64_t ns) {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    budget_period_ns = ns > 0 ? ns : 1;
+}
+
+}  // namespace chadregex
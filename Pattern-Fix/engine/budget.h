@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace chadregex {
+
+/*
+** Per-owner time budgets (token buckets), keyed by an opaque id such as
+** an E2 entity index. A bucket holds up to 'budget_ns' ns and refills at
+** that amount per 'budget_period_ns'; matches draw from it, and a match
+** that costs more than what was left leaves the bucket in debt, which
+** the next refills pay off first. Buckets are shared by all threads.
+*/
+
+/*
+** ns 'owner' may spend right now. Unknown owners start full and only get
+** a bucket once charged; buckets that are full again are dropped.
+*/
+uint64_t budget_available(long long owner);
+
+/* takes 'ns' from the bucket of 'owner' */
+void budget_charge(long long owner, uint64_t ns);
+
+/* forgets 'owner' (its next call starts with a full bucket), e.g. when its id is reused */
+void budget_reset(long long owner);
+
+uint64_t get_budget_ns();
+void set_budget_ns(uint64_t ns);
+uint64_t get_budget_period_ns();
+void set_budget_period_ns(uint64_t ns);
+
+}  // namespace chadregex
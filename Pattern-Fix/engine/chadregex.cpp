@@ -0,0 +1,259 @@
+#include "chadregex.h"
+
+#include <chrono>
+
+#include "dfa.h"
+#include "patternset.h"
+#include "scan.h"
+#include "stats.h"
+
+namespace chadregex {
+
+#if !defined(CR_CALLBACK_EVERY)
+#define CR_CALLBACK_EVERY	4096  /* steps between callback calls without a timeout */
+#endif
+
+
+static void apply_limits(MatchState* ms, const Limits& limits) {
+    if (limits.timeout_ns > 0) {
+        setup_deadline(ms, std::chrono::nanoseconds((long long)limits.timeout_ns), limits.every);
+        ms->hook.callback = limits.callback;
+        ms->hook.ud = limits.ud;
+    } else if (limits.callback != NULL)
+        setup_hook(ms, limits.every > 0 ? limits.every : CR_CALLBACK_EVERY,
+            limits.callback, limits.ud);
+    else
+        setup_hook(ms, 0, NULL, NULL);
+    if (limits.cancel != NULL)
+        watch_cancel(ms, limits.cancel);
+}
+
+
+/* returns 'st', reporting the steps of the call if asked to */
+static Status finish(const MatchState* ms, StatsProbe* probe, const Limits& limits, Status st) {
+    stats_settle(probe, ms);
+    if (limits.steps != NULL)
+        *limits.steps = hook_steps(ms);
+    return st;
+}
+
+
+/* fills 'm' from the match 's'..'e' */
+static Status get_match(const MatchState* ms, const char* s, const char* e, Match& m) {
+    m.whole.begin = s - ms->src_init;
+    m.whole.end = e - ms->src_init;
+    m.whole.position = false;
+    m.ncaptures = ms->level;
+    for (int i = 0; i < ms->level; i++) {
+        ptrdiff_t l = ms->capture[i].len;
+        Span& c = m.captures[i];
+        if (l == CAP_UNFINISHED)
+            return STATUS_UNFINISHED_CAPTURE;
+        c.begin = ms->capture[i].init - ms->src_init;
+        c.position = l == CAP_POSITION;
+        c.end = c.begin + (c.position ? 0 : l);
+    }
+    return STATUS_OK;
+}
+
+
+Status find(const Program& prog, std::string_view s, size_t init, Match& m, bool* found,
+    const Limits& limits) {
+    *found = false;
+    if (init > s.size()) {
+        if (limits.steps != NULL)
+            *limits.steps = 0;
+        return STATUS_OK;
+    }
+    MatchState ms;
+    prepstate(&ms, s.data(), s.size(), &prog);
+    apply_limits(&ms, limits);
+    StatsProbe probe;
+    stats_begin(&probe, &ms);
+    const char* s1 = s.data() + init;
+    if (!may_match(&prog, s1, ms.src_end))
+        return finish(&ms, &probe, limits, STATUS_OK);
+    const char *b, *e;
+    reprepstate(&ms);
+    switch (dfa_search(&ms, s1, &b, &e)) {
+    case DFA_MATCH:
+        *found = true;
+        return finish(&ms, &probe, limits, get_match(&ms, b, e, m));
+    case DFA_NOMATCH:
+        return finish(&ms, &probe, limits, STATUS_OK);
+    case DFA_STOPPED:
+        return finish(&ms, &probe, limits, ms.status);
+    case DFA_UNAVAILABLE:
+        break;
+    }
+    const char* last = last_start(&prog, s1, ms.src_end);
+    do {
+        const char* res;
+        if (!prog.anchor && (s1 = next_start(&prog, s1, ms.src_end)) > last)
+            break;
+        reprepstate(&ms);
+        if ((res = match(&ms, s1, prog.items.data())) != NULL) {
+            *found = true;
+            return finish(&ms, &probe, limits, get_match(&ms, s1, res, m));
+        }
+        if (ms.status != STATUS_OK)
+            return finish(&ms, &probe, limits, ms.status);
+    } while (s1++ < last && !prog.anchor);
+    return finish(&ms, &probe, limits, STATUS_OK);
+}
+
+
+Status find_any(const PatternSet& set, std::string_view s, size_t init, Match& m, int* entry,
+    const Limits& limits) {
+    *entry = -1;
+    if (init > s.size()) {
+        if (limits.steps != NULL)
+            *limits.steps = 0;
+        return STATUS_OK;
+    }
+    MatchState ms;
+    const char* start;
+    prepstate_set(&ms, s.data(), s.size());
+    apply_limits(&ms, limits);
+    StatsProbe probe;  /* a set has no program: nothing is recorded */
+    stats_begin(&probe, &ms);
+    const char* res = match_any(set, &ms, s.data() + init, &start, entry);
+    if (res == NULL) {
+        *entry = -1;
+        return finish(&ms, &probe, limits, ms.status);
+    }
+    return finish(&ms, &probe, limits, get_match(&ms, start, res, m));
+}
+
+
+size_t find_plain(std::string_view s, std::string_view needle, size_t init) {
+    if (init > s.size())
+        return std::string_view::npos;
+    const char* r = find_bytes(s.data() + init, s.data() + s.size(), needle.data(), needle.size());
+    return r != NULL ? (size_t)(r - s.data()) : std::string_view::npos;
+}
+
+
+MatchIterator::MatchIterator(const Program& prog, std::string_view s, size_t init,
+    const Limits& limits) {
+    prepstate(&ms, s.data(), s.size(), &prog);
+    apply_limits(&ms, limits);
+    stats_begin(&probe, &ms);
+    src = s.data() + (init > s.size() ? s.size() + 1 : init);
+    if (src <= ms.src_end && !may_match(&prog, src, ms.src_end))
+        src = ms.src_end + 1;  /* nothing to find */
+    last = last_start(&prog, s.data(), ms.src_end);
+}
+
+
+MatchIterator::~MatchIterator() {
+    stats_settle(&probe, &ms);
+}
+
+
+bool MatchIterator::next(Match& m) {
+    const Program* prog = ms.prog;
+    for (; src <= last; src++) {
+        const char* e;
+        if ((src = next_start(prog, src, ms.src_end)) > last)
+            break;
+        reprepstate(&ms);
+        if ((e = match(&ms, src, prog->items.data())) != NULL && e != lastmatch) {
+            ms.status = get_match(&ms, src, e, m);
+            src = lastmatch = e;
+            return ms.status == STATUS_OK;
+        }
+        if (ms.status != STATUS_OK)
+            return false;
+    }
+    return false;
+}
+
+
+Status check_replacement(std::string_view repl) {
+    std::shared_ptr<const Replacement> r;
+    return compile_replacement(repl.data(), repl.size(), r);
+}
+
+
+/* appends the expansion of 'repl' for the match 's'..'e' */
+static Status add_s(const MatchState* ms, const Replacement& repl, const char* s,
+    const char* e, std::string& out, int* arg) {
+    for (const ReplacementPart& part : repl.parts) {
+        if (part.capture == REPL_LITERAL)
+            out.append(repl.text, part.offset, part.len);
+        else if (part.capture == 0)
+            out.append(s, e - s);
+        else {
+            int l = part.capture - 1;
+            if (l >= ms->level) {
+                if (l != 0) {
+                    if (arg) *arg = l + 1;
+                    return STATUS_CAPTURE_INDEX;
+                }
+                out.append(s, e - s);  /* '%1' is the whole match without captures */
+            } else if (ms->capture[l].len == CAP_POSITION)
+                out += std::to_string((ms->capture[l].init - ms->src_init) + 1);
+            else if (ms->capture[l].len == CAP_UNFINISHED)
+                return STATUS_UNFINISHED_CAPTURE;
+            else
+                out.append(ms->capture[l].init, ms->capture[l].len);
+        }
+    }
+    return STATUS_OK;
+}
+
+
+Status gsub(const Program& prog, std::string_view s, const Replacement& repl, size_t max,
+    std::string& out, size_t* n, const Limits& limits, int* arg) {
+    *n = 0;
+    MatchState ms;
+    prepstate(&ms, s.data(), s.size(), &prog);
+    apply_limits(&ms, limits);
+    StatsProbe probe;
+    stats_begin(&probe, &ms);
+    const char* src = s.data();
+    const char* lastmatch = NULL;
+    const char* last = last_start(&prog, src, ms.src_end);
+    Status st;
+    out.reserve(out.size() + s.size());
+    if (!may_match(&prog, src, ms.src_end))
+        max = 0;  /* copy it all */
+    while (*n < max) {
+        const char* e;
+        if (!prog.anchor) {  /* copy the offsets the match cannot start at */
+            const char* c = next_start(&prog, src, ms.src_end);
+            if (c > last)
+                break;
+            out.append(src, c - src);
+            src = c;
+        }
+        reprepstate(&ms);
+        if ((e = match(&ms, src, prog.items.data())) != NULL && e != lastmatch) {
+            (*n)++;
+            if ((st = add_s(&ms, repl, src, e, out, arg)) != STATUS_OK)
+                return finish(&ms, &probe, limits, st);
+            src = lastmatch = e;
+        } else if (ms.status != STATUS_OK)
+            return finish(&ms, &probe, limits, ms.status);
+        else if (src < ms.src_end)
+            out += *src++;
+        else break;
+        if (prog.anchor) break;
+    }
+    out.append(src, ms.src_end - src);
+    return finish(&ms, &probe, limits, STATUS_OK);
+}
+
+
+Status gsub(const Program& prog, std::string_view s, std::string_view repl, size_t max,
+    std::string& out, size_t* n, const Limits& limits, int* arg) {
+    std::shared_ptr<const Replacement> r;
+    Status st = compile_replacement(repl.data(), repl.size(), r);
+    *n = 0;
+    if (st != STATUS_OK)
+        return st;
+    return gsub(prog, s, *r, max, out, n, limits, arg);
+}
+
+}  // namespace chadregex
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "matcher.h"
+#include "pattern.h"
+#include "stats.h"
+
+namespace chadregex {
+
+/*
+** The library interface: Lua string patterns over std::string_view, with
+** results as spans and every failure reported as a Status (never thrown,
+** never longjmp'd). Programs come from 'compile' and may be shared by
+** threads; everything else here is per call. Callers that need to drive
+** the matcher step by step (resume it, move its deadline) use matcher.h.
+*/
+
+/* [begin, end) in the subject; a '()' capture is an empty span with 'position' set */
+struct Span {
+    size_t begin = 0;
+    size_t end = 0;
+    bool position = false;
+};
+
+struct Match {
+    Span whole;
+    int ncaptures = 0;  /* explicit captures; 0 means the whole match stands for them */
+    Span captures[CR_MAXCAPTURES];
+};
+
+/* what may stop a call: a timeout, a hook callback, or both */
+struct Limits {
+    uint64_t timeout_ns = 0;  /* 0 for none */
+    size_t every = 0;  /* steps between checks; 0 adapts to the timeout */
+    Status (*callback)(void* ud, size_t steps) = NULL;
+    void* ud = NULL;
+    const std::atomic<bool>* cancel = NULL;  /* stops the call once set (see watch_cancel) */
+    size_t* steps = NULL;  /* if set, receives the steps the call took */
+};
+
+inline Status compile(std::string_view pattern, std::shared_ptr<const Program>& out,
+    unsigned flags = CF_NONE, int* arg = NULL) {
+    int dummy;
+    return compile(pattern.data(), pattern.size(), flags, out, arg ? arg : &dummy);
+}
+
+/*
+** First match of 'prog' in 's' starting at or after 'init'. Sets '*found'
+** and, when found, 'm'. An 'init' past the end finds nothing.
+*/
+Status find(const Program& prog, std::string_view s, size_t init, Match& m, bool* found,
+    const Limits& limits = Limits());
+
+struct PatternSet;  /* patternset.h */
+
+/*
+** Leftmost match of any entry of 'set' in 's' at or after 'init', the
+** entry listed first winning a tie. '*entry' receives its index, or -1
+** when nothing matched; a literal entry has no captures.
+*/
+Status find_any(const PatternSet& set, std::string_view s, size_t init, Match& m, int* entry,
+    const Limits& limits = Limits());
+
+/* 'str:find(pattern, init, true)': a plain substring search */
+size_t find_plain(std::string_view s, std::string_view needle, size_t init);
+
+/* successive non-overlapping matches, as gmatch (compile with CF_NOANCHOR) */
+class MatchIterator {
+public:
+    MatchIterator(const Program& prog, std::string_view s, size_t init = 0,
+        const Limits& limits = Limits());
+    ~MatchIterator();  /* the iteration counts as one call in the statistics */
+    MatchIterator(const MatchIterator&) = delete;
+    MatchIterator& operator=(const MatchIterator&) = delete;
+
+    /* the next match; false when there are no more or on error (see 'status') */
+    bool next(Match& m);
+    Status status() const { return ms.status; }
+    size_t steps() const { return hook_steps(&ms); }
+
+private:
+    MatchState ms;
+    StatsProbe probe;
+    const char* src;
+    const char* last;  /* no match starts after this */
+    const char* lastmatch = NULL;
+};
+
+/* checks the '%' escapes of a gsub replacement template */
+Status check_replacement(std::string_view repl);
+
+inline Status compile_replacement(std::string_view repl,
+    std::shared_ptr<const Replacement>& out) {
+    return compile_replacement(repl.data(), repl.size(), out);
+}
+
+/*
+** Appends 's' to 'out' with up to 'max' matches replaced by 'repl' ('%0'
+** to '%9', '%%'). '*n' receives the number of replacements; for
+** STATUS_CAPTURE_INDEX '*arg' receives the capture number.
+*/
+Status gsub(const Program& prog, std::string_view s, std::string_view repl, size_t max,
+    std::string& out, size_t* n, const Limits& limits = Limits(), int* arg = NULL);
+
+/* the same with a template compiled beforehand (see compile_replacement) */
+Status gsub(const Program& prog, std::string_view s, const Replacement& repl, size_t max,
+    std::string& out, size_t* n, const Limits& limits = Limits(), int* arg = NULL);
+
+}  // namespace chadregex
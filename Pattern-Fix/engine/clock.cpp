@@ -0,0 +1,127 @@
+#include "clock.h"
+
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CR_CLOCK_TSC
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#endif
+
+#if defined(__linux__)
+#include <time.h>
+#endif
+
+namespace chadregex {
+
+enum ClockSource { CLOCK_SRC_STEADY, CLOCK_SRC_COARSE, CLOCK_SRC_TSC };
+
+struct ClockState {
+    ClockSource source = CLOCK_SRC_STEADY;
+    uint64_t tsc_base = 0;
+    double ns_per_tick = 0;
+};
+
+
+static uint64_t steady_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+#if defined(CR_CLOCK_TSC)
+
+/* constant rate across P-states and C-states (CPUID 0x80000007, EDX bit 8) */
+static bool invariant_tsc() {
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuid(r, 0x80000000);
+    if ((unsigned)r[0] < 0x80000007u)
+        return false;
+    __cpuid(r, 0x80000007);
+    return (r[3] >> 8) & 1;
+#else
+    unsigned a, b, c, d;
+    if (__get_cpuid_max(0x80000000u, NULL) < 0x80000007u)
+        return false;
+    __cpuid(0x80000007u, a, b, c, d);
+    return (d >> 8) & 1;
+#endif
+}
+
+
+/* ticks per ns, measured over ~2 ms against steady_clock */
+static double calibrate_tsc() {
+    uint64_t t0 = steady_ns();
+    uint64_t c0 = __rdtsc();
+    uint64_t t1;
+    do {
+        t1 = steady_ns();
+    } while (t1 - t0 < 2000000);
+    uint64_t c1 = __rdtsc();
+    return (double)(t1 - t0) / (double)(c1 - c0);
+}
+
+#endif
+
+
+static ClockState init_clock() {
+    ClockState st;
+#if defined(CR_CLOCK_TSC)
+    if (invariant_tsc()) {
+        st.source = CLOCK_SRC_TSC;
+        st.ns_per_tick = calibrate_tsc();
+        st.tsc_base = __rdtsc();
+        return st;
+    }
+#endif
+#if defined(__linux__) && defined(CLOCK_MONOTONIC_COARSE)
+    struct timespec res;
+    if (clock_getres(CLOCK_MONOTONIC_COARSE, &res) == 0 &&
+        res.tv_sec == 0 && res.tv_nsec <= 1000000) {
+        st.source = CLOCK_SRC_COARSE;
+        return st;
+    }
+#endif
+    return st;
+}
+
+static const ClockState& clock_state() {
+    static const ClockState st = init_clock();
+    return st;
+}
+
+
+uint64_t clock_ns() {
+    const ClockState& st = clock_state();
+    switch (st.source) {
+#if defined(CR_CLOCK_TSC)
+    case CLOCK_SRC_TSC:
+        return (uint64_t)((double)(__rdtsc() - st.tsc_base) * st.ns_per_tick);
+#endif
+#if defined(__linux__) && defined(CLOCK_MONOTONIC_COARSE)
+    case CLOCK_SRC_COARSE: {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+    }
+#endif
+    default:
+        return steady_ns();
+    }
+}
+
+
+const char* clock_source() {
+    switch (clock_state().source) {
+    case CLOCK_SRC_TSC: return "tsc";
+    case CLOCK_SRC_COARSE: return "coarse";
+    default: return "steady";
+    }
+}
+
+}  // namespace chadregex
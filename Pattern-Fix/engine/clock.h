@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace chadregex {
+
+/*
+** Monotonic nanoseconds from the cheapest source that is precise enough
+** for match deadlines: the TSC when it is invariant (calibrated once
+** against steady_clock), else CLOCK_MONOTONIC_COARSE when its resolution
+** is 1 ms or better, else std::chrono::steady_clock.
+*/
+uint64_t clock_ns();
+
+/* "tsc", "coarse" or "steady" */
+const char* clock_source();
+
+}  // namespace chadregex
@@ -0,0 +1,492 @@
+#include "dfa.h"
+
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "scan.h"
+
+namespace chadregex {
+
+#if !defined(DFA_MAX_BYTES)
+#define DFA_MAX_BYTES	(256 * 1024)
+#endif
+
+/* flushes one search may do before it gives up */
+#define DFA_MAX_FLUSHES	3
+
+/* searches that gave up before a program stops trying its DFA */
+#define DFA_MAX_FAILURES	8
+
+/* longest pattern the DFA takes (instruction indexes are 16 bits) */
+#define DFA_MAX_ITEMS	4096
+
+
+static std::atomic<bool> dfa_enabled(true);
+
+enum InstOp : unsigned char {
+    I_BYTE,   /* a byte of sets[set], then go to x */
+    I_SPLIT,  /* go to x, or else to y */
+    I_EOS,    /* only at the end of the subject, then go to x */
+    I_MATCH
+};
+
+struct Inst {
+    InstOp op;
+    uint16_t set;
+    uint16_t x, y;
+};
+
+/* state flags */
+#define S_MATCH	1  /* a thread matched at this position */
+#define S_DONE	2  /* a thread matched here or before: no new starts */
+#define S_EOS	4  /* a thread waits for the end of the subject */
+#define S_DEAD	8  /* no thread left */
+
+struct DState {
+    std::vector<uint16_t> threads;  /* their I_BYTE and I_EOS, most preferred first */
+    unsigned char flags;
+};
+
+/* one direction of the search: its NFA and its cache of states */
+struct Direction {
+    std::vector<Inst> prog;
+    bool ordered = false;     /* leftmost-first (forward), not any match (backward) */
+    bool unanchored = false;  /* a thread starts at every position until a match */
+    /*
+    ** States go by their row in 'next' (index * nclasses), which saves the
+    ** scan loops a multiplication per byte.
+    */
+    std::vector<DState> states;
+    std::vector<int32_t> next;  /* row + class -> row, -1 if not built */
+    std::vector<unsigned char> flags;  /* row -> flags of the state */
+    std::unordered_map<std::string, int32_t> index;  /* threads and flags -> row */
+    size_t bytes = 0;
+    int32_t initial = -1;
+};
+
+struct Dfa {
+    std::atomic<bool> busy{ false };  /* a search is using the caches */
+    unsigned char classes[256] = {};  /* byte -> class (bytes no set tells apart) */
+    unsigned char reps[256] = {};     /* class -> one of its bytes */
+    bool starts[256] = {};            /* bytes in the program's start set */
+    size_t nclasses = 0;
+    std::vector<CharSet> sets;
+    Direction fwd, rev;
+    bool anchored = false;
+    int failures = 0;
+    /* scratch of 'add_threads' */
+    std::vector<uint32_t> seen;
+    uint32_t mark = 0;
+    std::vector<uint16_t> stack;
+};
+
+
+/*
+** Thompson NFA of the single-char items 'seq' (item, set) in that order,
+** with the alternatives of each quantifier in lstrlib's order: greedy
+** ones try one more repetition first, '-' tries the rest first.
+*/
+static void build_nfa(Direction& dir, const std::vector<std::pair<const Item*, uint16_t>>& seq,
+    bool eos) {
+    std::vector<uint16_t> entry(seq.size() + 1);
+    uint16_t pc = 0;
+    for (size_t i = 0; i < seq.size(); i++) {
+        entry[i] = pc;
+        pc += seq[i].first->quant == Q_ONE ? 1 : 2;
+    }
+    entry[seq.size()] = pc;
+    for (size_t i = 0; i < seq.size(); i++) {
+        uint16_t at = entry[i], next = entry[i + 1], set = seq[i].second;
+        switch (seq[i].first->quant) {
+        case Q_ONE:
+            dir.prog.push_back(Inst{ I_BYTE, set, next, 0 });
+            break;
+        case Q_OPT:
+            dir.prog.push_back(Inst{ I_SPLIT, 0, (uint16_t)(at + 1), next });
+            dir.prog.push_back(Inst{ I_BYTE, set, next, 0 });
+            break;
+        case Q_STAR:
+            dir.prog.push_back(Inst{ I_SPLIT, 0, (uint16_t)(at + 1), next });
+            dir.prog.push_back(Inst{ I_BYTE, set, at, 0 });
+            break;
+        case Q_LAZY:
+            dir.prog.push_back(Inst{ I_SPLIT, 0, next, (uint16_t)(at + 1) });
+            dir.prog.push_back(Inst{ I_BYTE, set, at, 0 });
+            break;
+        case Q_PLUS:
+            dir.prog.push_back(Inst{ I_BYTE, set, (uint16_t)(at + 1), 0 });
+            dir.prog.push_back(Inst{ I_SPLIT, 0, at, next });
+            break;
+        }
+    }
+    if (eos)
+        dir.prog.push_back(Inst{ I_EOS, 0, (uint16_t)(pc + 1), 0 });
+    dir.prog.push_back(Inst{ I_MATCH, 0, 0, 0 });
+}
+
+
+std::shared_ptr<Dfa> make_dfa(const Program& prog) {
+    if (prog.items.size() > DFA_MAX_ITEMS)
+        return NULL;
+    std::vector<std::pair<const Item*, uint16_t>> seq;
+    auto d = std::make_shared<Dfa>();
+    bool eos = false, quantified = false;
+    for (const Item& it : prog.items) {
+        CharSet cs = {};
+        switch (it.op) {
+        case OP_CHAR: cs.add(it.a); break;
+        case OP_ANY: cs.invert(); break;
+        case OP_CLASS: case OP_SET: cs = prog.sets[it.set]; break;
+        case OP_EOS: eos = true; continue;  /* always the last item */
+        case OP_MATCH: continue;
+        default: return NULL;  /* captures, '%b', '%f', back-references */
+        }
+        quantified |= it.quant != Q_ONE;
+        seq.emplace_back(&it, (uint16_t)d->sets.size());
+        d->sets.push_back(cs);
+    }
+
+    if (!quantified)  /* at most one try per item and offset: the start scan does better */
+        return NULL;
+
+    /* split the bytes into the classes no set tells apart */
+    size_t n = 1;
+    for (const CharSet& cs : d->sets) {
+        int remap[256][2];
+        memset(remap, -1, sizeof(remap));
+        size_t m = 0;
+        for (int c = 0; c < 256; c++) {
+            int& to = remap[d->classes[c]][cs.test((unsigned char)c)];
+            if (to < 0)
+                to = (int)m++;
+            d->classes[c] = (unsigned char)to;
+        }
+        n = m;
+    }
+    d->nclasses = n;
+    for (int c = 255; c >= 0; c--)
+        d->reps[d->classes[c]] = (unsigned char)c;
+    for (int c = 0; c < 256; c++) {
+        const StartSet& ss = prog.start;
+        d->starts[c] = ss.kind == StartSet::ANY ||
+            (ss.kind == StartSet::SET && ss.set.test((unsigned char)c)) ||
+            (ss.kind == StartSet::BYTES && memchr(ss.bytes, c, ss.nbytes) != NULL);
+    }
+
+    build_nfa(d->fwd, seq, eos);
+    d->fwd.ordered = true;
+    d->fwd.unanchored = !prog.anchor;
+    std::reverse(seq.begin(), seq.end());
+    build_nfa(d->rev, seq, false);  /* the forward pass already checked the '$' */
+    d->anchored = prog.anchor;
+    d->seen.assign(std::max(d->fwd.prog.size(), d->rev.prog.size()), 0);
+    return d;
+}
+
+
+static void new_mark(Dfa* d) {
+    if (++d->mark == 0) {  /* wrapped: forget the old marks */
+        std::fill(d->seen.begin(), d->seen.end(), 0);
+        d->mark = 1;
+    }
+}
+
+
+/*
+** Appends the threads reachable from 'pc' to 'out', most preferred first
+** (each instruction once per state). An ordered direction stops at a
+** match: whatever it has not reached yet is less preferred. Returns true
+** if a thread matched.
+*/
+static bool add_threads(Dfa* d, const Direction& dir, uint16_t pc, std::vector<uint16_t>& out,
+    unsigned char* flags) {
+    bool matched = false;
+    d->stack.clear();
+    d->stack.push_back(pc);
+    while (!d->stack.empty()) {
+        pc = d->stack.back();
+        d->stack.pop_back();
+        if (d->seen[pc] == d->mark)
+            continue;
+        d->seen[pc] = d->mark;
+        const Inst& in = dir.prog[pc];
+        switch (in.op) {
+        case I_BYTE:
+            out.push_back(pc);
+            break;
+        case I_EOS:
+            out.push_back(pc);
+            *flags |= S_EOS;
+            break;
+        case I_SPLIT:
+            d->stack.push_back(in.y);
+            d->stack.push_back(in.x);
+            break;
+        case I_MATCH:
+            *flags |= S_MATCH;
+            if (dir.ordered)
+                return true;
+            matched = true;
+            break;
+        }
+    }
+    return matched;
+}
+
+
+static void flush(Direction& dir) {
+    dir.states.clear();
+    dir.flags.clear();
+    dir.next.clear();
+    dir.index.clear();
+    dir.bytes = 0;
+    dir.initial = -1;
+}
+
+
+/* the row of the state with these threads and flags; -1 if the cache is full */
+static int32_t lookup(Dfa* d, Direction& dir, std::vector<uint16_t>& threads, unsigned char flags) {
+    if (!dir.ordered)  /* only the set matters */
+        std::sort(threads.begin(), threads.end());
+    if (threads.empty() && (!dir.unanchored || (flags & S_DONE)))
+        flags |= S_DEAD;
+    std::string key(1, (char)flags);
+    key.append((const char*)threads.data(), threads.size() * sizeof(uint16_t));
+    auto it = dir.index.find(key);
+    if (it != dir.index.end())
+        return it->second;
+    size_t cost = 2 * key.size() + d->nclasses * (sizeof(int32_t) + 1) + sizeof(DState) + 64;
+    if (dir.bytes + cost > DFA_MAX_BYTES && !dir.states.empty())
+        return -1;
+    int32_t row = (int32_t)dir.next.size();
+    dir.states.push_back(DState{ threads, flags });
+    dir.next.resize(row + d->nclasses, -1);
+    dir.flags.resize(row + d->nclasses, 0);
+    dir.flags[row] = flags;
+    dir.index.emplace(std::move(key), row);
+    dir.bytes += cost;
+    return row;
+}
+
+
+static int32_t initial_state(Dfa* d, Direction& dir) {
+    if (dir.initial >= 0)
+        return dir.initial;
+    std::vector<uint16_t> threads;
+    unsigned char flags = 0;
+    new_mark(d);
+    add_threads(d, dir, 0, threads, &flags);
+    if (dir.unanchored && (flags & S_MATCH))
+        flags |= S_DONE;
+    return dir.initial = lookup(d, dir, threads, flags);
+}
+
+
+/* builds the move of 'from' on byte class 'cls'; -1 if the cache is full */
+static int32_t build_next(Dfa* d, Direction& dir, int32_t from, unsigned cls) {
+    std::vector<uint16_t> threads;
+    unsigned char flags = 0;
+    unsigned char c = d->reps[cls];
+    const DState& st = dir.states[from / d->nclasses];
+    unsigned char from_flags = st.flags;
+    new_mark(d);
+    for (uint16_t pc : st.threads) {
+        const Inst& in = dir.prog[pc];
+        if (in.op != I_BYTE || !d->sets[in.set].test(c))
+            continue;
+        if (add_threads(d, dir, in.x, threads, &flags) && dir.ordered)
+            break;
+    }
+    if (dir.unanchored) {
+        if (!(from_flags & S_DONE) && !(flags & S_MATCH))  /* least preferred: a later start */
+            add_threads(d, dir, 0, threads, &flags);
+        if ((from_flags & S_DONE) || (flags & S_MATCH))
+            flags |= S_DONE;
+    }
+    int32_t to = lookup(d, dir, threads, flags);
+    if (to >= 0)
+        dir.next[(size_t)from + cls] = to;
+    return to;
+}
+
+
+/*
+** The move of 'from' on 'cls' when it is not cached yet. A full cache is
+** flushed (keeping 'from', renumbered in '*from'); -1 once a search has
+** flushed too often, which gives up on the DFA for this search.
+*/
+static int32_t miss(Dfa* d, Direction& dir, int32_t* from, unsigned cls, int* flushes) {
+    int32_t to = build_next(d, dir, *from, cls);
+    if (to >= 0)
+        return to;
+    if (++*flushes > DFA_MAX_FLUSHES)
+        return -1;
+    DState keep = dir.states[*from / d->nclasses];
+    flush(dir);
+    *from = lookup(d, dir, keep.threads, keep.flags);
+    return build_next(d, dir, *from, cls);
+}
+
+
+/* steps left until the next hook check, kept in a local as 'match_resume' does */
+struct Meter {
+    MatchState* ms;
+    size_t left;
+
+    explicit Meter(MatchState* m) : ms(m), left(m->hook.every - m->hook.count) {}
+
+    /* one step; false if the hook stopped the search */
+    bool tick() {
+        if (--left != 0)
+            return true;
+        Status st = hook_charge(ms, ms->hook.every - ms->hook.count);
+        left = ms->hook.every;
+        if (st == STATUS_OK)
+            return true;
+        ms->status = st;
+        return false;
+    }
+
+    /* writes the steps since the last check back to the hook */
+    void settle() {
+        ms->hook.count = ms->hook.every - left;
+    }
+};
+
+
+/*
+** End of the backtracker's match from 's' on. Where the state is the
+** initial one again no thread is alive but the newest start, so from a
+** byte no match starts with the scan jumps to the next one that can.
+*/
+static DfaResult forward(Dfa* d, MatchState* ms, const char* s, const char** end,
+    int* flushes) {
+    Direction& dir = d->fwd;
+    const Program* prog = ms->prog;
+    const char* e = ms->src_end;
+    const char* last = NULL;
+    Meter meter(ms);
+    int32_t init = initial_state(d, dir);
+    bool skip = dir.unanchored && !(dir.flags[init] & S_DONE);
+    const int32_t* next = dir.next.data();
+    const unsigned char* flags = dir.flags.data();
+    int32_t cur = init;
+    const char* p = s;
+    if (flags[cur] & S_MATCH)
+        last = s;
+    while (p < e) {
+        if (cur == init && skip && !d->starts[(unsigned char)*p]) {
+            p = next_start(prog, p, e);
+            if (p == e)
+                break;
+        }
+        unsigned cls = d->classes[(unsigned char)*p];
+        int32_t to = next[(size_t)cur + cls];
+        if (to < 0) {
+            size_t before = dir.states.size();
+            if ((to = miss(d, dir, &cur, cls, flushes)) < 0) {
+                meter.settle();
+                return DFA_UNAVAILABLE;
+            }
+            if (dir.states.size() < before)  /* flushed */
+                init = initial_state(d, dir);
+            next = dir.next.data();
+            flags = dir.flags.data();
+        }
+        cur = to;
+        p++;
+        if (flags[cur] & S_MATCH)
+            last = p;
+        if (!meter.tick())
+            return DFA_STOPPED;
+        if (flags[cur] & S_DEAD)
+            break;
+    }
+    meter.settle();
+    if (p == e && (flags[cur] & S_EOS))
+        last = e;
+    if (last == NULL)
+        return DFA_NOMATCH;
+    *end = last;
+    return DFA_MATCH;
+}
+
+
+/* leftmost start in [lo, e] of a match ending at 'e' (there is one) */
+static DfaResult backward(Dfa* d, MatchState* ms, const char* lo, const char* e,
+    const char** start, int* flushes) {
+    Direction& dir = d->rev;
+    const char* first = NULL;
+    Meter meter(ms);
+    int32_t cur = initial_state(d, dir);
+    const int32_t* next = dir.next.data();
+    const unsigned char* flags = dir.flags.data();
+    const char* p = e;
+    if (flags[cur] & S_MATCH)
+        first = e;
+    while (p > lo) {
+        unsigned cls = d->classes[(unsigned char)p[-1]];
+        int32_t to = next[(size_t)cur + cls];
+        if (to < 0) {
+            if ((to = miss(d, dir, &cur, cls, flushes)) < 0) {
+                meter.settle();
+                return DFA_UNAVAILABLE;
+            }
+            next = dir.next.data();
+            flags = dir.flags.data();
+        }
+        cur = to;
+        p--;
+        if (flags[cur] & S_MATCH)
+            first = p;
+        if (!meter.tick())
+            return DFA_STOPPED;
+        if (flags[cur] & S_DEAD)
+            break;
+    }
+    meter.settle();
+    if (first == NULL)  /* cannot happen after the forward pass */
+        return DFA_UNAVAILABLE;
+    *start = first;
+    return DFA_MATCH;
+}
+
+
+DfaResult dfa_search(MatchState* ms, const char* s, const char** start, const char** end) {
+    Dfa* d = ms->prog->dfa.get();
+    if (d == NULL || !get_dfa_enabled())
+        return DFA_UNAVAILABLE;
+    if (d->busy.exchange(true, std::memory_order_acquire))
+        return DFA_UNAVAILABLE;
+    if (d->failures >= DFA_MAX_FAILURES) {
+        d->busy.store(false, std::memory_order_release);
+        return DFA_UNAVAILABLE;
+    }
+    int flushes = 0;
+    DfaResult r = forward(d, ms, s, end, &flushes);
+    if (r == DFA_MATCH) {
+        if (d->anchored)
+            *start = s;
+        else
+            r = backward(d, ms, s, *end, start, &flushes);
+    }
+    if (r == DFA_UNAVAILABLE)
+        d->failures++;
+    d->busy.store(false, std::memory_order_release);
+    return r;
+}
+
+
+bool get_dfa_enabled() {
+    return dfa_enabled.load(std::memory_order_relaxed);
+}
+
+void set_dfa_enabled(bool on) {
+    dfa_enabled.store(on, std::memory_order_relaxed);
+}
+
+}  // namespace chadregex
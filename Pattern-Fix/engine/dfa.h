@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <memory>
+
+#include "matcher.h"
+#include "pattern.h"
+
+namespace chadregex {
+
+/*
+** Lazy DFA for patterns made of single-char items only, with an optional
+** '^' and '$': no captures, '%b', '%f' or back-references, and at least
+** one quantifier (without one the backtracker tries each item once per
+** offset anyway). A search reads each byte once, so no pattern of that
+** kind can make it backtrack.
+**
+** The forward pass keeps the threads of the backtracker in its order of
+** preference (earlier starts first, then greedy before lazy alternatives)
+** and drops the ones behind a thread that matched, so the last position
+** it sees a match at is where the backtracker's match ends. A backward
+** pass over the reversed pattern then finds the leftmost start of a match
+** ending there, which is where the backtracker's match starts.
+**
+** States are built on first use and cached in the program, up to
+** DFA_MAX_BYTES per direction. A search that fills the cache flushes it
+** and goes on; one that keeps flushing gives up and the caller falls back
+** to backtracking, as does a search that finds the cache in use by
+** another thread.
+*/
+struct Dfa;
+
+/* the DFA of 'prog' (states still unbuilt), or NULL if it is outside the subset */
+std::shared_ptr<Dfa> make_dfa(const Program& prog);
+
+enum DfaResult {
+    DFA_NOMATCH,
+    DFA_MATCH,        /* '*start'..'*end' is the match */
+    DFA_STOPPED,      /* the hook stopped it (ms->status says why) */
+    DFA_UNAVAILABLE,  /* no DFA, turned off, busy or overflowing: backtrack */
+};
+
+/*
+** Leftmost match of ms->prog at or after 's' (only at 's' when it is
+** anchored), the same one 'match' finds. One step per byte read, in
+** ms->hook.
+*/
+DfaResult dfa_search(MatchState* ms, const char* s, const char** start, const char** end);
+
+/* searches use the DFA when there is one (the default) */
+bool get_dfa_enabled();
+void set_dfa_enabled(bool on);
+
+}  // namespace chadregex
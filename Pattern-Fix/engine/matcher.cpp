@@ -0,0 +1,788 @@
+#include "matcher.h"
+
+#include "clock.h"
+#include "scan.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace chadregex {
+
+#if defined(__GNUC__)
+#define l_likely(x)	(__builtin_expect(((x) != 0), 1))
+#define l_unlikely(x)	(__builtin_expect(((x) != 0), 0))
+#else
+#define l_likely(x)	(x)
+#define l_unlikely(x)	(x)
+#endif
+
+#if defined(__GNUC__)
+#define l_noinline	__attribute__((noinline))
+#elif defined(_MSC_VER)
+#define l_noinline	__declspec(noinline)
+#else
+#define l_noinline
+#endif
+
+#define uchar(c)	((unsigned char)(c))
+
+#if !defined(MAX_STACK_BYTES)
+#define MAX_STACK_BYTES	(1 << 20)
+#endif
+
+/* stacks bigger than this are freed instead of going back to the pool */
+#define POOL_KEEP_BYTES	(64 << 10)
+
+#if !defined(MAX_MEMO_BYTES)
+#define MAX_MEMO_BYTES	(1 << 20)
+#endif
+
+/* adaptive deadline checks: first interval and bounds, in steps */
+#define HOOK_FIRST_EVERY	256
+#define HOOK_MIN_EVERY	16
+#define HOOK_MAX_EVERY	((size_t)1 << 24)
+
+/* check interval a cancel flag alone asks for (a load per check) */
+#define HOOK_CANCEL_EVERY	4096
+
+/* a deadline is checked about 'HOOK_SLICES' times over its quota */
+#define HOOK_SLICES	40
+
+/* backtracks a match may do on top of the subject length before memoizing */
+#if !defined(MEMO_AFTER)
+#define MEMO_AFTER	256
+#endif
+
+
+/*
+** Backtrack entry. Each pattern item runs at most once along a path, so
+** the stack depth is bounded by the pattern, not by the subject.
+*/
+enum FrameKind : unsigned char {
+    F_OPT,     /* '?': retry item p + 1 at s without the optional char */
+    F_GREEDY,  /* '*'/'+': n more repetitions after s can still be given back */
+    F_LAZY,    /* '-': try one more repetition at s */
+    F_LEVEL,   /* undo a '(': restore level n */
+    F_CLOSE,   /* undo a ')': reopen capture n */
+};
+
+struct Frame {
+    const Item* p;
+    const char* s;
+    ptrdiff_t n;
+    FrameKind kind;
+};
+
+
+static std::atomic<size_t> max_stack_bytes(MAX_STACK_BYTES);
+
+size_t get_max_stack_bytes() {
+    return max_stack_bytes.load(std::memory_order_relaxed);
+}
+
+void set_max_stack_bytes(size_t bytes) {
+    max_stack_bytes.store(bytes, std::memory_order_relaxed);
+}
+
+
+static std::atomic<size_t> max_memo_bytes(MAX_MEMO_BYTES);
+
+size_t get_max_memo_bytes() {
+    return max_memo_bytes.load(std::memory_order_relaxed);
+}
+
+void set_max_memo_bytes(size_t bytes) {
+    max_memo_bytes.store(bytes, std::memory_order_relaxed);
+}
+
+
+/*
+** Stack buffers are recycled per thread, and only taken on the first push,
+** so attempts that never backtrack cost nothing. Taking one from a free
+** list (rather than using a single thread_local stack) keeps nested
+** matches from hook callbacks safe.
+*/
+struct FrameBuffer {
+    Frame* data;
+    size_t cap;
+};
+
+static thread_local std::vector<FrameBuffer> frame_pool;
+
+FrameStack::~FrameStack() {
+    if (frames == NULL)
+        return;
+    if (cap * sizeof(Frame) <= POOL_KEEP_BYTES)
+        frame_pool.push_back(FrameBuffer{ frames, cap });
+    else
+        free(frames);
+}
+
+
+bool FrameStack::grow(size_t max) {
+    if (frames == NULL && !frame_pool.empty()) {
+        frames = frame_pool.back().data;
+        cap = frame_pool.back().cap;
+        frame_pool.pop_back();
+        return top < cap || grow(max);
+    }
+    if (top >= max)
+        return false;
+    size_t ncap = cap ? cap * 2 : 64;
+    if (ncap > max) ncap = max;
+    Frame* n = (Frame*)realloc(frames, ncap * sizeof(Frame));
+    if (n == NULL)
+        return false;
+    frames = n;
+    cap = ncap;
+    return true;
+}
+
+
+static std::atomic<bool> step_budget(false);
+static std::atomic<double> step_ns(0);
+
+bool get_step_budget() {
+    return step_budget.load(std::memory_order_relaxed);
+}
+
+void set_step_budget(bool on) {
+    if (on)
+        get_step_ns();  /* calibrate now rather than in the first match */
+    step_budget.store(on, std::memory_order_relaxed);
+}
+
+static double calibrate_step_ns();
+
+double get_step_ns() {
+    double ns = step_ns.load(std::memory_order_relaxed);
+    if (ns <= 0) {
+        ns = calibrate_step_ns();
+        step_ns.store(ns, std::memory_order_relaxed);
+    }
+    return ns;
+}
+
+void set_step_ns(double ns) {
+    step_ns.store(ns, std::memory_order_relaxed);
+}
+
+
+/*
+** Memoization. Without back-references, whether the rest of a pattern
+** matches depends only on the item and the subject position, not on how
+** we got there. So once (item, position) has been entered and backtracked
+** out of, entering it again can fail at once, which bounds the whole
+** search by #items * #positions. One bit per pair, position-major.
+**
+** The bitset is a per-thread scratch buffer that a match claims with a
+** token. A nested match (from a hook callback) or another gmatch iterator
+** may take it over in between; the first one then notices the foreign
+** token and starts over with a cleared memo, which only costs work.
+** Matches that never backtrack much do not touch it at all.
+*/
+struct MemoScratch {
+    std::vector<unsigned> bits;
+    unsigned long long owner = 0;
+    unsigned long long next_token = 0;
+};
+
+static thread_local MemoScratch memo_scratch;
+
+#define MEMO_WORD_BITS	(sizeof(unsigned) * 8)
+
+
+static size_t memo_bits(const MatchState* ms) {
+    return (size_t)(ms->src_end - ms->src_init + 1) * ms->memo_cols;
+}
+
+
+/* claims and clears the scratch bitset for 'ms' */
+static l_noinline unsigned* memo_acquire(MatchState* ms) {
+    MemoScratch& m = memo_scratch;
+    size_t words = (memo_bits(ms) + MEMO_WORD_BITS - 1) / MEMO_WORD_BITS;
+    m.bits.assign(words, 0);
+    m.owner = ms->memo_token = ++m.next_token;
+    return m.bits.data();
+}
+
+
+/* the bitset of 'ms' if it still owns it; otherwise drops the claim */
+static unsigned* memo_attach(MatchState* ms) {
+    if (memo_scratch.owner == ms->memo_token)
+        return memo_scratch.bits.data();
+    ms->memo_token = 0;
+    ms->memo_countdown = 1;  /* reclaim at the next backtrack */
+    return NULL;
+}
+
+
+/*
+** Forgets positions 'from'..'to' (a successful path only visits those),
+** so that a match rejected by the caller (gmatch/gsub skip an empty match
+** at the end of the previous one) does not poison the next attempt.
+*/
+static void memo_forget(const MatchState* ms, unsigned* memo,
+    const char* from, const char* to) {
+    size_t b = (size_t)(from - ms->src_init) * ms->memo_cols;
+    size_t e = (size_t)(to - ms->src_init + 1) * ms->memo_cols;
+    for (; b < e && b % MEMO_WORD_BITS != 0; b++)
+        memo[b / MEMO_WORD_BITS] &= ~(1u << (b % MEMO_WORD_BITS));
+    if (e - b >= MEMO_WORD_BITS) {
+        memset(memo + b / MEMO_WORD_BITS, 0, (e - b) / MEMO_WORD_BITS * sizeof(unsigned));
+        b += (e - b) / MEMO_WORD_BITS * MEMO_WORD_BITS;
+    }
+    for (; b < e; b++)
+        memo[b / MEMO_WORD_BITS] &= ~(1u << (b % MEMO_WORD_BITS));
+}
+
+
+void prepstate(MatchState* ms, const char* s, size_t ls, const Program* prog) {
+    ms->src_init = s;
+    ms->src_end = s + ls;
+    ms->prog = prog;
+    ms->sets = prog->sets.data();
+    ms->max_frames = get_max_stack_bytes() / sizeof(Frame);
+    ms->status = STATUS_OK;
+    ms->backtracks = 0;
+    ms->peak_frames = 0;
+    ms->memo_cols = 0;
+    ms->memo_countdown = (size_t)-1;
+    ms->memo_token = 0;
+    if (!prog->backrefs) {
+        size_t cols = prog->items.size();
+        if (ls < get_max_memo_bytes() * 8 / cols) {
+            ms->memo_cols = cols;
+            ms->memo_countdown = ls + MEMO_AFTER;
+        }
+    }
+}
+
+
+void reprepstate(MatchState* ms) {
+    ms->level = 0;
+    ms->hit_end = false;
+}
+
+
+void setup_hook(MatchState* ms, size_t every, Status (*callback)(void*, size_t), void* ud) {
+    MatchHook* h = &ms->hook;
+    h->every = callback == NULL ? (size_t)-1 / 2 : every > 0 ? every : 1;
+    h->count = 0;
+    h->total = 0;
+    h->limited = false;
+    h->by_steps = false;
+    h->adaptive = false;
+    h->callback = callback;
+    h->ud = ud;
+    h->cancel = NULL;
+}
+
+
+void setup_deadline(MatchState* ms, std::chrono::nanoseconds timeout, size_t every) {
+    MatchHook* h = &ms->hook;
+    uint64_t ns = timeout.count() > 0 ? (uint64_t)timeout.count() : 0;
+    setup_hook(ms, 1, NULL, NULL);
+    h->limited = true;
+    if (get_step_budget()) {
+        h->by_steps = true;
+        h->deadline = (uint64_t)((double)ns / get_step_ns());
+        if (every == 0) {  /* at most 1/20 of the budget past it */
+            uint64_t e = h->deadline / 20;
+            every = e < 1 ? 1 : e > HOOK_MAX_EVERY ? HOOK_MAX_EVERY : (size_t)e;
+        }
+        h->every = every;
+    } else {
+        h->last = clock_ns();
+        h->deadline = h->last + ns;
+        h->slice = ns / HOOK_SLICES > 0 ? ns / HOOK_SLICES : 1;
+        h->adaptive = every == 0;
+        h->every = every ? every : HOOK_FIRST_EVERY;
+    }
+}
+
+
+bool tighten_deadline(MatchState* ms, uint64_t ns) {
+    MatchHook* h = &ms->hook;
+    h->total += h->count;  /* 'every' may change below; restart the count */
+    h->count = 0;
+    if (!h->limited) {
+        h->limited = true;
+        h->by_steps = get_step_budget();
+        h->deadline = (uint64_t)-1;
+        if (h->callback == NULL) {  /* no interval fixed by a caller */
+            h->adaptive = !h->by_steps;
+            h->every = HOOK_FIRST_EVERY;
+        }
+        h->last = clock_ns();
+        h->slice = (uint64_t)-1;
+    }
+    uint64_t d;
+    if (h->by_steps) {
+        uint64_t steps = (uint64_t)((double)ns / get_step_ns());
+        d = h->total + steps;
+        if (d < h->deadline && h->callback == NULL) {
+            uint64_t e = steps / 20;
+            h->every = e < 1 ? 1 : e > HOOK_MAX_EVERY ? HOOK_MAX_EVERY : (size_t)e;
+        }
+    } else
+        d = clock_ns() + ns;
+    if (d >= h->deadline)
+        return false;
+    h->deadline = d;
+    if (h->adaptive && ns / HOOK_SLICES < h->slice)
+        h->slice = ns / HOOK_SLICES > 0 ? ns / HOOK_SLICES : 1;
+    return true;
+}
+
+
+void watch_cancel(MatchState* ms, const std::atomic<bool>* flag) {
+    MatchHook* h = &ms->hook;
+    h->cancel = flag;
+    if (flag != NULL && h->callback == NULL && !h->limited)  /* no checks yet */
+        h->every = HOOK_CANCEL_EVERY;
+}
+
+
+size_t hook_steps(const MatchState* ms) {
+    return ms->hook.total + ms->hook.count;
+}
+
+
+/*
+** Aims the next interval at 'slice' ns from the pace of the last one;
+** it at most doubles per check so a burst of cheap steps cannot push
+** the next check far past the deadline.
+*/
+static void retune(MatchHook* h, uint64_t now) {
+    uint64_t dt = now - h->last;
+    size_t next;
+    if (dt * 2 <= h->slice)
+        next = h->every * 2;
+    else
+        next = (size_t)((double)h->every * (double)h->slice / (double)dt);
+    h->every = next < HOOK_MIN_EVERY ? HOOK_MIN_EVERY
+        : next > HOOK_MAX_EVERY ? HOOK_MAX_EVERY : next;
+    h->last = now;
+}
+
+
+/* kept out of line: it runs once per 'every' steps; 'steps' since the last one */
+static l_noinline Status hook_check(MatchState* ms, size_t steps) {
+    MatchHook* h = &ms->hook;
+    h->total += steps;
+    h->count = 0;
+    if (h->cancel && h->cancel->load(std::memory_order_relaxed))
+        return STATUS_STOPPED;
+    if (h->limited) {
+        if (h->by_steps) {
+            if (h->total >= h->deadline)
+                return STATUS_TIMEOUT;
+        } else {
+            uint64_t now = clock_ns();
+            if (now >= h->deadline)
+                return STATUS_TIMEOUT;
+            if (h->adaptive)
+                retune(h, now);
+        }
+    }
+    if (h->callback)
+        return h->callback(h->ud, h->total);
+    return STATUS_OK;
+}
+
+
+Status hook_charge(MatchState* ms, size_t n) {
+    MatchHook* h = &ms->hook;
+    h->count += n;
+    if (h->count < h->every)
+        return STATUS_OK;
+    return hook_check(ms, h->count);
+}
+
+
+/*
+** Counts one step; jumps to 'stop' if the hook stops the match. The ticks
+** sit where nothing has been changed yet for the current item or frame
+** (or where the previous item is done), so 'stop' can record a point the
+** match resumes from. 'match_loop'
+** keeps the steps left until the next check in a local ('left'), which
+** is written back to hook.count on the way out. The hook may have run a
+** nested match, so the memo claim is checked again after it. Without
+** 'Checked' (nothing to check, see 'match_resume') a tick only counts:
+** the count may wrap below zero, the difference written back is right.
+*/
+#define TICK(ms, stop) \
+    if (!Checked) --left; \
+    else if (l_unlikely(--left == 0)) { \
+        (ms)->status = hook_check(ms, (ms)->hook.every); \
+        left = (ms)->hook.every; \
+        if ((ms)->status != STATUS_OK) goto stop; \
+        if (memo) memo = memo_attach(ms); }
+
+/* counts 'n' steps at once (runs measured in bulk); at most one check */
+#define TICKS(ms, n, stop) \
+    if (!Checked) left -= (size_t)(n); \
+    else if (l_unlikely((size_t)(n) >= left)) { \
+        (ms)->status = hook_check(ms, (ms)->hook.every - left + (size_t)(n)); \
+        left = (ms)->hook.every; \
+        if ((ms)->status != STATUS_OK) goto stop; \
+        if (memo) memo = memo_attach(ms); } \
+    else left -= (size_t)(n);
+
+/* writes back the step count and the statistics kept in locals */
+#define SYNC_HOOK(ms)	((ms)->hook.count = (ms)->hook.every - left, \
+    (ms)->backtracks += backtracks, (ms)->peak_frames = peak)
+
+
+static inline int singlematch(MatchState* ms, const char* s, const Item* p) {
+    if (s >= ms->src_end) {
+        ms->hit_end = true;
+        return 0;
+    } else {
+        int c = uchar(*s);
+        switch (p->op) {
+        case OP_ANY: return 1;  /* matches any char */
+        case OP_CLASS:
+        case OP_SET: return ms->sets[p->set].test((unsigned char)c);
+        default:  return (p->a == c);
+        }
+    }
+}
+
+
+/*
+** End of the run of bytes matching single-char item 'p' from 's'. Short
+** runs (the common case) are settled inline; longer ones go to the SIMD
+** span kernels.
+*/
+#define RUN_INLINE	16
+
+static inline const char* run_end(MatchState* ms, const char* s, const Item* p) {
+    const char* e = ms->src_end;
+    const char* stop = (e - s > RUN_INLINE) ? s + RUN_INLINE : e;
+    switch (p->op) {
+    case OP_ANY:
+        s = e;
+        break;
+    case OP_CHAR: {
+        while (s < stop && uchar(*s) == p->a) s++;
+        if (s == stop && s < e)
+            s = span_byte(p->a, s, e);
+        break;
+    }
+    default: {
+        const CharSet& cs = ms->sets[p->set];
+        while (s < stop && cs.test(uchar(*s))) s++;
+        if (s == stop && s < e)
+            s = span_set(cs, s, e);
+        break;
+    }
+    }
+    if (s == e)  /* the run might go on */
+        ms->hit_end = true;
+    return s;
+}
+
+
+static const char* matchbalance(MatchState* ms, const char* s,
+    const Item* p) {
+    if (s >= ms->src_end) {
+        ms->hit_end = true;
+        return NULL;
+    }
+    if (uchar(*s) != p->a) return NULL;
+    else {
+        int b = p->a;
+        int e = p->b;
+        int cont = 1;
+        while (++s < ms->src_end) {
+            if (uchar(*s) == e) {
+                if (--cont == 0) return s + 1;
+            } else if (uchar(*s) == b) cont++;
+        }
+    }
+    ms->hit_end = true;
+    return NULL;  /* string ends out of balance */
+}
+
+
+static int matchfrontier(MatchState* ms, const char* s, const Item* p) {
+    const CharSet& cs = ms->sets[p->set];
+    char previous = (s == ms->src_init) ? '\0' : *(s - 1);
+    char current = (s < ms->src_end) ? *s : '\0';
+    if (s == ms->src_end)
+        ms->hit_end = true;
+    return !cs.test(uchar(previous)) && cs.test(uchar(current));
+}
+
+
+static const char* match_capture(MatchState* ms, const char* s, int l) {
+    size_t len = ms->capture[l].len;
+    if ((size_t)(ms->src_end - s) < len)
+        ms->hit_end = true;
+    if ((size_t)(ms->src_end - s) >= len &&
+        memcmp(ms->capture[l].init, s, len) == 0)
+        return s + len;
+    else return NULL;
+}
+
+
+#define PUSH_FRAME(k, fp, fs, fn) { \
+    if (l_unlikely(stack.top == stack.cap) && !stack.grow(ms->max_frames)) { \
+        ms->status = STATUS_TOO_COMPLEX; goto overflow; } \
+    stack.frames[stack.top++] = Frame{ (fp), (fs), (fn), (k) }; }
+
+
+const char* match(MatchState* ms, const char* s, const Item* p) {
+    MatchCursor c;
+    cursor_start(&c, s, p);
+    return match_resume(ms, &c);
+}
+
+
+void cursor_start(MatchCursor* c, const char* s, const Item* p) {
+    c->stack.top = 0;
+    c->init = c->s = s;
+    c->p = p;
+    c->failing = false;
+    c->active = true;
+    c->paused = false;
+}
+
+
+/*
+** Backtracking matcher over the items of a compiled Program. Where
+** lstrlib recurses (max_expand, min_expand, captures, '?') this pushes a
+** Frame and keeps going; a failure pops frames until one of them offers
+** another alternative. Same semantics, no C recursion, no depth cap
+** besides the memory bound. 'Checked' is false when the hook can never
+** stop the match, so the hot loop only counts steps.
+*/
+template <bool Checked>
+static const char* match_loop(MatchState* ms, MatchCursor* c) {
+    FrameStack& stack = c->stack;
+    const char* s = c->s;
+    const Item* p = c->p;
+    if (Checked && c->paused && ms->hook.every - ms->hook.count < 2) {
+        /* take a step before the first check: a slice that is over on
+           entry would stop at the same point forever */
+        if (ms->hook.every < 2)
+            ms->hook.every = 2;
+        ms->hook.count = ms->hook.every - 2;
+    }
+    c->paused = false;
+    size_t left = ms->hook.every - ms->hook.count;
+    size_t backtracks = 0, peak = ms->peak_frames;
+    const char* const init = c->init;
+    const Item* const items = ms->prog->items.data();
+    unsigned* memo = ms->memo_token ? memo_attach(ms) : NULL;
+    ms->status = STATUS_OK;
+    if (c->failing)
+        goto fail;
+
+    for (;;) {
+        if (memo) {  /* been here before? then it failed */
+            size_t bit = (size_t)(s - ms->src_init) * ms->memo_cols + (size_t)(p - items);
+            unsigned mask = 1u << (bit % MEMO_WORD_BITS);
+            if (memo[bit / MEMO_WORD_BITS] & mask) goto fail;
+            memo[bit / MEMO_WORD_BITS] |= mask;
+        }
+        switch (p->op) {
+        case OP_MATCH: {  /* end of pattern */
+            if (memo) memo_forget(ms, memo, init, s);
+            if (stack.top > peak) peak = stack.top;
+            c->active = false;
+            SYNC_HOOK(ms);
+            return s;
+        }
+        case OP_OPEN:
+        case OP_POSITION: {  /* start capture */
+            PUSH_FRAME(F_LEVEL, p, NULL, ms->level);
+            ms->capture[p->a].init = s;
+            ms->capture[p->a].len = (p->op == OP_OPEN) ? CAP_UNFINISHED : CAP_POSITION;
+            ms->level = p->a + 1;
+            p++;
+            continue;
+        }
+        case OP_CLOSE: {  /* end capture */
+            PUSH_FRAME(F_CLOSE, p, NULL, p->a);
+            ms->capture[p->a].len = s - ms->capture[p->a].init;
+            p++;
+            continue;
+        }
+        case OP_EOS: {  /* check end of string */
+            if (s != ms->src_end) goto fail;
+            ms->hit_end = true;
+            p++;
+            continue;
+        }
+        case OP_BALANCE: {  /* balanced string? */
+            if ((s = matchbalance(ms, s, p)) == NULL) goto fail;
+            p++;
+            continue;
+        }
+        case OP_FRONTIER: {  /* frontier? */
+            if (!matchfrontier(ms, s, p)) goto fail;
+            p++;
+            continue;
+        }
+        case OP_BACKREF: {  /* capture results (%1-%9)? */
+            if ((s = match_capture(ms, s, p->a)) == NULL) goto fail;
+            p++;
+            continue;
+        }
+        default: {  /* pattern class plus optional suffix */
+            TICK(ms, suspend);
+            if (!singlematch(ms, s, p)) {  /* does not match at least once? */
+                if (p->quant == Q_STAR || p->quant == Q_OPT || p->quant == Q_LAZY) {
+                    p++;  /* accept empty */
+                    continue;
+                }
+                goto fail;  /* '+' or no suffix */
+            }
+            switch (p->quant) {  /* matched once; handle optional suffix */
+            case Q_ONE: {
+                s++; p++;
+                continue;
+            }
+            case Q_OPT: {  /* try with the char first, then without */
+                PUSH_FRAME(F_OPT, p, s, 0);
+                s++; p++;
+                continue;
+            }
+            case Q_LAZY: {  /* try with no repetition first */
+                PUSH_FRAME(F_LAZY, p, s, 0);
+                p++;
+                continue;
+            }
+            default: {  /* '*' or '+': take the maximum, give back on failure */
+                /* one repetition already checked; one step per byte tested */
+                ptrdiff_t i = run_end(ms, s + 1, p) - s;
+                ptrdiff_t n = i;
+                if (p->quant == Q_PLUS) {  /* first repetition is mandatory */
+                    s++; i--;
+                }
+                if (i > 0)
+                    PUSH_FRAME(F_GREEDY, p, s, i);
+                s += i; p++;
+                /* charged once the run is taken, so a resumed slice gets past it */
+                TICKS(ms, n, suspend);
+                continue;
+            }
+            }
+        }
+        }
+
+    fail:
+        if (stack.top > peak) peak = stack.top;
+        for (;;) {
+            if (stack.top == 0) {
+                c->active = false;
+                SYNC_HOOK(ms);
+                return NULL;
+            }
+            if (l_unlikely(--ms->memo_countdown == 0) && memo == NULL)
+                memo = memo_acquire(ms);
+            Frame& f = stack.frames[stack.top - 1];
+            switch (f.kind) {
+            case F_OPT: {
+                s = f.s; p = f.p + 1;
+                stack.top--;
+                break;
+            }
+            case F_GREEDY: {  /* reduce 1 repetition to try again */
+                s = f.s + --f.n; p = f.p + 1;
+                if (f.n == 0) stack.top--;
+                break;
+            }
+            case F_LAZY: {  /* try with one more repetition */
+                TICK(ms, suspend_failing);
+                if (!singlematch(ms, f.s, f.p)) {
+                    stack.top--;
+                    continue;
+                }
+                s = ++f.s; p = f.p + 1;
+                break;
+            }
+            case F_LEVEL: {  /* undo capture */
+                ms->level = (unsigned char)f.n;
+                stack.top--;
+                continue;
+            }
+            case F_CLOSE: {  /* undo capture */
+                ms->capture[f.n].len = CAP_UNFINISHED;
+                stack.top--;
+                continue;
+            }
+            }
+            backtracks++;
+            break;  /* resume at (s, p) */
+        }
+    }
+
+suspend:  /* at the entry of item 'p' at 's' */
+    c->s = s;
+    c->p = p;
+    c->failing = false;
+    c->paused = true;
+    goto stopped;
+suspend_failing:  /* before retrying the top frame */
+    c->failing = true;
+    c->paused = true;
+    goto stopped;
+overflow:
+    c->active = false;
+stopped:
+    if (stack.top > peak) peak = stack.top;
+    /* half-explored states are in the memo now; never reuse it */
+    ms->memo_token = 0;
+    ms->memo_countdown = ms->memo_cols ? 1 : (size_t)-1;
+    SYNC_HOOK(ms);
+    return NULL;
+}
+
+
+const char* match_resume(MatchState* ms, MatchCursor* c) {
+    const MatchHook* h = &ms->hook;
+    /* a deadline and a callback are told apart in 'hook_check', once per interval */
+    if (h->callback == NULL && !h->limited && h->cancel == NULL)
+        return match_loop<false>(ms, c);
+    return match_loop<true>(ms, c);
+}
+
+/*
+** Cost of one step on this machine, from a lazy and a greedy pattern that
+** backtrack over every start offset (memo off). The dearer of the two
+** wins, so a budget errs towards stopping early rather than late.
+*/
+static double calibrate_step_ns() {
+    static const char* const patterns[] = { "%a-%d", "%a*%d" };
+    std::string subject(1024, 'a');
+    double worst = 0;
+    for (const char* pat : patterns) {
+        std::shared_ptr<const Program> prog;
+        compile(pat, strlen(pat), CF_NONE, prog, NULL);
+        MatchState ms;
+        prepstate(&ms, subject.data(), subject.size(), prog.get());
+        ms.memo_cols = 0;
+        ms.memo_countdown = (size_t)-1;
+        setup_hook(&ms, 0, NULL, NULL);
+        uint64_t t0 = clock_ns();
+        for (const char* s = ms.src_init; s <= ms.src_end; s++) {
+            reprepstate(&ms);
+            match(&ms, s, prog->items.data());
+        }
+        size_t steps = hook_steps(&ms);
+        double ns = (double)(clock_ns() - t0) / (double)(steps ? steps : 1);
+        if (ns > worst)
+            worst = ns;
+    }
+    return worst > 0 ? worst : 1;
+}
+
+}  // namespace chadregex
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+#include "pattern.h"
+
+namespace chadregex {
+
+#define CAP_UNFINISHED	(-1)
+#define CAP_POSITION	(-2)
+
+
+/*
+** Step accounting. Every character test counts one step; every 'every'
+** steps the hook checks the deadline and/or calls 'callback', which may
+** stop the match by returning anything but STATUS_OK.
+**
+** Deadlines come in two flavours. By time: 'deadline' is a clock_ns()
+** value and, unless the caller fixed 'every', the interval is retuned at
+** each check so checks land about every 'slice' ns (1/40 of the quota),
+** which keeps the overshoot under 5% of the quota. By steps (the
+** "stepBudget" mode): 'deadline' is a step count converted once from
+** the quota, so results do not depend on machine load.
+*/
+struct MatchHook {
+    size_t every;    /* steps between two checks */
+    size_t count;    /* steps since the last check */
+    size_t total;    /* steps accounted by previous checks */
+    bool limited;    /* 'deadline' is set */
+    bool by_steps;   /* 'deadline' is a step count, not a clock_ns() time */
+    bool adaptive;   /* retune 'every' towards 'slice' */
+    uint64_t deadline;
+    uint64_t last;   /* clock_ns() at the previous check */
+    uint64_t slice;  /* wanted ns between checks */
+    Status (*callback)(void* ud, size_t steps);
+    void* ud;
+    const std::atomic<bool>* cancel;  /* stops the match once set; NULL for none */
+};
+
+
+/*
+** Plain data on purpose: the Lua binding keeps one inside a memset
+** userdata for gmatch. The backtrack stack lives outside of it.
+*/
+typedef struct MatchState {
+    const char* src_init;  /* init of source string */
+    const char* src_end;  /* end ('\0') of source string */
+    const Program* prog;
+    const CharSet* sets;  /* prog->sets */
+    size_t max_frames;  /* bound of the backtrack stack */
+    size_t memo_cols;  /* items per subject position, 0 if memo is off */
+    size_t memo_countdown;  /* backtracks left before the memo kicks in */
+    unsigned long long memo_token;  /* claim on the thread's memo, 0 if none */
+    Status status;  /* why 'match' returned NULL, STATUS_OK for no match */
+    size_t backtracks;  /* alternatives retried since prepstate */
+    size_t peak_frames;  /* deepest backtrack stack since prepstate */
+    unsigned char level;  /* total number of captures (finished or unfinished) */
+    bool hit_end;  /* the attempt looked at src_end: more bytes could change it */
+    struct {
+        const char* init;
+        ptrdiff_t len;
+    } capture[CR_MAXCAPTURES];
+    MatchHook hook;
+} MatchState;
+
+
+struct Frame;  /* backtrack entry, private to matcher.cpp */
+
+/* growable stack of Frames; buffers are recycled per thread */
+struct FrameStack {
+    Frame* frames = NULL;
+    size_t top = 0;
+    size_t cap = 0;
+
+    FrameStack() {}
+    FrameStack(const FrameStack&) = delete;
+    FrameStack& operator=(const FrameStack&) = delete;
+    ~FrameStack();
+
+    /* makes room for one more frame; false if that would exceed 'max' */
+    bool grow(size_t max);
+};
+
+
+/*
+** One match attempt that can be suspended and resumed. Everything the
+** matcher needs to go on (backtrack stack, resume point) lives here and
+** in the MatchState (captures, hook), not on the C stack, so a caller may
+** keep both in a heap object and resume from a later call.
+*/
+struct MatchCursor {
+    FrameStack stack;
+    const char* init = NULL;  /* where the attempt started */
+    const char* s = NULL;     /* resume point */
+    const Item* p = NULL;
+    bool failing = false;     /* resume by backtracking rather than at (s, p) */
+    bool active = false;      /* an attempt is in progress */
+    bool paused = false;      /* the hook stopped it; next call resumes */
+};
+
+
+void prepstate(MatchState* ms, const char* s, size_t ls, const Program* prog);
+void reprepstate(MatchState* ms);
+
+/* calls 'callback' every 'every' steps; NULL for no hook at all */
+void setup_hook(MatchState* ms, size_t every, Status (*callback)(void*, size_t), void* ud);
+
+/*
+** Fails the match with STATUS_TIMEOUT once 'timeout' has passed (or its
+** step equivalent in step-budget mode). 'every' fixes the check interval,
+** 0 lets it adapt.
+*/
+void setup_deadline(MatchState* ms, std::chrono::nanoseconds timeout, size_t every);
+
+/*
+** Makes sure the match stops at most 'ns' from now (or its step
+** equivalent), adding a deadline to a hook that had none. Returns true if
+** this moved the deadline earlier.
+*/
+bool tighten_deadline(MatchState* ms, uint64_t ns);
+
+/*
+** Also stops the match (STATUS_STOPPED) once '*flag' is set, tested at
+** each check without calling anything. Call it after the other setup; a
+** hook with no checks yet gets them every HOOK_CANCEL_EVERY steps.
+*/
+void watch_cancel(MatchState* ms, const std::atomic<bool>* flag);
+
+/* steps counted so far, including the ones since the last check */
+size_t hook_steps(const MatchState* ms);
+
+/*
+** Counts 'n' steps taken outside 'match' (by the DFA) and runs the check
+** if one fell due. Returns the hook's verdict; count at most the steps
+** left until the next check to keep the checks on time.
+*/
+Status hook_charge(MatchState* ms, size_t n);
+
+/*
+** Tries to match 'p' at 's'. Returns the end of the match, or NULL when
+** there is no match or the match was aborted (then ms->status says why).
+*/
+const char* match(MatchState* ms, const char* s, const Item* p);
+
+/* starts an attempt to match 'p' at 's' for 'match_resume' */
+void cursor_start(MatchCursor* c, const char* s, const Item* p);
+
+/*
+** Runs the attempt of 'c' until it matches (returns the end), fails
+** (NULL, status STATUS_OK) or the hook stops it (NULL, status says why).
+** In the last case 'c' stays active, except for STATUS_TOO_COMPLEX, and
+** calling again with the same MatchState picks up where it stopped.
+*/
+const char* match_resume(MatchState* ms, MatchCursor* c);
+
+/* memory bound of the backtrack stack, shared by all matches */
+size_t get_max_stack_bytes();
+void set_max_stack_bytes(size_t bytes);
+
+/*
+** Step-budget mode: deadlines are converted to steps at 'step_ns' ns per
+** step. get_step_ns() calibrates it on first use unless it was set.
+*/
+bool get_step_budget();
+void set_step_budget(bool on);
+double get_step_ns();
+void set_step_ns(double ns);
+
+/* memory bound of the memo bitset, 0 disables memoization */
+size_t get_max_memo_bytes();
+void set_max_memo_bytes(size_t bytes);
+
+}  // namespace chadregex
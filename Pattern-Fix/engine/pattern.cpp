@@ -0,0 +1,473 @@
+#include "pattern.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "dfa.h"
+
+namespace chadregex {
+
+#define L_ESC		'%'
+#define SPECIALS	"^$*+?.([%-"
+
+
+const char* status_message(Status st) {
+    switch (st) {
+    case STATUS_OK: return "no error";
+    case STATUS_MALFORMED_ESCAPE: return "malformed pattern (ends with '%%')";
+    case STATUS_MALFORMED_SET: return "malformed pattern (missing ']')";
+    case STATUS_MALFORMED_BALANCE: return "malformed pattern (missing arguments to '%%b')";
+    case STATUS_MALFORMED_FRONTIER: return "missing '[' after '%%f' in pattern";
+    case STATUS_CAPTURE_INDEX: return "invalid capture index %%%d";
+    case STATUS_PATTERN_CAPTURE: return "invalid pattern capture";
+    case STATUS_UNFINISHED_CAPTURE: return "unfinished capture";
+    case STATUS_TOO_MANY_CAPTURES: return "too many captures";
+    case STATUS_MALFORMED_REPLACEMENT: return "invalid use of '%%' in replacement string";
+    case STATUS_TOO_COMPLEX: return "pattern too complex";
+    case STATUS_TIMEOUT: return "Time limit exended";
+    case STATUS_STOPPED: return "Callback stop matching";
+    case STATUS_BUDGET: return "Time budget exhausted";
+    }
+    return "unknown error";
+}
+
+
+int format_status(Status st, int arg, char* buf, size_t size) {
+    return snprintf(buf, size, status_message(st), arg);
+}
+
+
+/* check whether pattern has no special characters */
+static bool nospecials(const char* p, size_t l) {
+    for (size_t i = 0; i < l; i++) {
+        if (p[i] != '\0' && strchr(SPECIALS, p[i]))
+            return false;
+    }
+    return true;
+}
+
+
+/*
+** Returns the end of the single-char class starting at 'p' (same walk as
+** lstrlib's 'classend'), or NULL if the class is malformed.
+*/
+static const char* classend(const char* p, const char* p_end, Status* st) {
+    switch (*p++) {
+    case L_ESC: {
+        if (p == p_end) {
+            *st = STATUS_MALFORMED_ESCAPE;
+            return NULL;
+        }
+        return p + 1;
+    }
+    case '[': {
+        if (*p == '^') p++;
+        do {  /* look for a ']' */
+            if (p >= p_end) {
+                *st = STATUS_MALFORMED_SET;
+                return NULL;
+            }
+            if (*(p++) == L_ESC && p < p_end)
+                p++;  /* skip escapes (e.g. '%]') */
+        } while (*p != ']');
+        return p + 1;
+    }
+    default: {
+        return p;
+    }
+    }
+}
+
+
+/* true for the letters that name a class ('%a', '%D', ...) */
+static bool isclassletter(int cl) {
+    switch (cl | 0x20) {  /* ASCII tolower */
+    case 'a': case 'c': case 'd': case 'g': case 'l': case 'p':
+    case 's': case 'u': case 'w': case 'x': case 'z':
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/* ASCII version of the <ctype.h> test behind class letter 'cl' (lower case) */
+static bool inclass(int c, int cl) {
+    bool upper = c >= 'A' && c <= 'Z';
+    bool lower = c >= 'a' && c <= 'z';
+    bool digit = c >= '0' && c <= '9';
+    bool graph = c > ' ' && c < 127;
+    switch (cl) {
+    case 'a': return upper || lower;
+    case 'c': return c < ' ' || c == 127;
+    case 'd': return digit;
+    case 'g': return graph;
+    case 'l': return lower;
+    case 'p': return graph && !(upper || lower || digit);
+    case 's': return c == ' ' || (c >= '\t' && c <= '\r');
+    case 'u': return upper;
+    case 'w': return upper || lower || digit;
+    case 'x': return digit || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+    case 'z': return c == 0;  /* deprecated option */
+    default: return false;
+    }
+}
+
+
+/* adds class 'cl' (a class letter or a literal char after '%') to 'cs' */
+static void addclass(CharSet* cs, int cl) {
+    if (!isclassletter(cl)) {
+        cs->add((unsigned char)cl);
+        return;
+    }
+    bool negate = cl >= 'A' && cl <= 'Z';
+    int lcl = cl | 0x20;
+    for (int c = 0; c < 256; c++) {
+        if (inclass(c, lcl) != negate)
+            cs->add((unsigned char)c);
+    }
+}
+
+
+/* bitmap of the '[...]' set from 'p' ('[') to 'ec' (']'), as matchbracketclass reads it */
+static CharSet bracketset(const char* p, const char* ec) {
+    CharSet cs = {};
+    bool negate = false;
+    if (*(p + 1) == '^') {
+        negate = true;
+        p++;  /* skip the '^' */
+    }
+    while (++p < ec) {
+        if (*p == L_ESC) {
+            p++;
+            addclass(&cs, (unsigned char)*p);
+        } else if ((*(p + 1) == '-') && (p + 2 < ec)) {
+            p += 2;
+            for (int c = (unsigned char)*(p - 2); c <= (unsigned char)*p; c++)
+                cs.add((unsigned char)c);
+        } else cs.add((unsigned char)*p);
+    }
+    if (negate)
+        cs.invert();
+    return cs;
+}
+
+
+static unsigned addset(Program* prog, const CharSet& cs) {
+    prog->sets.push_back(cs);
+    return (unsigned)(prog->sets.size() - 1);
+}
+
+
+/*
+** Walks the leading items collecting the bytes a non-empty match can
+** start with. Items that may match empty ('*', '?', '-', captures) let
+** the walk go on to the next one; anything that could match empty away
+** from the end of the subject, or any byte, leaves the set unrestricted.
+*/
+static void compute_start(Program* prog) {
+    CharSet cs = {};
+    for (const Item& it : prog->items) {
+        switch (it.op) {
+        case OP_OPEN: case OP_POSITION: case OP_CLOSE:
+            continue;
+        case OP_EOS:  /* the rest only matches at the end */
+            goto done;
+        case OP_BALANCE:
+            cs.add(it.a);
+            goto done;
+        case OP_FRONTIER:  /* the byte at the start must be in the set */
+            cs.merge(prog->sets[it.set]);
+            goto done;
+        case OP_CHAR:
+        case OP_CLASS:
+        case OP_SET: {
+            if (it.op == OP_CHAR)
+                cs.add(it.a);
+            else
+                cs.merge(prog->sets[it.set]);
+            if (it.quant == Q_ONE || it.quant == Q_PLUS)
+                goto done;
+            continue;
+        }
+        default:  /* OP_ANY, OP_BACKREF, OP_MATCH */
+            return;
+        }
+    }
+    return;
+
+done:
+    set_start(prog->start, cs);
+}
+
+
+/*
+** Facts every match must satisfy, for rejecting a subject before running
+** the matcher on it. Lua patterns have no alternation, so each item is
+** in every match: a run of plain characters (captures and frontiers
+** take no room between them) is a substring of the match, and so is the
+** run just before a final '$' at the end of the subject. A '+' char
+** ends a run with its first copy and starts the next with its last.
+** A run the match starts with is left out of 'must': the start-byte scan
+** already looks for it, at memchr speed.
+*/
+static void compute_required(Program* prog) {
+    std::string run;
+    bool leading = true;  /* 'run' is where the match starts */
+    for (const Item& it : prog->items) {
+        bool one = it.quant == Q_ONE || it.quant == Q_PLUS;
+        switch (it.op) {
+        case OP_CHAR: case OP_ANY: case OP_CLASS: case OP_SET:
+            if (one) prog->min_len++;
+            break;
+        case OP_BALANCE:
+            prog->min_len += 2;
+            break;
+        default:
+            break;
+        }
+        switch (it.op) {
+        case OP_FRONTIER:  /* zero width, but the start scan looks for its set */
+            leading = false;
+            continue;
+        case OP_OPEN: case OP_POSITION: case OP_CLOSE:
+            continue;  /* zero width */
+        case OP_CHAR:
+            if (it.quant == Q_ONE) {
+                run += (char)it.a;
+                continue;
+            }
+            if (it.quant == Q_PLUS) {
+                run += (char)it.a;
+                if (!leading && run.size() > prog->must.size())
+                    prog->must = run;
+                run.assign(1, (char)it.a);
+                leading = false;
+                continue;
+            }
+            break;
+        case OP_EOS:
+            prog->suffix = run;
+            break;
+        default:
+            break;
+        }
+        if (!leading && run.size() > prog->must.size())
+            prog->must = run;
+        run.clear();
+        leading = false;
+    }
+}
+
+
+void set_start(StartSet& ss, const CharSet& cs) {
+    int n = 0;
+    for (int c = 0; c < 256; c++) {
+        if (!cs.test((unsigned char)c))
+            continue;
+        if (n < 3)
+            ss.bytes[n] = (unsigned char)c;
+        n++;
+    }
+    ss.set = cs;
+    if (n == 256)
+        ss.kind = StartSet::ANY;
+    else if (n <= 3) {
+        ss.kind = StartSet::BYTES;
+        ss.nbytes = (unsigned char)n;
+    } else
+        ss.kind = StartSet::SET;
+}
+
+
+Status compile(const char* pat, size_t lp, unsigned flags,
+    std::shared_ptr<const Program>& out, int* arg) {
+    auto prog = std::make_shared<Program>();
+    prog->source.assign(pat, lp);
+    prog->literal = nospecials(pat, lp);
+
+    /* work on our own copy: it is '\0' terminated, which the walk relies on */
+    const char* const base = prog->source.c_str();
+    const char* const p_end = base + lp;
+    const char* p = base;
+
+    if (!(flags & CF_NOANCHOR) && p < p_end && *p == '^') {
+        prog->anchor = true;
+        p++;
+    }
+
+    unsigned char open[CR_MAXCAPTURES];  /* stack of unfinished captures */
+    bool closed[CR_MAXCAPTURES];
+    int nopen = 0;
+    int level = 0;
+    Status st = STATUS_OK;
+
+    while (p < p_end) {
+        Item it = {};
+        uint32_t at = (uint32_t)(p - base);
+        switch (*p) {
+        case '(': {
+            if (level >= CR_MAXCAPTURES)
+                return STATUS_TOO_MANY_CAPTURES;
+            it.a = (unsigned char)level;
+            if (p + 1 < p_end && *(p + 1) == ')') {  /* position capture? */
+                it.op = OP_POSITION;
+                closed[level] = true;
+                p += 2;
+            } else {
+                it.op = OP_OPEN;
+                closed[level] = false;
+                open[nopen++] = (unsigned char)level;
+                p++;
+            }
+            level++;
+            break;
+        }
+        case ')': {
+            if (nopen == 0)
+                return STATUS_PATTERN_CAPTURE;
+            it.op = OP_CLOSE;
+            it.a = open[--nopen];
+            closed[it.a] = true;
+            p++;
+            break;
+        }
+        case '$': {
+            if (p + 1 != p_end)  /* is the '$' the last char in pattern? */
+                goto dflt;  /* no; go to default */
+            it.op = OP_EOS;
+            p++;
+            break;
+        }
+        case L_ESC: {
+            switch (*(p + 1)) {
+            case 'b': {  /* balanced string? */
+                if (p + 2 >= p_end - 1)
+                    return STATUS_MALFORMED_BALANCE;
+                it.op = OP_BALANCE;
+                it.a = (unsigned char)*(p + 2);
+                it.b = (unsigned char)*(p + 3);
+                p += 4;
+                break;
+            }
+            case 'f': {  /* frontier? */
+                const char* ep;
+                p += 2;
+                if (*p != '[')
+                    return STATUS_MALFORMED_FRONTIER;
+                if ((ep = classend(p, p_end, &st)) == NULL)
+                    return st;
+                it.op = OP_FRONTIER;
+                it.set = addset(prog.get(), bracketset(p, ep - 1));
+                p = ep;
+                break;
+            }
+            case '0': case '1': case '2': case '3':
+            case '4': case '5': case '6': case '7':
+            case '8': case '9': {  /* capture results (%0-%9)? */
+                int l = *(p + 1) - '1';
+                if (l < 0 || l >= level || !closed[l]) {
+                    if (arg) *arg = l + 1;
+                    return STATUS_CAPTURE_INDEX;
+                }
+                it.op = OP_BACKREF;
+                it.a = (unsigned char)l;
+                prog->backrefs = true;
+                p += 2;
+                break;
+            }
+            default: goto dflt;
+            }
+            break;
+        }
+        default: dflt: {  /* pattern class plus optional suffix */
+            const char* ep = classend(p, p_end, &st);
+            if (ep == NULL)
+                return st;
+            switch (*p) {
+            case '.': it.op = OP_ANY; break;
+            case L_ESC: {
+                int cl = (unsigned char)*(p + 1);
+                if (isclassletter(cl)) {
+                    CharSet cs = {};
+                    addclass(&cs, cl);
+                    it.op = OP_CLASS;
+                    it.set = addset(prog.get(), cs);
+                } else {  /* escaped literal, e.g. '%.' */
+                    it.op = OP_CHAR;
+                    it.a = (unsigned char)cl;
+                }
+                break;
+            }
+            case '[':
+                it.op = OP_SET;
+                it.set = addset(prog.get(), bracketset(p, ep - 1));
+                break;
+            default: it.op = OP_CHAR; it.a = (unsigned char)*p; break;
+            }
+            if (ep < p_end) {
+                switch (*ep) {
+                case '?': it.quant = Q_OPT; ep++; break;
+                case '*': it.quant = Q_STAR; ep++; break;
+                case '+': it.quant = Q_PLUS; ep++; break;
+                case '-': it.quant = Q_LAZY; ep++; break;
+                default: break;
+                }
+            }
+            p = ep;
+            break;
+        }
+        }
+        prog->items.push_back(it);
+        prog->offsets.push_back(at);
+    }
+
+    if (nopen != 0)
+        return STATUS_UNFINISHED_CAPTURE;
+
+    Item end = {};
+    end.op = OP_MATCH;
+    prog->items.push_back(end);
+    prog->offsets.push_back((uint32_t)lp);
+    prog->ncaptures = (unsigned char)level;
+    compute_start(prog.get());
+    compute_required(prog.get());
+    if (!prog->literal)
+        prog->dfa = make_dfa(*prog);
+
+    out = std::move(prog);
+    return STATUS_OK;
+}
+
+
+Status compile_replacement(const char* r, size_t lr,
+    std::shared_ptr<const Replacement>& out) {
+    auto repl = std::make_shared<Replacement>();
+    repl->source.assign(r, lr);
+    repl->text.reserve(lr);
+    size_t run = 0;  /* start of the literal run in 'text' */
+    for (size_t i = 0; i < lr; i++) {
+        if (r[i] != '%') {
+            repl->text += r[i];
+            continue;
+        }
+        if (++i == lr)
+            return STATUS_MALFORMED_REPLACEMENT;
+        if (r[i] == '%') {  /* '%%' joins the literal run */
+            repl->text += '%';
+            continue;
+        }
+        if (r[i] < '0' || r[i] > '9')
+            return STATUS_MALFORMED_REPLACEMENT;
+        if (repl->text.size() > run)
+            repl->parts.push_back(ReplacementPart{ REPL_LITERAL, run, repl->text.size() - run });
+        repl->parts.push_back(ReplacementPart{ r[i] - '0', 0, 0 });
+        run = repl->text.size();
+    }
+    if (repl->text.size() > run)
+        repl->parts.push_back(ReplacementPart{ REPL_LITERAL, run, repl->text.size() - run });
+    out = std::move(repl);
+    return STATUS_OK;
+}
+
+}  // namespace chadregex
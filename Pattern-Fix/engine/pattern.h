@@ -0,0 +1,211 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace chadregex {
+
+/* maximum number of captures a pattern can have (same as LUA_MAXCAPTURES) */
+#define CR_MAXCAPTURES	32
+
+
+enum Status {
+    STATUS_OK = 0,
+    STATUS_MALFORMED_ESCAPE,    /* pattern ends with '%' */
+    STATUS_MALFORMED_SET,       /* missing ']' */
+    STATUS_MALFORMED_BALANCE,   /* missing arguments to '%b' */
+    STATUS_MALFORMED_FRONTIER,  /* missing '[' after '%f' */
+    STATUS_CAPTURE_INDEX,       /* invalid '%1'..'%9' reference */
+    STATUS_PATTERN_CAPTURE,     /* ')' without a matching '(' */
+    STATUS_UNFINISHED_CAPTURE,  /* '(' without a matching ')' */
+    STATUS_TOO_MANY_CAPTURES,
+    STATUS_MALFORMED_REPLACEMENT,  /* bad '%' in a gsub replacement string */
+    /* raised while matching */
+    STATUS_TOO_COMPLEX,         /* backtrack stack exceeded its memory bound */
+    STATUS_TIMEOUT,             /* time limit of the hook expired */
+    STATUS_STOPPED,             /* the hook callback asked to stop */
+    STATUS_BUDGET,              /* the owner's time budget ran out */
+};
+
+/*
+** printf-style message for a status; STATUS_CAPTURE_INDEX expects the
+** offending capture number as its only argument.
+*/
+const char* status_message(Status st);
+int format_status(Status st, int arg, char* buf, size_t size);
+
+
+enum Opcode : unsigned char {
+    OP_CHAR,      /* literal byte (a) */
+    OP_ANY,       /* '.' */
+    OP_CLASS,     /* '%a', '%D', ... (set = its bitmap) */
+    OP_SET,       /* '[...]' (set = its bitmap) */
+    OP_BALANCE,   /* '%bxy' (a = x, b = y) */
+    OP_FRONTIER,  /* '%f[...]' (set = its bitmap) */
+    OP_BACKREF,   /* '%1'..'%9' (a = capture index) */
+    OP_OPEN,      /* '(' (a = capture index) */
+    OP_POSITION,  /* '()' (a = capture index) */
+    OP_CLOSE,     /* ')' (a = index of the capture it closes) */
+    OP_EOS,       /* '$' as the last character of the pattern */
+    OP_MATCH      /* end of pattern */
+};
+
+enum Quantifier : unsigned char {
+    Q_ONE,   /* no suffix */
+    Q_OPT,   /* '?' */
+    Q_STAR,  /* '*' */
+    Q_PLUS,  /* '+' */
+    Q_LAZY   /* '-' */
+};
+
+struct Item {
+    unsigned char op;
+    unsigned char quant;
+    unsigned char a;
+    unsigned char b;
+    unsigned int set;      /* OP_CLASS/OP_SET/OP_FRONTIER: index in Program::sets */
+};
+
+
+/*
+** Membership bitmap of a class or a '[...]' set, one bit per byte value.
+** Classes follow the "C" locale (ASCII), whatever the process locale is.
+** 'lo'/'hi' hold the same bits indexed by low nibble, the layout the SIMD
+** lookups in scan.cpp need: bit (c >> 4) of lo[c & 15] for c < 128, bit
+** (c >> 4) - 8 of hi[c & 15] for c >= 128.
+*/
+struct CharSet {
+    uint32_t bits[8];
+    unsigned char lo[16];
+    unsigned char hi[16];
+
+    bool test(unsigned char c) const {
+        return (bits[c >> 5] >> (c & 31)) & 1;
+    }
+    void add(unsigned char c) {
+        bits[c >> 5] |= (uint32_t)1 << (c & 31);
+        if (c < 128)
+            lo[c & 15] |= (unsigned char)(1 << (c >> 4));
+        else
+            hi[c & 15] |= (unsigned char)(1 << ((c >> 4) - 8));
+    }
+    void merge(const CharSet& o) {
+        for (int i = 0; i < 8; i++) bits[i] |= o.bits[i];
+        for (int i = 0; i < 16; i++) { lo[i] |= o.lo[i]; hi[i] |= o.hi[i]; }
+    }
+    void invert() {
+        for (int i = 0; i < 8; i++) bits[i] = ~bits[i];
+        for (int i = 0; i < 16; i++) { lo[i] = (unsigned char)~lo[i]; hi[i] = (unsigned char)~hi[i]; }
+    }
+};
+
+
+/*
+** The bytes a match can start with, derived from the leading items. A
+** match at a position whose byte is not in the set can only be an empty
+** match at the end of the subject, so the callers' loops skip to the next
+** candidate (see scan.h) instead of running the matcher at every offset.
+*/
+struct StartSet {
+    enum Kind : unsigned char {
+        ANY,    /* no restriction */
+        BYTES,  /* one of 'bytes[0..nbytes)' (0 bytes: end of subject only) */
+        SET     /* a byte of 'set' */
+    };
+    Kind kind = ANY;
+    unsigned char nbytes = 0;
+    unsigned char bytes[3] = {};
+    CharSet set = {};
+};
+
+/* makes 'ss' the start set of the bytes in 'cs' */
+void set_start(StartSet& ss, const CharSet& cs);
+
+
+/* what the calls that ran a program cost (see stats.h) */
+struct PatternStats {
+    std::atomic<uint64_t> calls{ 0 };
+    std::atomic<uint64_t> steps{ 0 };
+    std::atomic<uint64_t> backtracks{ 0 };
+    std::atomic<uint64_t> peak_frames{ 0 };  /* deepest backtrack stack of a call */
+    std::atomic<uint64_t> total_ns{ 0 };
+    std::atomic<uint64_t> max_ns{ 0 };  /* longest call */
+    std::atomic<uint64_t> timeouts{ 0 };
+};
+
+struct Dfa;  /* dfa.h */
+
+
+/*
+** A parsed and validated pattern. Everything 'match' needs to know about
+** the pattern text is decided here once, so the matcher never re-scans
+** '[...]' sets or re-checks captures.
+*/
+struct Program {
+    Program();  /* listed for stats_report while alive */
+    ~Program();
+    Program(const Program&) = delete;
+    Program& operator=(const Program&) = delete;
+
+    std::string source;        /* pattern text as given (including '^') */
+    std::vector<Item> items;   /* always terminated by OP_MATCH */
+    std::vector<uint32_t> offsets;  /* where each item starts in 'source' (OP_MATCH: the end) */
+    std::vector<CharSet> sets; /* bitmaps of the class and set items */
+    StartSet start;            /* possible first bytes of a match */
+    size_t min_len = 0;        /* bytes the shortest possible match takes */
+    std::string must;          /* bytes every match contains (longest such run) */
+    std::string suffix;        /* bytes the subject must end with ('$' patterns) */
+    unsigned char ncaptures = 0;
+    bool anchor = false;       /* started with '^' (not part of 'items') */
+    bool literal = false;      /* no special characters at all */
+    bool backrefs = false;     /* uses '%1'..'%9' */
+    std::shared_ptr<Dfa> dfa;  /* for single-char items only, else NULL (see dfa.h) */
+    mutable PatternStats stats;
+};
+
+
+enum CompileFlags : unsigned {
+    CF_NONE = 0,
+    CF_NOANCHOR = 1,   /* '^' is an ordinary character (gmatch) */
+};
+
+/*
+** Parse 'p' into a program. On failure 'out' is left empty and, for
+** STATUS_CAPTURE_INDEX, '*arg' receives the capture number.
+*/
+Status compile(const char* p, size_t lp, unsigned flags,
+    std::shared_ptr<const Program>& out, int* arg);
+
+
+
+/* a piece of a gsub replacement: a run of literal text, or a capture */
+struct ReplacementPart {
+    int capture;     /* REPL_LITERAL, 0 for the whole match, 1..9 for '%n' */
+    size_t offset;   /* REPL_LITERAL: the run is text[offset, offset + len) */
+    size_t len;
+};
+
+#define REPL_LITERAL	(-1)
+
+/*
+** A gsub replacement template split once into its parts, so expanding
+** it per match is a copy per part instead of a scan for '%' escapes.
+*/
+struct Replacement {
+    std::string source;  /* template text as given */
+    std::string text;    /* the literal runs, with '%%' already undone */
+    std::vector<ReplacementPart> parts;
+};
+
+/*
+** Parse the gsub replacement 'r'. On failure (STATUS_MALFORMED_REPLACEMENT)
+** 'out' is left empty.
+*/
+Status compile_replacement(const char* r, size_t lr,
+    std::shared_ptr<const Replacement>& out);
+
+}  // namespace chadregex
@@ -0,0 +1,216 @@
+#include "patternset.h"
+
+#include <string.h>
+#include <algorithm>
+#include <deque>
+
+#include "scan.h"
+
+namespace chadregex {
+
+/* adds the literal 'e' of 'set' to the trie (before 'delta' is completed) */
+static void add_literal(PatternSet* set, int e) {
+    const std::string& text = set->entries[e].text;
+    size_t nc = set->ncolumns;
+    int32_t st = 0;
+    for (unsigned char c : text) {
+        int32_t* next = &set->delta[st * nc + set->columns[c]];
+        if (*next <= 0) {  /* no edge yet (the root is never a target) */
+            *next = (int32_t)set->accept.size();
+            set->accept.push_back(-1);
+            set->delta.resize(set->delta.size() + nc, 0);
+            next = &set->delta[st * nc + set->columns[c]];  /* 'delta' moved */
+        }
+        st = *next;
+    }
+    if (set->accept[st] < 0)  /* a duplicate keeps the first entry */
+        set->accept[st] = e;
+}
+
+
+/*
+** Turns the trie into the automaton: missing edges take the edge of the
+** failure state, and a state that ends no literal itself accepts what its
+** failure state accepts (the longest literal that is a suffix of it).
+*/
+static void build_automaton(PatternSet* set) {
+    size_t nc = set->ncolumns;
+    std::vector<int32_t> fail(set->accept.size(), 0);
+    std::deque<int32_t> queue;
+    for (size_t c = 0; c < nc; c++) {
+        if (set->delta[c] > 0)
+            queue.push_back(set->delta[c]);
+    }
+    while (!queue.empty()) {
+        int32_t u = queue.front();
+        queue.pop_front();
+        for (size_t c = 0; c < nc; c++) {
+            int32_t& v = set->delta[u * nc + c];
+            if (v <= 0) {
+                v = set->delta[fail[u] * nc + c];
+                continue;
+            }
+            fail[v] = set->delta[fail[u] * nc + c];
+            if (set->accept[v] < 0)
+                set->accept[v] = set->accept[fail[v]];
+            queue.push_back(v);
+        }
+    }
+}
+
+
+std::shared_ptr<const PatternSet> compile_set(std::vector<SetEntry> entries) {
+    auto set = std::make_shared<PatternSet>();
+    set->entries = std::move(entries);
+    CharSet pattern_bytes = {}, first_bytes = {};
+    bool pattern_any = false;
+    std::vector<int> literals;
+    for (size_t i = 0; i < set->entries.size(); i++) {
+        SetEntry& en = set->entries[i];
+        if (en.prog && en.prog->literal)
+            en.prog.reset();
+        if (en.prog) {
+            set->patterns.push_back((int)i);
+            if (en.prog->start.kind == StartSet::ANY)
+                pattern_any = true;
+            else
+                pattern_bytes.merge(en.prog->start.set);
+        } else if (en.text.empty()) {
+            if (set->empty_literal < 0)
+                set->empty_literal = (int)i;
+        } else {
+            literals.push_back((int)i);
+            first_bytes.add((unsigned char)en.text[0]);
+            set->max_literal = std::max(set->max_literal, en.text.size());
+            for (unsigned char c : en.text) {
+                if (set->columns[c] == 0)
+                    set->columns[c] = (unsigned char)set->ncolumns++;
+            }
+        }
+    }
+    if (set->ncolumns > 255) {  /* every byte occurs: no column left for "none" */
+        for (int c = 0; c < 256; c++)
+            set->columns[c] = (unsigned char)c;
+        set->ncolumns = 256;
+    }
+    if (pattern_any)
+        set->pattern_start.kind = StartSet::ANY;
+    else
+        set_start(set->pattern_start, pattern_bytes);
+    set_start(set->literal_start, first_bytes);
+
+    set->accept.push_back(-1);  /* the root */
+    set->delta.assign(set->ncolumns, 0);
+    for (int e : literals)
+        add_literal(set.get(), e);
+    build_automaton(set.get());
+    return set;
+}
+
+
+void prepstate_set(MatchState* ms, const char* s, size_t ls) {
+    memset(ms, 0, sizeof(MatchState));
+    ms->src_init = s;
+    ms->src_end = s + ls;
+    ms->status = STATUS_OK;
+    ms->memo_countdown = (size_t)-1;
+}
+
+
+/*
+** Leftmost literal at or after 's' (lowest entry on a tie): sets '*start'
+** and returns the entry, or -1. Once a literal is found the scan only
+** goes on while a longer one could still start before it.
+*/
+static int find_literal(const PatternSet& set, const char* s, const char* e,
+    const char** start) {
+    int best = set.empty_literal;
+    const char* best_start = s;
+    *start = s;
+    if (set.accept.size() == 1)  /* no literal but "" */
+        return best;
+    size_t nc = set.ncolumns;
+    const int32_t* delta = set.delta.data();
+    const char* stop = e;
+    if (best >= 0 && (size_t)(e - s) > set.max_literal)
+        stop = s + set.max_literal;
+    int32_t st = 0;
+    const char* p = s;
+    while (p < stop) {
+        if (st == 0 && set.literal_start.kind != StartSet::ANY) {  /* only a first byte leaves the root */
+            p = scan_start(set.literal_start, p, stop);
+            if (p == stop)
+                break;
+        }
+        st = delta[st * nc + set.columns[(unsigned char)*p++]];
+        int a = set.accept[st];
+        if (a < 0)
+            continue;
+        const char* b = p - set.entries[a].text.size();
+        if (best < 0 || b < best_start || (b == best_start && a < best)) {
+            best = a;
+            best_start = b;
+            if ((size_t)(e - b) > set.max_literal)
+                stop = b + set.max_literal;
+        }
+    }
+    *start = best_start;
+    return best;
+}
+
+
+const char* match_any(const PatternSet& set, MatchState* ms, const char* s,
+    const char** start, int* entry) {
+    const char* e = ms->src_end;
+    const char* lit_start = NULL;
+    int lit = find_literal(set, s, e, &lit_start);
+    if (!set.patterns.empty()) {
+        std::vector<MatchState> states(set.patterns.size());
+        for (size_t k = 0; k < states.size(); k++)
+            prepstate(&states[k], ms->src_init, e - ms->src_init,
+                set.entries[set.patterns[k]].prog.get());
+        const char* limit = lit >= 0 ? lit_start : e;  /* nothing after it can win */
+        for (const char* p = s; p <= limit; p++) {
+            if (set.pattern_start.kind != StartSet::ANY) {
+                p = scan_start(set.pattern_start, p, e);
+                if (p > limit)
+                    break;
+            }
+            for (size_t k = 0; k < states.size(); k++) {
+                int i = set.patterns[k];
+                const Program* prog = set.entries[i].prog.get();
+                if (lit >= 0 && p == lit_start && i > lit)
+                    break;  /* the literal is listed first */
+                if ((prog->anchor && p != s) ||
+                    (p < e && prog->start.kind != StartSet::ANY &&
+                        !prog->start.set.test((unsigned char)*p)))
+                    continue;
+                MatchState* st = &states[k];
+                const char* res;
+                st->hook = ms->hook;  /* one hook for all the entries */
+                reprepstate(st);
+                res = match(st, p, prog->items.data());
+                ms->hook = st->hook;
+                if (res != NULL) {
+                    ms->level = st->level;
+                    memcpy(ms->capture, st->capture, sizeof(ms->capture));
+                    *start = p;
+                    *entry = i;
+                    return res;
+                }
+                if (st->status != STATUS_OK) {
+                    ms->status = st->status;
+                    return NULL;
+                }
+            }
+        }
+    }
+    if (lit < 0)
+        return NULL;
+    ms->level = 0;
+    *start = lit_start;
+    *entry = lit;
+    return lit_start + set.entries[lit].text.size();
+}
+
+}  // namespace chadregex
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "matcher.h"
+#include "pattern.h"
+
+namespace chadregex {
+
+/* an entry of a PatternSet: a literal string or a compiled pattern */
+struct SetEntry {
+    std::string text;  /* the literal (or the pattern source) */
+    std::shared_ptr<const Program> prog;  /* NULL for a literal */
+};
+
+/*
+** Several patterns searched in one pass. Literal entries (plain strings,
+** and patterns without special characters) are merged into one
+** Aho-Corasick automaton; the other entries share one scan for the union
+** of their start bytes, so the subject is walked once however many
+** entries there are.
+*/
+struct PatternSet {
+    std::vector<SetEntry> entries;  /* in the order given */
+    std::vector<int> patterns;  /* indexes of the entries that are not literals */
+    StartSet pattern_start;  /* union of the start sets of 'patterns' */
+
+    /* the automaton: a DFA over byte columns, state 0 is the root */
+    unsigned char columns[256] = {};  /* byte -> column (0: in no literal) */
+    size_t ncolumns = 1;
+    std::vector<int32_t> delta;  /* state * ncolumns + column -> state */
+    std::vector<int32_t> accept;  /* state -> longest literal ending there, or -1 */
+    StartSet literal_start;  /* first bytes of the literals */
+    size_t max_literal = 0;  /* length of the longest literal */
+    int empty_literal = -1;  /* first "" entry, which matches anywhere */
+};
+
+/*
+** Builds the set; entries whose program is literal move into the
+** automaton. Ties between entries go to the one listed first.
+*/
+std::shared_ptr<const PatternSet> compile_set(std::vector<SetEntry> entries);
+
+/* readies 'ms' for 'match_any' over 's' (set up its hook afterwards) */
+void prepstate_set(MatchState* ms, const char* s, size_t ls);
+
+/*
+** Leftmost match of any entry of 'set' starting at or after 's', the
+** first entry listed winning a tie. Returns its end, with its start in
+** '*start' and its index in '*entry'; the captures of a pattern entry are
+** left in 'ms' (none for a literal). Returns NULL when nothing matches or
+** the hook stopped the search (then ms->status says why).
+*/
+const char* match_any(const PatternSet& set, MatchState* ms, const char* s,
+    const char** start, int* entry);
+
+}  // namespace chadregex
@@ -0,0 +1,447 @@
+#include "scan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CR_SCAN_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+namespace chadregex {
+
+#if defined(CR_SCAN_X86)
+
+/* lets GCC/Clang emit instructions above the build's baseline ISA per function */
+#if defined(__GNUC__)
+#define CR_TARGET(isa)	__attribute__((target(isa)))
+#else
+#define CR_TARGET(isa)
+#endif
+
+static inline int lowest_bit(unsigned mask) {
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return (int)i;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+#endif
+
+
+/* scalar kernels: also used for the tails of the vector ones */
+
+static const char* scan_bytes_scalar(const StartSet& ss, const char* s, const char* e) {
+    for (; s < e; s++) {
+        unsigned char c = (unsigned char)*s;
+        for (int i = 0; i < ss.nbytes; i++) {
+            if (c == ss.bytes[i])
+                return s;
+        }
+    }
+    return e;
+}
+
+/* first byte whose membership in 'cs' is 'member' */
+static const char* find_set_scalar(const CharSet& cs, bool member, const char* s, const char* e) {
+    for (; s < e; s++) {
+        if (cs.test((unsigned char)*s) == member)
+            return s;
+    }
+    return e;
+}
+
+/* first byte other than 'c' */
+static const char* span_byte_scalar(unsigned char c, const char* s, const char* e) {
+    while (s < e && (unsigned char)*s == c)
+        s++;
+    return s;
+}
+
+/* first 'p' in [s, e) with p[0] == a and p[gap] == b; bytes up to 'e + gap' are readable */
+static const char* scan_pair_scalar(unsigned char a, unsigned char b, size_t gap,
+    const char* s, const char* e) {
+    while (s < e) {
+        const char* p = (const char*)memchr(s, a, (size_t)(e - s));
+        if (p == NULL)
+            return e;
+        if ((unsigned char)p[gap] == b)
+            return p;
+        s = p + 1;
+    }
+    return e;
+}
+
+
+#if defined(CR_SCAN_X86)
+
+/* 2 or 3 bytes; a missing third byte repeats the first */
+CR_TARGET("sse2")
+static const char* scan_bytes_sse2(const StartSet& ss, const char* s, const char* e) {
+    const __m128i b0 = _mm_set1_epi8((char)ss.bytes[0]);
+    const __m128i b1 = _mm_set1_epi8((char)ss.bytes[1]);
+    const __m128i b2 = _mm_set1_epi8((char)ss.bytes[ss.nbytes > 2 ? 2 : 0]);
+    for (; e - s >= 16; s += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)s);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, b0),
+            _mm_cmpeq_epi8(v, b1)), _mm_cmpeq_epi8(v, b2));
+        unsigned mask = (unsigned)_mm_movemask_epi8(m);
+        if (mask != 0)
+            return s + lowest_bit(mask);
+    }
+    return scan_bytes_scalar(ss, s, e);
+}
+
+CR_TARGET("avx2")
+static const char* scan_bytes_avx2(const StartSet& ss, const char* s, const char* e) {
+    const __m256i b0 = _mm256_set1_epi8((char)ss.bytes[0]);
+    const __m256i b1 = _mm256_set1_epi8((char)ss.bytes[1]);
+    const __m256i b2 = _mm256_set1_epi8((char)ss.bytes[ss.nbytes > 2 ? 2 : 0]);
+    for (; e - s >= 32; s += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)s);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, b0),
+            _mm256_cmpeq_epi8(v, b1)), _mm256_cmpeq_epi8(v, b2));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask != 0)
+            return s + lowest_bit(mask);
+    }
+    return scan_bytes_sse2(ss, s, e);
+}
+
+
+CR_TARGET("sse2")
+static const char* span_byte_sse2(unsigned char c, const char* s, const char* e) {
+    const __m128i b = _mm_set1_epi8((char)c);
+    for (; e - s >= 16; s += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)s);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, b)) ^ 0xffffu;
+        if (mask != 0)
+            return s + lowest_bit(mask);
+    }
+    return span_byte_scalar(c, s, e);
+}
+
+CR_TARGET("avx2")
+static const char* span_byte_avx2(unsigned char c, const char* s, const char* e) {
+    const __m256i b = _mm256_set1_epi8((char)c);
+    for (; e - s >= 32; s += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)s);
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, b));
+        if (mask != 0)
+            return s + lowest_bit(mask);
+    }
+    return span_byte_sse2(c, s, e);
+}
+
+
+/*
+** Needle prefilter: compares a block at 's' with the first byte and the
+** block 'gap' further with the last byte, so a candidate needs both.
+*/
+CR_TARGET("sse2")
+static const char* scan_pair_sse2(unsigned char a, unsigned char b, size_t gap,
+    const char* s, const char* e) {
+    const __m128i va = _mm_set1_epi8((char)a);
+    const __m128i vb = _mm_set1_epi8((char)b);
+    for (; e - s >= 16; s += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)s);
+        __m128i y = _mm_loadu_si128((const __m128i*)(s + gap));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(y, vb)));
+        if (mask != 0)
+            return s + lowest_bit(mask);
+    }
+    return scan_pair_scalar(a, b, gap, s, e);
+}
+
+CR_TARGET("avx2")
+static const char* scan_pair_avx2(unsigned char a, unsigned char b, size_t gap,
+    const char* s, const char* e) {
+    const __m256i va = _mm256_set1_epi8((char)a);
+    const __m256i vb = _mm256_set1_epi8((char)b);
+    for (; e - s >= 32; s += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)s);
+        __m256i y = _mm256_loadu_si256((const __m256i*)(s + gap));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(x, va), _mm256_cmpeq_epi8(y, vb)));
+        if (mask != 0)
+            return s + lowest_bit(mask);
+    }
+    return scan_pair_sse2(a, b, gap, s, e);
+}
+
+
+/*
+** Bitmap lookup with two nibble shuffles ("truffle"): the low nibble of
+** each byte picks a row of 'lo' (bytes < 128) or 'hi' (bytes >= 128;
+** pshufb zeroes lanes whose index has the top bit set, which routes each
+** byte to exactly one table), and the high nibble picks the bit. The
+** result is a mask of the bytes outside the set, flipped when looking
+** for members.
+*/
+static const unsigned char nibble_bit[16] = {
+    1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+};
+
+CR_TARGET("ssse3")
+static const char* find_set_ssse3(const CharSet& cs, bool member, const char* s, const char* e) {
+    const __m128i lo = _mm_loadu_si128((const __m128i*)cs.lo);
+    const __m128i hi = _mm_loadu_si128((const __m128i*)cs.hi);
+    const __m128i bit = _mm_loadu_si128((const __m128i*)nibble_bit);
+    const __m128i top = _mm_set1_epi8((char)0x80);
+    const __m128i low4 = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    const unsigned flip = member ? 0xffffu : 0;
+    for (; e - s >= 16; s += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)s);
+        __m128i row = _mm_or_si128(_mm_shuffle_epi8(lo, v),
+            _mm_shuffle_epi8(hi, _mm_xor_si128(v, top)));
+        __m128i sel = _mm_shuffle_epi8(bit, _mm_and_si128(_mm_srli_epi16(v, 4), low4));
+        __m128i miss = _mm_cmpeq_epi8(_mm_and_si128(row, sel), zero);
+        unsigned mask = (unsigned)_mm_movemask_epi8(miss) ^ flip;
+        if (mask != 0)
+            return s + lowest_bit(mask);
+    }
+    return find_set_scalar(cs, member, s, e);
+}
+
+CR_TARGET("avx2")
+static const char* find_set_avx2(const CharSet& cs, bool member, const char* s, const char* e) {
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)cs.lo));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)cs.hi));
+    const __m256i bit = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)nibble_bit));
+    const __m256i top = _mm256_set1_epi8((char)0x80);
+    const __m256i low4 = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    const unsigned flip = member ? ~0u : 0;
+    for (; e - s >= 32; s += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)s);
+        __m256i row = _mm256_or_si256(_mm256_shuffle_epi8(lo, v),
+            _mm256_shuffle_epi8(hi, _mm256_xor_si256(v, top)));
+        __m256i sel = _mm256_shuffle_epi8(bit, _mm256_and_si256(_mm256_srli_epi16(v, 4), low4));
+        __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(row, sel), zero);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(miss) ^ flip;
+        if (mask != 0)
+            return s + lowest_bit(mask);
+    }
+    return find_set_ssse3(cs, member, s, e);
+}
+
+
+enum CpuLevel { CPU_SCALAR, CPU_SSE2, CPU_SSSE3, CPU_AVX2 };
+
+static CpuLevel detect_cpu() {
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuid(r, 0);
+    int nids = r[0];
+    __cpuid(r, 1);
+    bool sse2 = (r[3] >> 26) & 1;
+    bool ssse3 = (r[2] >> 9) & 1;
+    bool osavx = ((r[2] >> 27) & 1) && ((r[2] >> 28) & 1)  /* OSXSAVE, AVX */
+        && (_xgetbv(0) & 6) == 6;  /* XMM and YMM state enabled */
+    bool avx2 = false;
+    if (nids >= 7) {
+        __cpuidex(r, 7, 0);
+        avx2 = osavx && ((r[1] >> 5) & 1);
+    }
+#else
+    __builtin_cpu_init();
+    bool sse2 = __builtin_cpu_supports("sse2");
+    bool ssse3 = __builtin_cpu_supports("ssse3");
+    bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    if (avx2) return CPU_AVX2;
+    if (ssse3) return CPU_SSSE3;
+    if (sse2) return CPU_SSE2;
+    return CPU_SCALAR;
+}
+
+#endif
+
+
+struct ScanImpl {
+    const char* name;
+    const char* (*bytes)(const StartSet&, const char*, const char*);  /* 2 or 3 bytes */
+    const char* (*set)(const CharSet&, bool, const char*, const char*);
+    const char* (*span_byte)(unsigned char, const char*, const char*);
+    const char* (*pair)(unsigned char, unsigned char, size_t, const char*, const char*);
+};
+
+static ScanImpl pick_impl() {
+#if defined(CR_SCAN_X86)
+    switch (detect_cpu()) {
+    case CPU_AVX2:
+        return ScanImpl{ "avx2", scan_bytes_avx2, find_set_avx2, span_byte_avx2, scan_pair_avx2 };
+    case CPU_SSSE3:
+        return ScanImpl{ "ssse3", scan_bytes_sse2, find_set_ssse3, span_byte_sse2, scan_pair_sse2 };
+    case CPU_SSE2:
+        return ScanImpl{ "sse2", scan_bytes_sse2, find_set_scalar, span_byte_sse2, scan_pair_sse2 };
+    default: break;
+    }
+#endif
+    return ScanImpl{ "scalar", scan_bytes_scalar, find_set_scalar, span_byte_scalar, scan_pair_scalar };
+}
+
+static const ScanImpl& impl() {
+    static const ScanImpl chosen = pick_impl();
+    return chosen;
+}
+
+
+const char* scan_start(const StartSet& ss, const char* s, const char* e) {
+    switch (ss.kind) {
+    case StartSet::BYTES: {
+        if (ss.nbytes == 0)
+            return e;
+        if (ss.nbytes == 1) {  /* the C library's memchr is vectorized already */
+            const void* r = memchr(s, ss.bytes[0], (size_t)(e - s));
+            return r ? (const char*)r : e;
+        }
+        return impl().bytes(ss, s, e);
+    }
+    case StartSet::SET:
+        return impl().set(ss.set, true, s, e);
+    default:
+        return s;
+    }
+}
+
+
+const char* span_set(const CharSet& cs, const char* s, const char* e) {
+    return impl().set(cs, false, s, e);
+}
+
+
+const char* span_byte(unsigned char c, const char* s, const char* e) {
+    return impl().span_byte(c, s, e);
+}
+
+
+/*
+** Two-Way string matching (Crochemore and Perrin): linear time and
+** constant space whatever the needle, with the last byte of each window
+** checked first against a shift table to skip ahead like Horspool. 'ln'
+** is at least 2.
+*/
+static const char* two_way(const unsigned char* h, const unsigned char* z,
+    const unsigned char* n, size_t ln) {
+    size_t byteset[32 / sizeof(size_t)] = {};
+    size_t shift[256];
+    const size_t W = 8 * sizeof(size_t);
+    for (size_t i = 0; i < ln; i++) {
+        byteset[n[i] / W] |= (size_t)1 << (n[i] % W);
+        shift[n[i]] = i + 1;
+    }
+
+    /* critical factorization: the larger of the two maximal suffixes */
+    size_t ip = (size_t)-1, jp = 0, k = 1, p = 1;
+    while (jp + k < ln) {
+        if (n[ip + k] == n[jp + k]) {
+            if (k == p) { jp += p; k = 1; }
+            else k++;
+        } else if (n[ip + k] > n[jp + k]) { jp += k; k = 1; p = jp - ip; }
+        else { ip = jp++; k = p = 1; }
+    }
+    size_t ms = ip, p0 = p;
+    ip = (size_t)-1; jp = 0; k = p = 1;
+    while (jp + k < ln) {
+        if (n[ip + k] == n[jp + k]) {
+            if (k == p) { jp += p; k = 1; }
+            else k++;
+        } else if (n[ip + k] < n[jp + k]) { jp += k; k = 1; p = jp - ip; }
+        else { ip = jp++; k = p = 1; }
+    }
+    if (ip + 1 > ms + 1) ms = ip;
+    else p = p0;
+
+    size_t mem0, mem = 0;
+    if (memcmp(n, n + p, ms + 1) != 0) {  /* not periodic: no memory needed */
+        mem0 = 0;
+        p = (ms > ln - ms - 1 ? ms : ln - ms - 1) + 1;
+    } else
+        mem0 = ln - p;
+
+    for (;;) {
+        if ((size_t)(z - h) < ln)
+            return NULL;
+        unsigned char last = h[ln - 1];
+        if ((byteset[last / W] >> (last % W)) & 1) {
+            k = ln - shift[last];
+            if (k) {
+                if (k < mem) k = mem;
+                h += k;
+                mem = 0;
+                continue;
+            }
+        } else {
+            h += ln;
+            mem = 0;
+            continue;
+        }
+        for (k = (ms + 1 > mem ? ms + 1 : mem); k < ln && n[k] == h[k]; k++) {}
+        if (k < ln) {  /* right half mismatch */
+            h += k - ms;
+            mem = 0;
+            continue;
+        }
+        for (k = ms + 1; k > mem && n[k - 1] == h[k - 1]; k--) {}
+        if (k <= mem)
+            return (const char*)h;
+        h += p;
+        mem = mem0;
+    }
+}
+
+
+/* needle bytes compared past the prefilter, per haystack byte, before giving up on it */
+#define PAIR_VERIFY_RATIO	4
+#define PAIR_VERIFY_SLACK	4096
+
+const char* find_bytes(const char* s, const char* e, const char* n, size_t ln) {
+    if (ln == 0)
+        return s;
+    if ((size_t)(e - s) < ln)
+        return NULL;
+    if (ln == 1)
+        return (const char*)memchr(s, *n, (size_t)(e - s));
+    const char* last = e - ln + 1;  /* candidates are [s, last) */
+    unsigned char a = (unsigned char)n[0], b = (unsigned char)n[ln - 1];
+    size_t verified = 0;
+    for (const char* p = s; ; p++) {
+        p = impl().pair(a, b, ln - 1, p, last);
+        if (p == last)
+            return NULL;
+        if (memcmp(p + 1, n + 1, ln - 2) == 0)
+            return p;
+        verified += ln;
+        if (verified > PAIR_VERIFY_RATIO * (size_t)(p - s) + PAIR_VERIFY_SLACK)  /* periodic input */
+            return two_way((const unsigned char*)p + 1, (const unsigned char*)e,
+                (const unsigned char*)n, ln);
+    }
+}
+
+
+bool may_match(const Program* prog, const char* s, const char* e) {
+    size_t n = (size_t)(e - s);
+    if (n < prog->min_len)
+        return false;
+    size_t ls = prog->suffix.size();
+    if (ls > 0 && memcmp(e - ls, prog->suffix.data(), ls) != 0)
+        return false;
+    if (prog->must.empty() || prog->anchor)  /* an anchored attempt fails as fast */
+        return true;
+    return find_bytes(s, e, prog->must.data(), prog->must.size()) != NULL;
+}
+
+
+const char* scan_impl_name() {
+    return impl().name;
+}
+
+}  // namespace chadregex
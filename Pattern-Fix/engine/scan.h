@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "pattern.h"
+
+namespace chadregex {
+
+/*
+** Returns the first position in [s, e) whose byte is in 'ss', or 'e' if
+** there is none. Uses AVX2 or SSE2/SSSE3 when the CPU has them (checked
+** once at run time) and a plain loop otherwise.
+*/
+const char* scan_start(const StartSet& ss, const char* s, const char* e);
+
+/* next position at or after 's' where a match of 'prog' may start */
+inline const char* next_start(const Program* prog, const char* s, const char* e) {
+    if (prog->start.kind == StartSet::ANY)
+        return s;
+    return scan_start(prog->start, s, e);
+}
+
+/*
+** False when no match of 'prog' can lie in [s, e): too few bytes for the
+** shortest match, no copy of the bytes every match contains, or a
+** subject that does not end the way a '$' pattern needs. The literal
+** search stops at its first hit, which comes before the end of the
+** first match, so a subject that does match pays at most that much;
+** '^' patterns skip it, their one attempt fails about as fast.
+*/
+bool may_match(const Program* prog, const char* s, const char* e);
+
+/* last position in [s, e] a match of 'prog' can start at (never before 's') */
+inline const char* last_start(const Program* prog, const char* s, const char* e) {
+    return (size_t)(e - s) > prog->min_len ? e - prog->min_len : s;
+}
+
+/* end of the run of bytes in 'cs' / equal to 'c' that starts at 's' (at most 'e') */
+const char* span_set(const CharSet& cs, const char* s, const char* e);
+const char* span_byte(unsigned char c, const char* s, const char* e);
+
+/*
+** First occurrence of the 'ln' bytes at 'n' in [s, e), or NULL. The vector
+** kernels only stop where the first and the last byte of the needle both
+** match; if that keeps finding false candidates (periodic text) the
+** search switches to Two-Way, so it stays linear whatever the input.
+*/
+const char* find_bytes(const char* s, const char* e, const char* n, size_t ln);
+
+/* name of the kernel set picked for this CPU ("avx2", "ssse3", "sse2", "scalar") */
+const char* scan_impl_name();
+
+}  // namespace chadregex
@@ -0,0 +1,224 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "clock.h"
+
+namespace chadregex {
+
+#if !defined(SLOW_MATCH_NS)
+#define SLOW_MATCH_NS	2000000  /* 2 ms */
+#endif
+
+#if !defined(SLOW_LOG_SIZE)
+#define SLOW_LOG_SIZE	64
+#endif
+
+
+static std::atomic<bool> stats_enabled(true);
+static std::atomic<uint64_t> slow_match_ns(SLOW_MATCH_NS);
+
+/*
+** The live programs, for stats_report, and the slow log. Both are
+** allocated once and never freed: programs may outlive static
+** destruction in a state that closes late.
+*/
+struct StatsRegistry {
+    std::mutex mutex;
+    std::unordered_set<const Program*> programs;
+    std::deque<SlowMatch> slow;
+    size_t slow_size = SLOW_LOG_SIZE;
+};
+
+static StatsRegistry& registry() {
+    static StatsRegistry* r = new StatsRegistry();
+    return *r;
+}
+
+
+Program::Program() {
+    StatsRegistry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.programs.insert(this);
+}
+
+
+Program::~Program() {
+    StatsRegistry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.programs.erase(this);
+}
+
+
+/*
+** Plain loads and stores rather than read-modify-writes: no locked
+** instruction on the match path. Two threads running the same program
+** at once may lose an update now and then, which statistics can afford.
+*/
+static void bump(std::atomic<uint64_t>& a, uint64_t v) {
+    a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+
+static void raise_max(std::atomic<uint64_t>& a, uint64_t v) {
+    if (v > a.load(std::memory_order_relaxed))
+        a.store(v, std::memory_order_relaxed);
+}
+
+
+void stats_begin(StatsProbe* probe, const MatchState* ms, bool owned, long long owner) {
+    probe->prog = ms->prog;
+    probe->start = stats_enabled.load(std::memory_order_relaxed) ? clock_ns() : 0;
+    probe->mark = probe->start;
+    probe->steps = hook_steps(ms);
+    probe->backtracks = ms->backtracks;
+    probe->counted = false;
+    probe->logged = false;
+    probe->owned = owned;
+    probe->owner = owner;
+}
+
+
+static void slow_log(const StatsProbe* probe, const MatchState* ms, uint64_t now) {
+    StatsRegistry& r = registry();
+    SlowMatch m;
+    m.pattern = probe->prog->source;
+    m.subject_len = (size_t)(ms->src_end - ms->src_init);
+    m.owned = probe->owned;
+    m.owner = probe->owner;
+    m.ns = now - probe->start;
+    m.steps = hook_steps(ms);
+    m.when = now;
+    std::lock_guard<std::mutex> lock(r.mutex);
+    if (r.slow_size == 0)
+        return;
+    while (r.slow.size() >= r.slow_size)
+        r.slow.pop_front();
+    r.slow.push_back(std::move(m));
+}
+
+
+void stats_settle(StatsProbe* probe, const MatchState* ms) {
+    if (probe->start == 0 || probe->prog == NULL)
+        return;
+    PatternStats& st = probe->prog->stats;
+    uint64_t now = clock_ns();
+    size_t steps = hook_steps(ms);
+    if (!probe->counted) {
+        bump(st.calls, 1);
+        probe->counted = true;
+    }
+    bump(st.steps, steps - probe->steps);
+    bump(st.backtracks, ms->backtracks - probe->backtracks);
+    bump(st.total_ns, now - probe->mark);
+    raise_max(st.max_ns, now - probe->start);
+    raise_max(st.peak_frames, ms->peak_frames);
+    if (ms->status == STATUS_TIMEOUT || ms->status == STATUS_BUDGET)
+        bump(st.timeouts, 1);
+    uint64_t slow = slow_match_ns.load(std::memory_order_relaxed);
+    if (slow > 0 && !probe->logged && now - probe->start >= slow) {
+        slow_log(probe, ms, now);
+        probe->logged = true;
+    }
+    probe->mark = now;
+    probe->steps = steps;
+    probe->backtracks = ms->backtracks;
+}
+
+
+std::vector<PatternReport> stats_report(size_t max) {
+    StatsRegistry& r = registry();
+    std::vector<PatternReport> out;
+    {
+        std::unordered_map<std::string, size_t> index;
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (const Program* prog : r.programs) {
+            const PatternStats& st = prog->stats;
+            uint64_t calls = st.calls.load(std::memory_order_relaxed);
+            if (calls == 0)
+                continue;
+            auto it = index.emplace(prog->source, out.size()).first;
+            if (it->second == out.size()) {
+                out.emplace_back();
+                out.back().pattern = prog->source;
+            }
+            PatternReport& rep = out[it->second];
+            rep.programs++;
+            rep.calls += calls;
+            rep.steps += st.steps.load(std::memory_order_relaxed);
+            rep.backtracks += st.backtracks.load(std::memory_order_relaxed);
+            rep.peak_frames = std::max(rep.peak_frames, st.peak_frames.load(std::memory_order_relaxed));
+            rep.total_ns += st.total_ns.load(std::memory_order_relaxed);
+            rep.max_ns = std::max(rep.max_ns, st.max_ns.load(std::memory_order_relaxed));
+            rep.timeouts += st.timeouts.load(std::memory_order_relaxed);
+        }
+    }
+    std::sort(out.begin(), out.end(), [](const PatternReport& a, const PatternReport& b) {
+        return a.total_ns > b.total_ns;
+    });
+    if (max > 0 && out.size() > max)
+        out.resize(max);
+    return out;
+}
+
+
+std::vector<SlowMatch> slow_matches() {
+    StatsRegistry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return std::vector<SlowMatch>(r.slow.begin(), r.slow.end());
+}
+
+
+void stats_reset() {
+    StatsRegistry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (const Program* prog : r.programs) {
+        PatternStats& st = prog->stats;
+        st.calls.store(0, std::memory_order_relaxed);
+        st.steps.store(0, std::memory_order_relaxed);
+        st.backtracks.store(0, std::memory_order_relaxed);
+        st.peak_frames.store(0, std::memory_order_relaxed);
+        st.total_ns.store(0, std::memory_order_relaxed);
+        st.max_ns.store(0, std::memory_order_relaxed);
+        st.timeouts.store(0, std::memory_order_relaxed);
+    }
+    r.slow.clear();
+}
+
+
+bool get_stats_enabled() {
+    return stats_enabled.load(std::memory_order_relaxed);
+}
+
+void set_stats_enabled(bool on) {
+    stats_enabled.store(on, std::memory_order_relaxed);
+}
+
+uint64_t get_slow_match_ns() {
+    return slow_match_ns.load(std::memory_order_relaxed);
+}
+
+void set_slow_match_ns(uint64_t ns) {
+    slow_match_ns.store(ns, std::memory_order_relaxed);
+}
+
+size_t get_slow_log_size() {
+    StatsRegistry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return r.slow_size;
+}
+
+void set_slow_log_size(size_t n) {
+    StatsRegistry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.slow_size = n;
+    while (r.slow.size() > n)
+        r.slow.pop_front();
+}
+
+}  // namespace chadregex
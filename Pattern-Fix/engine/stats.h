@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "matcher.h"
+#include "pattern.h"
+
+namespace chadregex {
+
+/*
+** Per-program statistics. Each call that runs a Program adds to its
+** PatternStats (relaxed atomics, so threads may share the program), and
+** a call that runs longer than the slow-match threshold also goes to a
+** small ring log. A call is metered in stretches: 'stats_begin' when it
+** starts matching, 'stats_settle' whenever it stops (more than once if
+** it hands control back in between, like gsub before a replacement
+** function); the call itself is counted at its first settle.
+*/
+
+/* a call being metered */
+struct StatsProbe {
+    const Program* prog;
+    uint64_t start;       /* clock_ns() at stats_begin, 0 when stats are off */
+    uint64_t mark;        /* clock_ns() at the last settle */
+    size_t steps;         /* hook_steps() at the last settle */
+    size_t backtracks;    /* ms->backtracks at the last settle */
+    bool counted;         /* in 'calls' already */
+    bool logged;          /* in the slow log already */
+    bool owned;
+    long long owner;
+};
+
+void stats_begin(StatsProbe* probe, const MatchState* ms, bool owned = false,
+    long long owner = 0);
+
+/* adds what ran since the last settle; a timed-out match counts as a timeout */
+void stats_settle(StatsProbe* probe, const MatchState* ms);
+
+/* the counters of every live program with the same source, added up */
+struct PatternReport {
+    std::string pattern;
+    size_t programs = 0;  /* compiled copies (states, flags, user-held) */
+    uint64_t calls = 0;
+    uint64_t steps = 0;
+    uint64_t backtracks = 0;
+    uint64_t peak_frames = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t timeouts = 0;
+};
+
+/* reports sorted by total_ns, largest first; at most 'max' (0 for all) */
+std::vector<PatternReport> stats_report(size_t max = 0);
+
+/* one call that ran past the slow-match threshold */
+struct SlowMatch {
+    std::string pattern;
+    size_t subject_len;
+    bool owned;
+    long long owner;
+    uint64_t ns;  /* of the whole call */
+    size_t steps;
+    uint64_t when;  /* clock_ns() at the end of the call */
+};
+
+/* the slow log, oldest first */
+std::vector<SlowMatch> slow_matches();
+
+/* zeroes the counters of every live program and empties the slow log */
+void stats_reset();
+
+bool get_stats_enabled();
+void set_stats_enabled(bool on);
+
+/* calls longer than this go to the slow log; 0 turns the log off */
+uint64_t get_slow_match_ns();
+void set_slow_match_ns(uint64_t ns);
+
+/* entries the slow log keeps (the oldest are dropped) */
+size_t get_slow_log_size();
+void set_slow_log_size(size_t n);
+
+}  // namespace chadregex
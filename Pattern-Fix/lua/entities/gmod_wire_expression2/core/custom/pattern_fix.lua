@@ -4,17 +4,67 @@ require("pattern_fix")
 
 local VarQuota = CreateConVar("pattern_fix", "0.1", FCVAR_ARCHIVE)
 
+local VarBudget = CreateConVar("pattern_fix_budget", "0.01", FCVAR_ARCHIVE, "regex time (s) each chip may use per tick, 0 turns the budget off")
+
+local function applyBudget()
+	if VarBudget:GetFloat() <= 0 then return end -- off: getOwner passes no owner
+	CHADRegex.option("budgetNs", VarBudget:GetFloat() * 1e9)
+	CHADRegex.option("budgetPeriodNs", engine.TickInterval() * 1e9)
+end
+applyBudget()
+cvars.AddChangeCallback("pattern_fix_budget", applyBudget, "pattern_fix")
+
 local function getQuota_ns(self)
 	-- if isFullAccess(self.player) then return null end
 	return VarQuota:GetFloat() * 1e9;
 end
 
-local gsub = CHADRegex.gsub
-local find = CHADRegex.find
+-- budget owner: every chip draws from its own per-tick allowance (none while the budget is off)
+local function getOwner(self)
+	if VarBudget:GetFloat() <= 0 then return nil end
+	return self.entity:EntIndex()
+end
+
+-- a chip placed later on the same entity index must not inherit this one's debt
+registerCallback("destruct", function(self)
+	CHADRegex.budget(self.entity:EntIndex(), true) -- also while the budget is off
+end)
+
+local VarMaxDegree = CreateConVar("pattern_fix_max_degree", "0", FCVAR_ARCHIVE,
+	"refuse patterns whose worst case grows faster than length^this (see CHADRegex.analyze), 0 allows all")
+
+local analyze = CHADRegex.analyze
+local analyzed, analyzedCount = {}, 0
+
+-- errors (which the callers print) for a pattern over pattern_fix_max_degree
+local function admit(pattern)
+	local max = VarMaxDegree:GetInt()
+	if max <= 0 then return end
+	local a = analyzed[pattern]
+	if not a then
+		a = analyze(pattern)
+		if analyzedCount >= 512 then analyzed, analyzedCount = {}, 0 end
+		analyzed[pattern], analyzedCount = a, analyzedCount + 1
+	end
+	if a.degree > max then
+		local where = a.findings[1]
+		error("pattern too ambiguous (" .. a.class .. (where and ", at '" .. where.text .. "'" or "") .. ")", 0)
+	end
+end
+
+local function admitted(fn)
+	return function(this, pattern, ...)
+		admit(pattern)
+		return fn(this, pattern, ...)
+	end
+end
+
+local gsub = admitted(CHADRegex.gsub)
+local find = admitted(CHADRegex.find)
 
 --- Returns the 1st occurrence of the string <pattern>, returns 0 if not found. Prints malformed string errors to the chat area.
 e2function number string:findRE(string pattern)
-	local OK, Ret = pcall(find, this, pattern, 1, false, getQuota_ns(self))
+	local OK, Ret = pcall(find, this, pattern, 1, false, getQuota_ns(self), nil, getOwner(self))
 	if not OK then
 		self.player:ChatPrint(Ret)
 		return 0
@@ -25,7 +75,7 @@ end
 
 ---  Returns the 1st occurrence of the string <pattern> starting at <start> and going to the end of the string, returns 0 if not found. Prints malformed string errors to the chat area.
 e2function number string:findRE(string pattern, start)
-	local OK, Ret = pcall(find, this, pattern, start, false, getQuota_ns(self))
+	local OK, Ret = pcall(find, this, pattern, start, false, getQuota_ns(self), nil, getOwner(self))
 	if not OK then
 		self.player:ChatPrint(Ret)
 		return 0
@@ -36,7 +86,7 @@ end
 
 ---  Finds and replaces every occurrence of <pattern> with <new> using regular expressions. Prints malformed string errors to the chat area.
 e2function string string:replaceRE(string pattern, string new)
-	local OK, NewStr = pcall(gsub, this, pattern, new, nil, getQuota_ns(self))
+	local OK, NewStr = pcall(gsub, this, pattern, new, nil, getQuota_ns(self), nil, getOwner(self))
 	if not OK then
 		self.player:ChatPrint(NewStr)
 		return ""
@@ -46,12 +96,12 @@ e2function string string:replaceRE(string pattern, string new)
 end
 
 
-local string_match = CHADRegex.match
+local string_match = admitted(CHADRegex.match)
 local table_remove = table.remove
 
 --- runs [[string.match]](<this>, <pattern>) and returns the sub-captures as an array. Prints malformed pattern errors to the chat area.
 e2function array string:match(string pattern)
-	local args = {pcall(string_match, this, pattern, nil, getQuota_ns(self))}
+	local args = {pcall(string_match, this, pattern, nil, getQuota_ns(self), nil, getOwner(self))}
 	if not args[1] then
 		self.player:ChatPrint(args[2] or "Unknown error in str:match")
 		return {}
@@ -63,7 +113,7 @@ end
 
 --- runs [[string.match]](<this>, <pattern>, <position>) and returns the sub-captures as an array. Prints malformed pattern errors to the chat area.
 e2function array string:match(string pattern, position)
-	local args = {pcall(string_match, this, pattern, position, getQuota_ns(self))}
+	local args = {pcall(string_match, this, pattern, position, getQuota_ns(self), nil, getOwner(self))}
 	if not args[1] then
 		self.player:ChatPrint(args[2] or "Unknown error in str:match")
 		return {}
@@ -73,27 +123,16 @@ e2function array string:match(string pattern, position)
 	end
 end
 
-local string_gmatch = CHADRegex.gmatch
+local gmatchAll = admitted(CHADRegex.gmatchAll)
 local table_Copy = table.Copy
-local Right = string.Right
 
 -- Helper function for gmatch (below)
 -- (By Divran)
 local DEFAULT = {n={},ntypes={},s={},stypes={},size=0,istable=true,depth=0}
-local function gmatch( self, this, pattern )
-	local ret = table_Copy( DEFAULT )
-	local num = 0
-	local iter = string_gmatch( this, pattern, nil, getQuota_ns(self) )
-	local v
-	while true do
-		v = {iter()}
-		if (!v or #v==0) then break end
-		num = num + 1
-		ret.n[num] = v
-		ret.ntypes[num] = "r"
-	end
+local function gmatch( self, this, pattern, position )
+	-- the whole E2 table comes back from one call
+	local ret, num = gmatchAll( this, pattern, position, nil, true, getQuota_ns(self), nil, getOwner(self) )
 	self.prf = self.prf + num
-	ret.size = num
 	return ret
 end
 
@@ -112,8 +151,7 @@ end
 --- runs [[string.gmatch]](<this>, <pattern>, <position>) and returns the captures in an array in a table. Prints malformed pattern errors to the chat area.
 -- (By Divran)
 e2function table string:gmatch(string pattern, position)
-	this = this:Right( -position-1 )
-	local OK, ret = pcall( gmatch, self, this, pattern )
+	local OK, ret = pcall( gmatch, self, this, pattern, position + 1 )
 	if (!OK) then
 		self.player:ChatPrint( ret or "Unknown error in str:gmatch" )
 		return table_Copy( DEFAULT )
@@ -124,7 +162,7 @@ end
 
 --- runs [[string.match]](<this>, <pattern>) and returns the first match or an empty string if the match failed. Prints malformed pattern errors to the chat area.
 e2function string string:matchFirst(string pattern)
-	local OK, Ret = pcall(string_match, this, pattern, nil, getQuota_ns(self))
+	local OK, Ret = pcall(string_match, this, pattern, nil, getQuota_ns(self), nil, getOwner(self))
 	if not OK then
 		self.player:ChatPrint(Ret)
 		return ""
@@ -135,7 +173,7 @@ end
 
 --- runs [[string.match]](<this>, <pattern>, <position>) and returns the first match or an empty string if the match failed. Prints malformed pattern errors to the chat area.
 e2function string string:matchFirst(string pattern, position)
-	local OK, Ret = pcall(string_match, this, pattern, position, getQuota_ns(self))
+	local OK, Ret = pcall(string_match, this, pattern, position, getQuota_ns(self), nil, getOwner(self))
 	if not OK then
 		self.player:ChatPrint(Ret)
 		return ""
@@ -20,12 +20,32 @@ CreateWorkspace({
     name = "Pattern_Fix", -- Not use '-' otherwise print error 'invalid macro definition'
 })
 	cppdialect 'C++17'
-	
+
+	-- the matcher itself: plain C++17, no Lua, linked into both modules
+	project("chadregex")
+		kind("StaticLib")
+		pic("On")
+		files({"./engine/*.h", "./engine/*.cpp"})
+		vpaths({["Header files/*"] = "./engine/*.h", ["Source files/*"] = "./engine/*.cpp"})
+
+	-- engine vs the stock Lua matcher on E2-style workloads, see bench/bench.cpp
+	project("chadregex_bench")
+		kind("ConsoleApp")
+		files({"./bench/*.h", "./bench/*.cpp"})
+		vpaths({["Header files/*"] = "./bench/*.h", ["Source files/*"] = "./bench/*.cpp"})
+		includedirs({"./engine"})
+		links({"chadregex"})
+		filter("system:linux")
+			links({"pthread"})
+		filter({})
+
 	CreateProject({
 		serverside = false,
 		source_path = "./src" -- optional
 		-- manual_files = project_manual_files, -- optional
 	})
+		includedirs({"./engine"})
+		links({"chadregex"})
 
 	IncludeLuaShared() -- uses this repo path
 	IncludeDetouring() -- uses this repo detouring submodule
@@ -38,6 +58,8 @@ CreateWorkspace({
 		source_path = "./src" -- optional
 		-- manual_files = project_manual_files, -- optional
 	})
+		includedirs({"./engine"})
+		links({"chadregex"})
 
 
 	IncludeLuaShared() -- uses this repo path
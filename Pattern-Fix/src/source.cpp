@@ -6,10 +6,29 @@
 #include <iomanip>
 #include <iostream>
 #include <chrono>
+#include <atomic>
+#include <list>
+#include <new>
+#include <string_view>
+#include <unordered_map>
 
 #include <GarrysMod/Lua/Interface.h>
 
+#include "analyze.h"
+#include "async.h"
+#include "batch.h"
+#include "budget.h"
+#include "chadregex.h"
+#include "clock.h"
+#include "dfa.h"
+#include "matcher.h"
+#include "pattern.h"
+#include "patternset.h"
+#include "scan.h"
+#include "stats.h"
+
 using namespace std::chrono_literals;
+using namespace chadregex;
 
 #ifdef __cplusplus
 extern "C"
@@ -50,381 +69,404 @@ static size_t posrelatI(lua_Integer pos, size_t len) {
 }
 
 
+static size_t getendpos(lua_State* L, int arg, lua_Integer def, size_t len) {
+    lua_Integer pos = luaL_optinteger(L, arg, def);
+    if (pos > (lua_Integer)len)
+        return len;
+    else if (pos >= 0)
+        return (size_t)pos;
+    else if (pos < -(lua_Integer)len)
+        return 0;
+    else return len + (size_t)pos + 1;
+}
+
+
 /*
 ** {======================================================
-** PATTERN MATCHING
+** CANCELLATION TOKENS
 ** =======================================================
 */
 
-#define CAP_UNFINISHED	(-1)
-#define CAP_POSITION	(-2)
+#define TOKEN_MT	"CHADRegex.Token"
 
+/*
+** CHADRegex.token(callback = nil): passed where a call takes 'callback
+** or timeOutNS', it stops the match once cancelled. The flag is read by
+** the engine at each check, so no Lua runs for it; the workers of async
+** calls read it too. The optional callback is bound once and called
+** like a plain callback; release() drops it at once instead of at
+** collection.
+*/
+typedef struct TokenUD {
+    std::shared_ptr<std::atomic<bool>> cancelled;
+    int ref_callback;  /* LUA_NOREF once released */
+} TokenUD;
 
-typedef struct MatchState {
-    const char* src_init;  /* init of source string */
-    const char* src_end;  /* end ('\0') of source string */
-    const char* p_end;  /* end ('\0') of pattern */
-    lua_State* L;
-    int matchdepth;  /* control for recursive depth (to avoid C stack overflow) */
-    unsigned char level;  /* total number of captures (finished or unfinished) */
-    struct {
-        const char* init;
-        ptrdiff_t len;
-    } capture[LUA_MAXCAPTURES];
-
-    struct {
-        size_t maxIterateCallback;
-        size_t curIterateCallback;
-        size_t current;
-        int ref_callback;
-        bool limited;
-        std::chrono::nanoseconds timeLimit;
-        std::chrono::high_resolution_clock::time_point startPoint;
-    } hook;
-} MatchState;
-
-inline void tick_lua_match_hook(MatchState* ms) {
-//#define TICK_LUA_MATCH_HOOK(ms)
-    if(++ms->hook.curIterateCallback >= ms->hook.maxIterateCallback){
-        if (ms->hook.limited) {
-            if (std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - ms->hook.startPoint) > ms->hook.timeLimit) {
-                lua_pushstring(ms->L, "Time limit exended");
-                lua_error(ms->L);
-            }
-        } else if(ms->hook.ref_callback) {
-            ms->hook.current += ms->hook.curIterateCallback;
-            ms->hook.curIterateCallback = 0;
-            
-            lua_rawgeti(ms->L, LUA_REGISTRYINDEX, ms->hook.ref_callback);
-            lua_pushnumber(ms->L, (lua_Number)ms->hook.current);
-            lua_pcall(ms->L, 1, 1, 0);
-
-            if (lua_isboolean(ms->L, 1) && lua_toboolean(ms->L, 1)) {
-                lua_pushstring(ms->L, "Callback stop matching");
-                lua_error(ms->L);
-            }
-        }
+
+static TokenUD* check_token(lua_State* L, int idx) {
+    return (TokenUD*)luaL_checkudata(L, idx, TOKEN_MT);
+}
+
+
+static void token_release_callback(lua_State* L, TokenUD* t) {
+    if (t->ref_callback != LUA_NOREF) {
+        lua_unref(L, t->ref_callback);
+        t->ref_callback = LUA_NOREF;
     }
 }
 
 
-/* recursive function */
-static const char* match(MatchState* ms, const char* s, const char* p);
+static int module_token(lua_State* L) {
+    if (!lua_isnoneornil(L, 1))
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_settop(L, 1);
+    TokenUD* t = (TokenUD*)lua_newuserdata(L, sizeof(TokenUD));
+    new (t) TokenUD{ std::make_shared<std::atomic<bool>>(false), LUA_NOREF };
+    luaL_getmetatable(L, TOKEN_MT);
+    lua_setmetatable(L, -2);
+    if (!lua_isnil(L, 1)) {
+        lua_pushvalue(L, 1);
+        t->ref_callback = lua_ref(L, LUA_REGISTRYINDEX);
+    }
+    return 1;
+}
 
 
-/* maximum recursion depth for 'match' */
-#if !defined(MAXCCALLS)
-#define MAXCCALLS	200
-#endif
+/* token:cancel() */
+static int token_cancel(lua_State* L) {
+    check_token(L, 1)->cancelled->store(true, std::memory_order_relaxed);
+    return 0;
+}
 
 
-#define L_ESC		'%'
-#define SPECIALS	"^$*+?.([%-"
+/* token:reset(): lets the token be passed to new calls again */
+static int token_reset(lua_State* L) {
+    check_token(L, 1)->cancelled->store(false, std::memory_order_relaxed);
+    return 0;
+}
 
 
-static int check_capture(MatchState* ms, int l) {
-    l -= '1';
-    if (l_unlikely(l < 0 || l >= ms->level ||
-        ms->capture[l].len == CAP_UNFINISHED))
-        return luaL_error(ms->L, "invalid capture index %%%d", l + 1);
-    return l;
+/* token:isCancelled() */
+static int token_is_cancelled(lua_State* L) {
+    lua_pushboolean(L, check_token(L, 1)->cancelled->load(std::memory_order_relaxed));
+    return 1;
 }
 
 
-static int capture_to_close(MatchState* ms) {
-    int level = ms->level;
-    for (level--; level >= 0; level--)
-        if (ms->capture[level].len == CAP_UNFINISHED) return level;
-    return luaL_error(ms->L, "invalid pattern capture");
+/* token:release(): unbinds the callback; the token still cancels */
+static int token_release(lua_State* L) {
+    token_release_callback(L, check_token(L, 1));
+    return 0;
 }
 
 
-static const char* classend(MatchState* ms, const char* p) {
-    switch (*p++) {
-    case L_ESC: {
-        if (l_unlikely(p == ms->p_end))
-            luaL_error(ms->L, "malformed pattern (ends with '%%')");
-        return p + 1;
-    }
-    case '[': {
-        if (*p == '^') p++;
-        do {  /* look for a ']' */
-            if (l_unlikely(p == ms->p_end))
-                luaL_error(ms->L, "malformed pattern (missing ']')");
-            if (*(p++) == L_ESC && p < ms->p_end)
-                p++;  /* skip escapes (e.g. '%]') */
-        } while (*p != ']');
-        return p + 1;
-    }
-    default: {
-        return p;
-    }
-    }
+static int token_gc(lua_State* L) {
+    TokenUD* t = check_token(L, 1);
+    token_release_callback(L, t);
+    t->~TokenUD();
+    return 0;
 }
 
 
-static int match_class(int c, int cl) {
-    int res;
-    switch (tolower(cl)) {
-    case 'a': res = isalpha(c); break;
-    case 'c': res = iscntrl(c); break;
-    case 'd': res = isdigit(c); break;
-    case 'g': res = isgraph(c); break;
-    case 'l': res = islower(c); break;
-    case 'p': res = ispunct(c); break;
-    case 's': res = isspace(c); break;
-    case 'u': res = isupper(c); break;
-    case 'w': res = isalnum(c); break;
-    case 'x': res = isxdigit(c); break;
-    case 'z': res = (c == 0); break;  /* deprecated option */
-    default: return (cl == c);
-    }
-    return (islower(cl) ? res : !res);
+static int token_tostring(lua_State* L) {
+    TokenUD* t = check_token(L, 1);
+    lua_pushfstring(L, TOKEN_MT " (%s%s)",
+        t->cancelled->load(std::memory_order_relaxed) ? "cancelled" : "live",
+        t->ref_callback != LUA_NOREF ? ", with callback" : "");
+    return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** STRING VIEWS
+** =======================================================
+*/
+
+#define VIEW_MT	"CHADRegex.View"
+
+/*
+** CHADRegex.view(string or view, i = 1, j = -1): bytes i..j of a string,
+** as string.sub numbers them, without copying them. Every function that
+** takes a subject matches a view in place, with positions counted from
+** its first byte; a Lua string is only made when one is asked for
+** (view:str(), tostring, ..). The string it points into is pinned by a
+** registry reference.
+*/
+typedef struct ViewUD {
+    const char* data;
+    size_t len;
+    size_t offset;  /* of 'data' in the source string */
+    int ref_source;
+} ViewUD;
+
+
+static ViewUD* check_view(lua_State* L, int idx) {
+    return (ViewUD*)luaL_checkudata(L, idx, VIEW_MT);
 }
 
 
-static int matchbracketclass(int c, const char* p, const char* ec) {
-    int sig = 1;
-    if (*(p + 1) == '^') {
-        sig = 0;
-        p++;  /* skip the '^' */
+/* the subject argument at 'idx': a string, or a view of one */
+static const char* check_subject(lua_State* L, int idx, size_t* len) {
+    if (lua_type(L, idx) == LUA_TUSERDATA) {
+        ViewUD* v = check_view(L, idx);
+        *len = v->len;
+        return v->data;
     }
-    while (++p < ec) {
-        if (*p == L_ESC) {
-            p++;
-            if (match_class(c, uchar(*p)))
-                return sig;
-        } else if ((*(p + 1) == '-') && (p + 2 < ec)) {
-            p += 2;
-            if (uchar(*(p - 2)) <= c && c <= uchar(*p))
-                return sig;
-        } else if (uchar(*p) == c) return sig;
+    return luaL_checklstring(L, idx, len);
+}
+
+
+/* CHADRegex.view(s, i = 1, j = -1), also view:sub(i = 1, j = -1) */
+static int module_view(lua_State* L) {
+    size_t l;
+    const char* s = check_subject(L, 1, &l);
+    size_t start = posrelatI(luaL_optinteger(L, 2, 1), l);
+    size_t end = getendpos(L, 3, -1, l);
+    size_t base = 0;
+    if (start > end) {  /* empty */
+        start = 1;
+        end = 0;
     }
-    return !sig;
+    if (lua_type(L, 1) == LUA_TUSERDATA) {
+        ViewUD* src = check_view(L, 1);
+        base = src->offset;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, src->ref_source);
+    } else
+        lua_pushvalue(L, 1);
+    int ref = lua_ref(L, LUA_REGISTRYINDEX);
+    ViewUD* v = (ViewUD*)lua_newuserdata(L, sizeof(ViewUD));
+    *v = ViewUD{ s + start - 1, end - start + 1, base + start - 1, ref };
+    luaL_getmetatable(L, VIEW_MT);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+
+/* view:str(), also tostring(view): the bytes as a Lua string */
+static int view_str(lua_State* L) {
+    ViewUD* v = check_view(L, 1);
+    lua_pushlstring(L, v->data, v->len);
+    return 1;
 }
 
 
-static int singlematch(MatchState* ms, const char* s, const char* p,
-    const char* ep) {
+/* view:len(), also #view */
+static int view_len(lua_State* L) {
+    lua_pushinteger(L, (lua_Integer)check_view(L, 1)->len);
+    return 1;
+}
 
-    tick_lua_match_hook(ms);
 
-    if (s >= ms->src_end)
+/* view:byte(i = 1, j = i), as string.byte */
+static int view_byte(lua_State* L) {
+    ViewUD* v = check_view(L, 1);
+    lua_Integer pi = luaL_optinteger(L, 2, 1);
+    size_t pose = getendpos(L, 3, pi, v->len);
+    size_t posi = posrelatI(pi, v->len);
+    if (posi > pose)
         return 0;
-    else {
-        int c = uchar(*s);
-        switch (*p) {
-        case '.': return 1;  /* matches any char */
-        case L_ESC: return match_class(c, uchar(*(p + 1)));
-        case '[': return matchbracketclass(c, p, ep - 1);
-        default:  return (uchar(*p) == c);
-        }
-    }
+    int n = (int)(pose - posi) + 1;
+    luaL_checkstack(L, n, "string slice too long");
+    for (int i = 0; i < n; i++)
+        lua_pushinteger(L, uchar(v->data[posi + i - 1]));
+    return n;
 }
 
 
-static const char* matchbalance(MatchState* ms, const char* s,
-    const char* p) {
-    if (l_unlikely(p >= ms->p_end - 1))
-        luaL_error(ms->L, "malformed pattern (missing arguments to '%%b')");
-    if (*s != *p) return NULL;
-    else {
-        int b = *p;
-        int e = *(p + 1);
-        int cont = 1;
-        while (++s < ms->src_end) {
-            if (*s == e) {
-                if (--cont == 0) return s + 1;
-            } else if (*s == b) cont++;
-        }
-    }
-    return NULL;  /* string ends out of balance */
+/* view:offsets(): where the view starts and ends in view:source() */
+static int view_offsets(lua_State* L) {
+    ViewUD* v = check_view(L, 1);
+    lua_pushinteger(L, (lua_Integer)v->offset + 1);
+    lua_pushinteger(L, (lua_Integer)(v->offset + v->len));
+    return 2;
 }
 
 
-static const char* max_expand(MatchState* ms, const char* s,
-    const char* p, const char* ep) {
-    ptrdiff_t i = 0;  /* counts maximum expand for item */
-    while (singlematch(ms, s + i, p, ep))
-        i++;
-    /* keeps trying to match with the maximum repetitions */
-    while (i >= 0) {
-        const char* res = match(ms, (s + i), ep + 1);
-        if (res) return res;
-        i--;  /* else didn't match; reduce 1 repetition to try again */
-    }
-    return NULL;
+/* view:source(): the string the view points into */
+static int view_source(lua_State* L) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, check_view(L, 1)->ref_source);
+    return 1;
 }
 
 
-static const char* min_expand(MatchState* ms, const char* s,
-    const char* p, const char* ep) {
-    for (;;) {
-        const char* res = match(ms, s, ep + 1);
-        if (res != NULL)
-            return res;
-        else if (singlematch(ms, s, p, ep))
-            s++;  /* try with one more repetition */
-        else return NULL;
+/* view .. x and x .. view, with strings, numbers or views */
+static int view_concat(lua_State* L) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (int i = 1; i <= 2; i++) {
+        size_t l;
+        const char* s = check_subject(L, i, &l);
+        luaL_addlstring(&b, s, l);
     }
+    luaL_pushresult(&b);
+    return 1;
 }
 
 
-static const char* start_capture(MatchState* ms, const char* s,
-    const char* p, int what) {
-    const char* res;
-    unsigned char level = (unsigned char)ms->level;
-    if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
-    ms->capture[level].init = s;
-    ms->capture[level].len = what;
-    ms->level = level + 1;
-    if ((res = match(ms, s, p)) == NULL)  /* match failed? */
-        ms->level--;  /* undo capture */
-    return res;
+/* view == view: the same bytes */
+static int view_eq(lua_State* L) {
+    ViewUD* a = check_view(L, 1);
+    ViewUD* b = check_view(L, 2);
+    lua_pushboolean(L, a->len == b->len && memcmp(a->data, b->data, a->len) == 0);
+    return 1;
 }
 
 
-static const char* end_capture(MatchState* ms, const char* s,
-    const char* p) {
-    int l = capture_to_close(ms);
-    const char* res;
-    ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
-    if ((res = match(ms, s, p)) == NULL)  /* match failed? */
-        ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
-    return res;
+static int view_gc(lua_State* L) {
+    lua_unref(L, check_view(L, 1)->ref_source);
+    return 0;
 }
 
+/* }====================================================== */
 
-static const char* match_capture(MatchState* ms, const char* s, int l) {
-    size_t len;
-    l = check_capture(ms, l);
-    len = ms->capture[l].len;
-    if ((size_t)(ms->src_end - s) >= len &&
-        memcmp(ms->capture[l].init, s, len) == 0)
-        return s + len;
-    else return NULL;
-}
-
-
-static const char* match(MatchState* ms, const char* s, const char* p) {
-    if (l_unlikely(ms->matchdepth-- == 0))
-        luaL_error(ms->L, "pattern too complex");
-init: /* using goto's to optimize tail recursion */
-    if (p != ms->p_end) {  /* end of pattern? */
-        switch (*p) {
-        case '(': {  /* start capture */
-            if (*(p + 1) == ')')  /* position capture? */
-                s = start_capture(ms, s, p + 2, CAP_POSITION);
-            else
-                s = start_capture(ms, s, p + 1, CAP_UNFINISHED);
-            break;
-        }
-        case ')': {  /* end capture */
-            s = end_capture(ms, s, p + 1);
-            break;
-        }
-        case '$': {
-            if ((p + 1) != ms->p_end)  /* is the '$' the last char in pattern? */
-                goto dflt;  /* no; go to default */
-            s = (s == ms->src_end) ? s : NULL;  /* check end of string */
-            break;
-        }
-        case L_ESC: {  /* escaped sequences not in the format class[*+?-]? */
-            switch (*(p + 1)) {
-            case 'b': {  /* balanced string? */
-                s = matchbalance(ms, s, p + 2);
-                if (s != NULL) {
-                    p += 4; goto init;  /* return match(ms, s, p + 4); */
-                }  /* else fail (s == NULL) */
-                break;
-            }
-            case 'f': {  /* frontier? */
-                const char* ep; char previous;
-                p += 2;
-                if (l_unlikely(*p != '['))
-                    luaL_error(ms->L, "missing '[' after '%%f' in pattern");
-                ep = classend(ms, p);  /* points to what is next */
-                previous = (s == ms->src_init) ? '\0' : *(s - 1);
-                if (!matchbracketclass(uchar(previous), p, ep - 1) &&
-                    matchbracketclass(uchar(*s), p, ep - 1)) {
-                    p = ep; goto init;  /* return match(ms, s, ep); */
-                }
-                s = NULL;  /* match failed */
-                break;
-            }
-            case '0': case '1': case '2': case '3':
-            case '4': case '5': case '6': case '7':
-            case '8': case '9': {  /* capture results (%0-%9)? */
-                s = match_capture(ms, s, uchar(*(p + 1)));
-                if (s != NULL) {
-                    p += 2; goto init;  /* return match(ms, s, p + 2) */
-                }
-                break;
-            }
-            default: goto dflt;
-            }
-            break;
-        }
-        default: dflt: {  /* pattern class plus optional suffix */
-            const char* ep = classend(ms, p);  /* points to optional suffix */
-            /* does not match at least once? */
-            if (!singlematch(ms, s, p, ep)) {
-                if (*ep == '*' || *ep == '?' || *ep == '-') {  /* accept empty? */
-                    p = ep + 1; goto init;  /* return match(ms, s, ep + 1); */
-                } else  /* '+' or no suffix */
-                    s = NULL;  /* fail */
-            } else {  /* matched once */
-                switch (*ep) {  /* handle optional suffix */
-                case '?': {  /* optional */
-                    const char* res;
-                    if ((res = match(ms, s + 1, ep + 1)) != NULL)
-                        s = res;
-                    else {
-                        p = ep + 1; goto init;  /* else return match(ms, s, ep + 1); */
-                    }
-                    break;
-                }
-                case '+':  /* 1 or more repetitions */
-                    s++;  /* 1 match already done */
-                    /* FALLTHROUGH */
-                case '*':  /* 0 or more repetitions */
-                    s = max_expand(ms, s, p, ep);
-                    break;
-                case '-':  /* 0 or more repetitions (minimum) */
-                    s = min_expand(ms, s, p, ep);
-                    break;
-                default:  /* no suffix */
-                    s++; p = ep; goto init;  /* return match(ms, s + 1, ep); */
-                }
-            }
-            break;
-        }
-        }
+
+/*
+** {======================================================
+** PATTERN MATCHING
+** =======================================================
+*/
+
+/*
+** Lua side of the match hook: the callback passed to find/gmatch/gsub, or
+** the one bound to a token, is called from the engine every
+** 'everySimpleStep' steps. The callback is not referenced: it stays on
+** the stack of the call (in an upvalue for gmatch) for as long as the
+** match can run.
+*/
+typedef struct LuaHook {
+    lua_State* L;
+    int callback;  /* stack index (or pseudo-index) of the callback, 0 for none */
+    TokenUD* token;  /* the token at 'callback' instead, or NULL */
+    int owned;  /* draws from the budget of 'owner' */
+    int budget_bound;  /* the deadline currently comes from that budget */
+    lua_Integer owner;
+    uint64_t mark;  /* clock_ns() (or steps) at the last charge */
+    MatchHook base;  /* the hook as the arguments set it up */
+    StatsProbe stats;
+} LuaHook;
+
+
+/*
+** Stops the match if the callback returns true or raises (the error
+** cannot cross the engine, so it only stops the match). The stack is
+** left as it was: a gsub buffer may be open below.
+*/
+static Status lua_hook_callback(void* ud, size_t steps) {
+    LuaHook* h = (LuaHook*)ud;
+    lua_State* L = h->L;
+    int top = lua_gettop(L);
+
+    if (h->token != NULL) {
+        if (h->token->ref_callback == LUA_NOREF)  /* released by now */
+            return STATUS_OK;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, h->token->ref_callback);
+    } else
+        lua_pushvalue(L, h->callback);
+    lua_pushnumber(L, (lua_Number)steps);
+    int stop = lua_pcall(L, 1, 1, 0) != 0 ||
+        (lua_isboolean(L, -1) && lua_toboolean(L, -1));
+    lua_settop(L, top);
+    return stop ? STATUS_STOPPED : STATUS_OK;
+}
+
+
+/* what the owner has spent since the last charge, in ns */
+static uint64_t budget_spent(const MatchState* ms, const LuaHook* h) {
+    if (get_step_budget())
+        return (uint64_t)((double)(hook_steps(ms) - h->mark) * get_step_ns());
+    return clock_ns() - h->mark;
+}
+
+static uint64_t budget_mark(const MatchState* ms) {
+    return get_step_budget() ? hook_steps(ms) : clock_ns();
+}
+
+
+/*
+** Starts a metered stretch of matching: starts the pattern's statistics
+** and caps the deadline at what the owner has left, or raises if nothing
+** is left.
+*/
+static void budget_begin(lua_State* L, MatchState* ms, LuaHook* h) {
+    stats_begin(&h->stats, ms, h->owned != 0, h->owner);
+    if (!h->owned)
+        return;
+    uint64_t left = budget_available(h->owner);
+    if (left == 0) {
+        lua_pushstring(L, status_message(STATUS_BUDGET));
+        lua_error(L);
     }
-    ms->matchdepth++;
-    return s;
+    size_t steps = hook_steps(ms);
+    ms->hook = h->base;  /* drop the cap of a previous stretch (gmatch) */
+    ms->hook.total = steps;
+    ms->hook.count = 0;
+    h->budget_bound = tighten_deadline(ms, left);
+    h->mark = budget_mark(ms);
 }
 
 
+/* charges the owner (and the pattern's statistics) for the matching done since the last charge */
+static void budget_settle(const MatchState* ms, LuaHook* h) {
+    stats_settle(&h->stats, ms);
+    if (!h->owned)
+        return;
+    budget_charge(h->owner, budget_spent(ms, h));
+    h->mark = budget_mark(ms);
+}
 
-static const char* lmemfind(const char* s1, size_t l1,
-    const char* s2, size_t l2) {
-    if (l2 == 0) return s1;  /* empty strings are everywhere */
-    else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
-    else {
-        const char* init;  /* to search for a '*s2' inside 's1' */
-        l2--;  /* 1st char will be checked by 'memchr' */
-        l1 = l1 - l2;  /* 's2' cannot be found after that */
-        while (l1 > 0 && (init = (const char*)memchr(s1, *s2, l1)) != NULL) {
-            init++;   /* 1st char is already checked */
-            if (memcmp(init, s2 + 1, l2) == 0)
-                return init - 1;
-            else {  /* correct 'l1' and 's1' to try again */
-                l1 -= init - s1;
-                s1 = init;
-            }
-        }
-        return NULL;  /* not found */
+
+/*
+** Sets up the hook from the 'callback or timeOutNS or token,
+** everySimpleStep, ownerId' arguments starting at 'arg', which must stay
+** on the stack while the match runs. With a timeout and no
+** everySimpleStep the check interval adapts to the quota (see
+** MatchHook). With an owner the match also stops when the owner's
+** budget runs out.
+*/
+static void setup_lua_hook(lua_State* L, MatchState* ms, LuaHook* h, int arg) {
+    h->L = L;
+    h->callback = 0;
+    h->token = NULL;
+    h->owned = !lua_isnoneornil(L, arg + 2);
+    h->owner = h->owned ? luaL_checkinteger(L, arg + 2) : 0;
+    h->budget_bound = 0;
+    if (lua_isfunction(L, arg)) {
+        lua_Integer maxIter = luaL_optinteger(L, arg + 1, (size_t)1e5);
+        h->callback = arg;
+
+        setup_hook(ms, maxIter, lua_hook_callback, h);
+    } else if (lua_type(L, arg) == LUA_TUSERDATA) {
+        h->token = check_token(L, arg);
+        h->callback = arg;
+        if (h->token->ref_callback != LUA_NOREF)
+            setup_hook(ms, luaL_optinteger(L, arg + 1, (size_t)1e5), lua_hook_callback, h);
+        else
+            setup_hook(ms, 0, NULL, NULL);
+        watch_cancel(ms, h->token->cancelled.get());
+    } else if (lua_isnumber(L, arg)) {
+        lua_Integer maxIter = luaL_optinteger(L, arg + 1, 0);
+
+        setup_deadline(ms, std::chrono::nanoseconds((long long)(double)lua_tonumber(L, arg)), maxIter > 0 ? maxIter : 0);
+    } else {
+        setup_hook(ms, 0, NULL, NULL);
+    }
+    h->base = ms->hook;
+    budget_begin(L, ms, h);
+}
+
+
+/* raises the error that aborted the last match, if any */
+static void check_match_status(lua_State* L, const MatchState* ms, LuaHook* h) {
+    if (l_unlikely(ms->status != STATUS_OK)) {
+        Status st = ms->status;
+        if (st == STATUS_TIMEOUT && h->budget_bound)
+            st = STATUS_BUDGET;
+        budget_settle(ms, h);
+        lua_pushstring(L, status_message(st));
+        lua_error(L);
     }
 }
 
@@ -436,20 +478,20 @@ static const char* lmemfind(const char* s1, size_t l1,
 ** its length and put its address in '*cap'. If it is an integer
 ** (a position), push it on the stack and return CAP_POSITION.
 */
-static size_t get_onecapture(MatchState* ms, int i, const char* s,
+static size_t get_onecapture(lua_State* L, MatchState* ms, int i, const char* s,
     const char* e, const char** cap) {
     if (i >= ms->level) {
         if (l_unlikely(i != 0))
-            luaL_error(ms->L, "invalid capture index %%%d", i + 1);
+            luaL_error(L, "invalid capture index %%%d", i + 1);
         *cap = s;
         return e - s;
     } else {
         ptrdiff_t capl = ms->capture[i].len;
         *cap = ms->capture[i].init;
         if (l_unlikely(capl == CAP_UNFINISHED))
-            luaL_error(ms->L, "unfinished capture");
+            luaL_error(L, "unfinished capture");
         else if (capl == CAP_POSITION)
-            lua_pushinteger(ms->L, (ms->capture[i].init - ms->src_init) + 1);
+            lua_pushinteger(L, (ms->capture[i].init - ms->src_init) + 1);
         return capl;
     }
 }
@@ -458,26 +500,52 @@ static size_t get_onecapture(MatchState* ms, int i, const char* s,
 /*
 ** Push the i-th capture on the stack.
 */
-static void push_onecapture(MatchState* ms, int i, const char* s,
+static void push_onecapture(lua_State* L, MatchState* ms, int i, const char* s,
     const char* e) {
     const char* cap;
-    ptrdiff_t l = get_onecapture(ms, i, s, e, &cap);
+    ptrdiff_t l = get_onecapture(L, ms, i, s, e, &cap);
     if (l != CAP_POSITION)
-        lua_pushlstring(ms->L, cap, l);
+        lua_pushlstring(L, cap, l);
     /* else position was already pushed */
 }
 
 
-static int push_captures(MatchState* ms, const char* s, const char* e) {
+static int push_captures(lua_State* L, MatchState* ms, const char* s, const char* e) {
     int i;
     int nlevels = (ms->level == 0 && s) ? 1 : ms->level;
-    luaL_checkstack(ms->L, nlevels, "too many captures");
+    luaL_checkstack(L, nlevels, "too many captures");
     for (i = 0; i < nlevels; i++)
-        push_onecapture(ms, i, s, e);
+        push_onecapture(L, ms, i, s, e);
     return nlevels;  /* number of strings pushed */
 }
 
 
+/*
+** Pushes the start and end of the match 's'..'e' and then of each
+** capture, numbered as 'find' does (the end inclusive), without making
+** any string. A position capture is the empty span at its position.
+*/
+static int push_positions(lua_State* L, MatchState* ms, const char* s, const char* e) {
+    int n = ms->level;
+    luaL_checkstack(L, 2 + 2 * n, "too many captures");
+    lua_pushinteger(L, (s - ms->src_init) + 1);
+    lua_pushinteger(L, e - ms->src_init);
+    for (int i = 0; i < n; i++) {
+        ptrdiff_t l = ms->capture[i].len;
+        ptrdiff_t b = ms->capture[i].init - ms->src_init;
+        if (l_unlikely(l == CAP_UNFINISHED))
+            luaL_error(L, "unfinished capture");
+        lua_pushinteger(L, b + 1);
+        lua_pushinteger(L, b + (l == CAP_POSITION ? 0 : l));
+    }
+    return 2 + 2 * n;
+}
+
+
+#define L_ESC		'%'
+#define SPECIALS	"^$*+?.([%-"
+
+
 /* check whether pattern has no special characters */
 static int nospecials(const char* p, size_t l) {
     size_t upto = 0;
@@ -490,185 +558,864 @@ static int nospecials(const char* p, size_t l) {
 }
 
 
-static void prepstate(MatchState* ms, lua_State* L,
-    const char* s, size_t ls, const char* p, size_t lp) {
-    ms->L = L;
-    ms->matchdepth = MAXCCALLS;
-    ms->src_init = s;
-    ms->src_end = s + ls;
-    ms->p_end = p + lp;
-}
+/*
+** {======================================================
+** COMPILED PATTERNS
+** =======================================================
+*/
 
+#define PATTERN_MT	"CHADRegex.Pattern"
+#define REPLACEMENT_MT	"CHADRegex.Replacement"
 
-static void reprepstate(MatchState* ms) {
-    ms->level = 0;
-    lua_assert(ms->matchdepth == MAXCCALLS);
-}
+#if !defined(PATTERN_CACHE_SIZE)
+#define PATTERN_CACHE_SIZE	256
+#endif
 
-inline void ms_setup_hook(MatchState &ms, int refCb, size_t maxIter, bool limited, std::chrono::nanoseconds timeout){
-    ms.hook.startPoint = std::chrono::high_resolution_clock::now();
-    ms.hook.maxIterateCallback = maxIter;
-    ms.hook.ref_callback = refCb;
-    ms.hook.timeLimit = timeout;
-    ms.hook.limited = limited;
-    ms.hook.curIterateCallback = 0;
-    ms.hook.current = 0;
-}
 
-static int str_find_aux(lua_State* L, int find) {
-    size_t ls, lp;
-    const char* s = luaL_checklstring(L, 1, &ls);
-    const char* p = luaL_checklstring(L, 2, &lp);
-    size_t init = posrelatI(luaL_optinteger(L, 3, 1), ls) - 1;
-    if (init > ls) {  /* start after string's end? */
-        luaL_pushfail(L);  /* cannot find anything */
-        return 1;
-    }
-    /* explicit request or no special characters? */
-    if (find && lua_isboolean(L, 4) && (lua_toboolean(L, 4) || nospecials(p, lp))) {
-        /* do a plain search */
-        const char* s2 = lmemfind(s + init, ls - init, p, lp);
-        if (s2) {
-            lua_pushinteger(L, (s2 - s) + 1);
-            lua_pushinteger(L, (s2 - s) + lp);
-            return 2;
-        }
-    } else {
-        MatchState ms;
+/* userdata returned by 'CHADRegex.compile' */
+typedef struct PatternUD {
+    std::shared_ptr<const Program> prog;
+} PatternUD;
 
-        if (lua_isfunction(L, find ? 5 : 4)) {
-            lua_Integer maxIter = luaL_optinteger(L, find ? 6 : 5, (size_t)1e5);
-            lua_pushvalue(L, find ? 5 : 4);
-            
-            ms_setup_hook(ms, lua_ref(L, LUA_REGISTRYINDEX), maxIter, false, 0ns);
-        } else if(lua_isnumber(L, find ? 5 : 4)) {
-            lua_Integer maxIter = luaL_optinteger(L, find ? 6 : 5, (size_t)1e5);
+/* userdata returned by 'CHADRegex.compileReplacement' */
+typedef struct ReplacementUD {
+    std::shared_ptr<const Replacement> repl;
+} ReplacementUD;
 
-            ms_setup_hook(ms, 0, maxIter, true, std::chrono::nanoseconds((long long)(double)lua_tonumber(L, find ? 5 : 4)));
-        } else {
-            ms_setup_hook(ms, 0, (size_t)1e5, false, 0ns);
-        }
+/* key flag of cached gsub templates, next to the CompileFlags of patterns */
+#define CACHE_REPLACEMENT	0x80000000u
 
-        const char* s1 = s + init;
-        int anchor = (*p == '^');
-        if (anchor) {
-            p++; lp--;  /* skip anchor character */
+
+/*
+** Bounded LRU of compiled string patterns and gsub templates, one per
+** lua_State (it is the first upvalue of every module function). Entries
+** only hold a registry reference to the userdata: a call keeps the
+** userdata on its own stack, so an entry evicted by a nested call (e.g.
+** from a callback) cannot free the program under our feet, even across
+** a 'lua_error'.
+*/
+struct PatternCache {
+    struct Key {
+        std::string_view text;
+        unsigned flags;
+        bool operator==(const Key& o) const {
+            return flags == o.flags && text == o.text;
         }
-        prepstate(&ms, L, s, ls, p, lp);
-        do {
-            const char* res;
-            reprepstate(&ms);
-            if ((res = match(&ms, s1, p)) != NULL) {
-                if (find) {
-                    lua_pushinteger(L, (s1 - s) + 1);  /* start */
-                    lua_pushinteger(L, res - s);   /* end */
-                    return push_captures(&ms, NULL, 0) + 2;
-                } else
-                    return push_captures(&ms, s1, res);
-            }
-        } while (s1++ < ms.src_end && !anchor);
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const {
+            return std::hash<std::string_view>()(k.text) ^ k.flags;
+        }
+    };
+    struct Entry {
+        Key key;  /* 'text' points into the 'source' of 'compiled' */
+        const void* compiled;  /* Program, or Replacement with CACHE_REPLACEMENT */
+        int ref;
+    };
+
+    size_t capacity = PATTERN_CACHE_SIZE;
+    std::list<Entry> lru;  /* most recently used first */
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+};
+
+
+static PatternCache* cache_of(lua_State* L) {
+    return (PatternCache*)lua_touserdata(L, lua_upvalueindex(1));
+}
+
+
+static void cache_trim(lua_State* L, PatternCache* c, size_t capacity) {
+    while (c->lru.size() > capacity) {
+        PatternCache::Entry& e = c->lru.back();
+        c->index.erase(e.key);
+        luaL_unref(L, LUA_REGISTRYINDEX, e.ref);
+        c->lru.pop_back();
     }
-    luaL_pushfail(L);  /* not found */
-    return 1;
 }
 
 
-static int str_find(lua_State* L) {
-    return str_find_aux(L, 1);
+static void push_program(lua_State* L, std::shared_ptr<const Program>&& prog) {
+    PatternUD* ud = (PatternUD*)lua_newuserdata(L, sizeof(PatternUD));
+    new (ud) PatternUD{ std::move(prog) };
+    luaL_getmetatable(L, PATTERN_MT);
+    lua_setmetatable(L, -2);
 }
 
 
-static int str_match(lua_State* L) {
-    return str_find_aux(L, 0);
+/*
+** Compiles 'p' and pushes the new pattern userdata. On error pushes the
+** message instead and returns NULL; nothing with a destructor is alive
+** by the time the caller raises it.
+*/
+static const Program* compile_to_stack(lua_State* L, const char* p, size_t lp,
+    unsigned flags) {
+    std::shared_ptr<const Program> prog;
+    int arg = 0;
+    Status st = compile(p, lp, flags, prog, &arg);
+    if (st != STATUS_OK) {
+        char msg[128];
+        format_status(st, arg, msg, sizeof(msg));
+        lua_pushstring(L, msg);
+        return NULL;
+    }
+    const Program* raw = prog.get();
+    push_program(L, std::move(prog));
+    return raw;
 }
 
 
-/* state for 'gmatch' */
-typedef struct GMatchState {
-    const char* src;  /* current position */
-    const char* p;  /* pattern */
-    const char* lastmatch;  /* end of last match */
-    MatchState ms;  /* match state */
-} GMatchState;
+/* on a hit pushes the cached userdata and returns what it holds, else NULL */
+static const void* cache_lookup(lua_State* L, PatternCache* c,
+    const char* p, size_t lp, unsigned flags) {
+    auto it = c->index.find(PatternCache::Key{ std::string_view(p, lp), flags });
+    if (it == c->index.end())
+        return NULL;
+    c->lru.splice(c->lru.begin(), c->lru, it->second);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, it->second->ref);
+    return it->second->compiled;
+}
 
 
-static int gmatch_aux(lua_State* L) {
-    GMatchState* gm = (GMatchState*)lua_touserdata(L, lua_upvalueindex(3));
-    const char* src;
-    gm->ms.L = L;
-    for (src = gm->src; src <= gm->ms.src_end; src++) {
-        const char* e;
-        reprepstate(&gm->ms);
-        if ((e = match(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
-            gm->src = gm->lastmatch = e;
-            return push_captures(&gm->ms, src, e);
-        }
-    }
-    return 0;  /* not found */
+/* remembers the userdata on top of the stack, which holds 'compiled' */
+static void cache_insert(lua_State* L, PatternCache* c, std::string_view source,
+    unsigned flags, const void* compiled) {
+    if (c->capacity == 0)
+        return;
+    lua_pushvalue(L, -1);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    c->lru.push_front(PatternCache::Entry{ PatternCache::Key{ source, flags }, compiled, ref });
+    c->index.emplace(c->lru.front().key, c->lru.begin());
+    cache_trim(L, c, c->capacity);
 }
 
 
-static int gmatch(lua_State* L) {
-    size_t ls, lp;
-    const char* s = luaL_checklstring(L, 1, &ls);
-    const char* p = luaL_checklstring(L, 2, &lp);
-    size_t init = posrelatI(luaL_optinteger(L, 3, 1), ls) - 1;
-    GMatchState* gm;
-    //lua_settop(L, 2);  /* keep strings on closure to avoid being collected */
-    gm = (GMatchState*)lua_newuserdata(L, sizeof(GMatchState));
-    memset(gm, 0, sizeof(GMatchState));
-    lua_insert(L, 3);
-    
-    if (lua_isfunction(L, 5)) {
-        lua_Integer maxIter = luaL_optinteger(L, 6, (size_t)1e5);
-        lua_pushvalue(L, 5);
+/*
+** Pushes the (cached) pattern userdata for 'p' and returns its program.
+** Returns NULL with the error message pushed if 'p' is malformed.
+*/
+static const Program* cache_fetch(lua_State* L, PatternCache* c,
+    const char* p, size_t lp, unsigned flags) {
+    const Program* prog = (const Program*)cache_lookup(L, c, p, lp, flags);
+    if (prog != NULL)  /* hit: skip parsing altogether */
+        return prog;
+    prog = compile_to_stack(L, p, lp, flags);
+    if (prog != NULL)
+        cache_insert(L, c, prog->source, flags, prog);
+    return prog;
+}
 
-        ms_setup_hook(gm->ms, lua_ref(L, LUA_REGISTRYINDEX), maxIter, false, 0ns);
-    } else if (lua_isnumber(L, 5)) {
-        lua_Integer maxIter = luaL_optinteger(L, 6, (size_t)1e5);
 
-        ms_setup_hook(gm->ms, 0, maxIter, true, std::chrono::nanoseconds((long long)(double)lua_tonumber(L, 5)));
+/*
+** Argument 'idx' may be a pattern string or a compiled pattern. Replaces
+** it with the compiled userdata (so it stays alive for the whole call)
+** and returns the program.
+*/
+static const Program* check_program(lua_State* L, int idx, unsigned flags) {
+    const Program* prog;
+    if (lua_type(L, idx) == LUA_TUSERDATA) {
+        prog = ((PatternUD*)luaL_checkudata(L, idx, PATTERN_MT))->prog.get();
+        if (!((flags & CF_NOANCHOR) && prog->anchor))
+            return prog;
+        /* '^' means something else here; use the matching variant */
+        prog = cache_fetch(L, cache_of(L), prog->source.data(), prog->source.size(), flags);
     } else {
-        ms_setup_hook(gm->ms, 0, (size_t)1e5, false, 0ns);
+        size_t lp;
+        const char* p = luaL_checklstring(L, idx, &lp);
+        prog = cache_fetch(L, cache_of(L), p, lp, flags);
     }
-
-    lua_settop(L, 3);
-
-    if (init > ls)  /* start after string's end? */
-        init = ls + 1;  /* avoid overflows in 's + init' */
-    prepstate(&gm->ms, L, s, ls, p, lp);
-    gm->src = s + init; gm->p = p; gm->lastmatch = NULL;
-    lua_pushcclosure(L, gmatch_aux, 3);
-    return 1;
+    if (prog == NULL)
+        lua_error(L);
+    lua_replace(L, idx);
+    return prog;
 }
 
 
-static void add_s(MatchState* ms, luaL_Buffer* b, const char* s,
-    const char* e) {
-    size_t l;
-    lua_State* L = ms->L;
-    const char* news = lua_tolstring(L, 3, &l);
-    const char* p;
-    while ((p = (char*)memchr(news, L_ESC, l)) != NULL) {
-        luaL_addlstring(b, news, p - news);
-        p++;  /* skip ESC */
-        if (*p == L_ESC)  /* '%%' */
-            luaL_addchar(b, *p);
-        else if (*p == '0')  /* '%0' */
-            luaL_addlstring(b, s, e - s);
-        else if (isdigit(uchar(*p))) {  /* '%n' */
-            const char* cap;
-            ptrdiff_t resl = get_onecapture(ms, *p - '1', s, e, &cap);
-            if (resl == CAP_POSITION)
-                luaL_addvalue(b);  /* add position to accumulated result */
-            else
-                luaL_addlstring(b, cap, resl);
-        } else
-            luaL_error(L, "invalid use of '%c' in replacement string", L_ESC);
-        l -= p + 1 - news;
-        news = p + 1;
+/* text of pattern argument 'idx' without compiling it (for plain searches) */
+static const char* pattern_text(lua_State* L, int idx, size_t* lp, int* literal) {
+    if (lua_type(L, idx) == LUA_TUSERDATA) {
+        const Program* prog = ((PatternUD*)luaL_checkudata(L, idx, PATTERN_MT))->prog.get();
+        *lp = prog->source.size();
+        *literal = prog->literal;
+        return prog->source.data();
+    } else {
+        const char* p = luaL_checklstring(L, idx, lp);
+        *literal = nospecials(p, *lp);
+        return p;
+    }
+}
+
+
+/*
+** Pushes the (cached) template userdata for the replacement 'r' and
+** returns the template. Returns NULL with the error message pushed if
+** 'r' is malformed.
+*/
+static const Replacement* template_fetch(lua_State* L, PatternCache* c,
+    const char* r, size_t lr) {
+    const Replacement* repl = (const Replacement*)cache_lookup(L, c, r, lr, CACHE_REPLACEMENT);
+    if (repl != NULL)
+        return repl;
+    std::shared_ptr<const Replacement> compiled;
+    Status st = compile_replacement(r, lr, compiled);
+    if (st != STATUS_OK) {
+        char msg[128];
+        format_status(st, 0, msg, sizeof(msg));
+        lua_pushstring(L, msg);
+        return NULL;
+    }
+    repl = compiled.get();
+    ReplacementUD* ud = (ReplacementUD*)lua_newuserdata(L, sizeof(ReplacementUD));
+    new (ud) ReplacementUD{ std::move(compiled) };
+    luaL_getmetatable(L, REPLACEMENT_MT);
+    lua_setmetatable(L, -2);
+    cache_insert(L, c, repl->source, CACHE_REPLACEMENT, repl);
+    return repl;
+}
+
+
+/*
+** Argument 'idx' may be a string (or number) gsub replacement or a
+** compiled template. Replaces it with the template userdata and returns
+** the template. A malformed string is not an error yet, since stock gsub
+** only complains once a match expands it: NULL is returned and 'idx' is
+** left as it is.
+*/
+static const Replacement* check_template(lua_State* L, int idx) {
+    if (lua_type(L, idx) == LUA_TUSERDATA)
+        return ((ReplacementUD*)luaL_checkudata(L, idx, REPLACEMENT_MT))->repl.get();
+    size_t lr;
+    const char* r = lua_tolstring(L, idx, &lr);
+    const Replacement* repl = template_fetch(L, cache_of(L), r, lr);
+    if (repl == NULL) {
+        lua_pop(L, 1);  /* the message */
+        return NULL;
+    }
+    lua_replace(L, idx);
+    return repl;
+}
+
+
+static int pattern_gc(lua_State* L) {
+    PatternUD* ud = (PatternUD*)luaL_checkudata(L, 1, PATTERN_MT);
+    ud->~PatternUD();
+    return 0;
+}
+
+
+static int pattern_tostring(lua_State* L) {
+    PatternUD* ud = (PatternUD*)luaL_checkudata(L, 1, PATTERN_MT);
+    lua_pushfstring(L, PATTERN_MT ": %s", ud->prog->source.c_str());
+    return 1;
+}
+
+
+static int replacement_gc(lua_State* L) {
+    ReplacementUD* ud = (ReplacementUD*)luaL_checkudata(L, 1, REPLACEMENT_MT);
+    ud->~ReplacementUD();
+    return 0;
+}
+
+
+static int replacement_tostring(lua_State* L) {
+    ReplacementUD* ud = (ReplacementUD*)luaL_checkudata(L, 1, REPLACEMENT_MT);
+    lua_pushfstring(L, REPLACEMENT_MT ": %s", ud->repl->source.c_str());
+    return 1;
+}
+
+
+static int cache_gc(lua_State* L) {
+    PatternCache* c = (PatternCache*)lua_touserdata(L, 1);
+    c->~PatternCache();
+    return 0;
+}
+
+
+/* CHADRegex.compile(pattern) */
+static int module_compile(lua_State* L) {
+    check_program(L, 1, CF_NONE);
+    lua_settop(L, 1);
+    return 1;
+}
+
+
+/* CHADRegex.compileReplacement(replacement): a gsub template parsed once */
+static int module_compile_replacement(lua_State* L) {
+    if (lua_type(L, 1) != LUA_TUSERDATA)
+        luaL_checkstring(L, 1);
+    if (check_template(L, 1) == NULL)
+        return luaL_error(L, "invalid use of '%c' in replacement string", L_ESC);
+    lua_settop(L, 1);
+    return 1;
+}
+
+
+/* CHADRegex.option(name [, value]): returns the value before the call */
+static int module_option(lua_State* L) {
+    static const char* const options[] = { "cacheSize", "maxStackBytes", "maxMemoBytes", "stepBudget", "stepNs",
+        "budgetNs", "budgetPeriodNs", "asyncThreads", "stats", "slowMatchNs", "slowLogSize", "dfa", NULL };
+    PatternCache* c = cache_of(L);
+    int set = !lua_isnoneornil(L, 2);
+    switch (luaL_checkoption(L, 1, NULL, options)) {
+    case 0: {
+        lua_pushinteger(L, (lua_Integer)c->capacity);
+        if (set) {
+            lua_Integer n = luaL_checkinteger(L, 2);
+            luaL_argcheck(L, n >= 0, 2, "cache size must be non-negative");
+            c->capacity = (size_t)n;
+            cache_trim(L, c, c->capacity);
+        }
+        break;
+    }
+    case 1: {
+        lua_pushinteger(L, (lua_Integer)get_max_stack_bytes());
+        if (set) {
+            lua_Integer n = luaL_checkinteger(L, 2);
+            luaL_argcheck(L, n > 0, 2, "stack bound must be positive");
+            set_max_stack_bytes((size_t)n);
+        }
+        break;
+    }
+    case 2: {
+        lua_pushinteger(L, (lua_Integer)get_max_memo_bytes());
+        if (set) {
+            lua_Integer n = luaL_checkinteger(L, 2);
+            luaL_argcheck(L, n >= 0, 2, "memo bound must be non-negative");
+            set_max_memo_bytes((size_t)n);
+        }
+        break;
+    }
+    case 3: {
+        lua_pushboolean(L, get_step_budget());
+        if (set) {
+            luaL_checktype(L, 2, LUA_TBOOLEAN);
+            set_step_budget(lua_toboolean(L, 2) != 0);
+        }
+        break;
+    }
+    case 4: {
+        lua_pushnumber(L, (lua_Number)get_step_ns());
+        if (set) {
+            lua_Number ns = luaL_checknumber(L, 2);
+            luaL_argcheck(L, ns > 0, 2, "step cost must be positive");
+            set_step_ns((double)ns);
+        }
+        break;
+    }
+    case 5: {
+        lua_pushnumber(L, (lua_Number)get_budget_ns());
+        if (set) {
+            lua_Number ns = luaL_checknumber(L, 2);
+            luaL_argcheck(L, ns >= 0, 2, "budget must be non-negative");
+            set_budget_ns((uint64_t)ns);
+        }
+        break;
+    }
+    case 6: {
+        lua_pushnumber(L, (lua_Number)get_budget_period_ns());
+        if (set) {
+            lua_Number ns = luaL_checknumber(L, 2);
+            luaL_argcheck(L, ns > 0, 2, "period must be positive");
+            set_budget_period_ns((uint64_t)ns);
+        }
+        break;
+    }
+    case 7: {
+        lua_pushinteger(L, (lua_Integer)get_async_threads());
+        if (set) {
+            lua_Integer n = luaL_checkinteger(L, 2);
+            luaL_argcheck(L, n >= 1 && n <= 64, 2, "thread count out of range");
+            set_async_threads((size_t)n);
+        }
+        break;
+    }
+    case 8: {
+        lua_pushboolean(L, get_stats_enabled());
+        if (set) {
+            luaL_checktype(L, 2, LUA_TBOOLEAN);
+            set_stats_enabled(lua_toboolean(L, 2) != 0);
+        }
+        break;
+    }
+    case 9: {
+        lua_pushnumber(L, (lua_Number)get_slow_match_ns());
+        if (set) {
+            lua_Number ns = luaL_checknumber(L, 2);
+            luaL_argcheck(L, ns >= 0, 2, "threshold must be non-negative");
+            set_slow_match_ns((uint64_t)ns);
+        }
+        break;
+    }
+    case 10: {
+        lua_pushinteger(L, (lua_Integer)get_slow_log_size());
+        if (set) {
+            lua_Integer n = luaL_checkinteger(L, 2);
+            luaL_argcheck(L, n >= 0, 2, "log size must be non-negative");
+            set_slow_log_size((size_t)n);
+        }
+        break;
+    }
+    case 11: {
+        lua_pushboolean(L, get_dfa_enabled());
+        if (set) {
+            luaL_checktype(L, 2, LUA_TBOOLEAN);
+            set_dfa_enabled(lua_toboolean(L, 2) != 0);
+        }
+        break;
+    }
+    }
+    return 1;
+}
+
+
+/*
+** CHADRegex.budget(ownerId, reset = false): ns the owner may still spend
+** right now; with 'reset' its debt is forgotten first (the id is reused)
+*/
+static int module_budget(lua_State* L) {
+    lua_Integer owner = luaL_checkinteger(L, 1);
+    if (lua_toboolean(L, 2))
+        budget_reset(owner);
+    lua_pushnumber(L, (lua_Number)budget_available(owner));
+    return 1;
+}
+
+/* }====================================================== */
+
+
+static int str_find_aux(lua_State* L, int find, int positions) {
+    size_t ls, lp;
+    int literal = 0;
+    const char* s = check_subject(L, 1, &ls);
+    const char* p = NULL;
+    size_t init = posrelatI(luaL_optinteger(L, 3, 1), ls) - 1;
+    if (init > ls) {  /* start after string's end? */
+        luaL_pushfail(L);  /* cannot find anything */
+        return 1;
+    }
+    if (find && lua_isboolean(L, 4))
+        p = pattern_text(L, 2, &lp, &literal);
+    /* explicit request or no special characters? */
+    if (p != NULL && (lua_toboolean(L, 4) || literal)) {
+        /* do a plain search */
+        const char* s2 = find_bytes(s + init, s + ls, p, lp);
+        if (s2) {
+            lua_pushinteger(L, (s2 - s) + 1);
+            lua_pushinteger(L, (s2 - s) + lp);
+            return 2;
+        }
+    } else {
+        MatchState ms;
+        LuaHook hook;
+        const Program* prog = check_program(L, 2, CF_NONE);
+        const char* s1 = s + init;
+        int anchor = prog->anchor;
+        prepstate(&ms, s, ls, prog);
+        setup_lua_hook(L, &ms, &hook, find ? 5 : 4);
+        const char* last = last_start(prog, s1, ms.src_end);
+        const char *b, *e;
+        DfaResult dr = DFA_NOMATCH;
+        if (may_match(prog, s1, ms.src_end)) {
+            reprepstate(&ms);
+            dr = dfa_search(&ms, s1, &b, &e);
+            check_match_status(L, &ms, &hook);
+        }
+        if (dr == DFA_MATCH) {  /* no captures: just the whole match */
+            budget_settle(&ms, &hook);
+            if (find) {
+                lua_pushinteger(L, (b - s) + 1);
+                lua_pushinteger(L, e - s);
+                return 2;
+            } else if (positions)
+                return push_positions(L, &ms, b, e);
+            else
+                return push_captures(L, &ms, b, e);
+        }
+        if (dr == DFA_UNAVAILABLE) do {  /* back to the backtracker */
+            const char* res;
+            if (!anchor &&  /* skip offsets the match cannot start at */
+                (s1 = next_start(prog, s1, ms.src_end)) > last)
+                break;
+            reprepstate(&ms);
+            if ((res = match(&ms, s1, prog->items.data())) != NULL) {
+                budget_settle(&ms, &hook);
+                if (find) {
+                    lua_pushinteger(L, (s1 - s) + 1);  /* start */
+                    lua_pushinteger(L, res - s);   /* end */
+                    return push_captures(L, &ms, NULL, 0) + 2;
+                } else if (positions)
+                    return push_positions(L, &ms, s1, res);
+                else
+                    return push_captures(L, &ms, s1, res);
+            }
+            check_match_status(L, &ms, &hook);
+        } while (s1++ < last && !anchor);
+        budget_settle(&ms, &hook);
+    }
+    luaL_pushfail(L);  /* not found */
+    return 1;
+}
+
+
+static int str_find(lua_State* L) {
+    return str_find_aux(L, 1, 0);
+}
+
+
+static int str_match(lua_State* L) {
+    return str_find_aux(L, 0, 0);
+}
+
+
+/*
+** CHADRegex.matchPos(string, pattern, startPos = 1, callback or timeOutNS,
+** everySimpleStep, ownerId): the start and end of the match, then of
+** each capture, instead of the captured strings.
+*/
+static int str_match_pos(lua_State* L) {
+    return str_find_aux(L, 0, 1);
+}
+
+
+/*
+** Walks the occurrences for 'findAll' and 'count': non-overlapping plain
+** occurrences, or the matches gsub would replace. Their offsets go to
+** 'spans' (start and end pairs) unless it is NULL; returns how many.
+** Errors are left in 'ms->status' for the caller to raise.
+*/
+static size_t find_all_walk(MatchState* ms, const Program* prog,
+    const char* p, size_t lp, size_t init, size_t max, std::vector<size_t>* spans) {
+    const char* s = ms->src_init;
+    const char* src = s + init;
+    size_t n = 0;
+    if (prog == NULL) {  /* plain */
+        const char* hit;
+        while (n < max && src <= ms->src_end &&
+            (hit = find_bytes(src, ms->src_end, p, lp)) != NULL) {
+            if (spans) {
+                spans->push_back(hit - s);
+                spans->push_back(hit - s + lp);
+            }
+            n++;
+            src = hit + (lp > 0 ? lp : 1);  /* "" is found at every position */
+        }
+        return n;
+    }
+    const char* lastmatch = NULL;
+    const char* last = last_start(prog, src, ms->src_end);
+    if (!may_match(prog, src, ms->src_end))
+        return 0;
+    while (n < max) {
+        const char* e;
+        if (!prog->anchor && (src = next_start(prog, src, ms->src_end)) > last)
+            break;
+        reprepstate(ms);
+        if ((e = match(ms, src, prog->items.data())) != NULL && e != lastmatch) {
+            if (spans) {
+                spans->push_back(src - s);
+                spans->push_back(e - s);
+            }
+            n++;
+            src = lastmatch = e;
+        } else if (ms->status != STATUS_OK || src >= ms->src_end)
+            break;
+        else src++;
+        if (prog->anchor) break;
+    }
+    return n;
+}
+
+
+/*
+** CHADRegex.findAll(string, needle, noPatterns = false, startPos = 1, maxResults = nil,
+** callback or timeOutNS, everySimpleStep, ownerId) returns the start and the
+** end positions of every occurrence as two arrays; CHADRegex.count(...) with
+** the same arguments only counts them.
+*/
+static int find_all_aux(lua_State* L, int count) {
+    size_t ls, lp;
+    int literal = 0;
+    const char* s = check_subject(L, 1, &ls);
+    const char* p = pattern_text(L, 2, &lp, &literal);
+    const Program* prog = NULL;
+    size_t init = posrelatI(luaL_optinteger(L, 4, 1), ls) - 1;
+    lua_Integer max_n = luaL_optinteger(L, 5, ls + 1);
+    size_t n = 0;
+    MatchState ms;
+    LuaHook hook;
+    if (!lua_toboolean(L, 3) && !literal) {
+        prog = check_program(L, 2, CF_NONE);
+        prepstate(&ms, s, ls, prog);
+    } else
+        prepstate_set(&ms, s, ls);  /* no matcher: only the subject is needed */
+    setup_lua_hook(L, &ms, &hook, 6);
+    if (init > ls || max_n <= 0) {
+        budget_settle(&ms, &hook);
+        if (count) {
+            lua_pushinteger(L, 0);
+            return 1;
+        }
+        lua_newtable(L);
+        lua_newtable(L);
+        return 2;
+    }
+    if (count)
+        n = find_all_walk(&ms, prog, p, lp, init, (size_t)max_n, NULL);
+    else {
+        std::vector<size_t> spans;
+        n = find_all_walk(&ms, prog, p, lp, init, (size_t)max_n, &spans);
+        if (ms.status == STATUS_OK) {
+            lua_createtable(L, (int)n, 0);
+            lua_createtable(L, (int)n, 0);
+            for (size_t i = 0; i < n; i++) {
+                lua_pushinteger(L, (lua_Integer)spans[2 * i] + 1);
+                lua_rawseti(L, -3, (int)i + 1);
+                lua_pushinteger(L, (lua_Integer)spans[2 * i + 1]);
+                lua_rawseti(L, -2, (int)i + 1);
+            }
+        }
+    }
+    check_match_status(L, &ms, &hook);  /* after 'spans' is gone */
+    budget_settle(&ms, &hook);
+    if (count) {
+        lua_pushinteger(L, (lua_Integer)n);
+        return 1;
+    }
+    return 2;
+}
+
+
+static int find_all(lua_State* L) {
+    return find_all_aux(L, 0);
+}
+
+
+static int count_all(lua_State* L) {
+    return find_all_aux(L, 1);
+}
+
+
+/* state for 'gmatch' */
+typedef struct GMatchState {
+    const char* src;  /* current position */
+    const Item* p;  /* pattern */
+    const char* lastmatch;  /* end of last match */
+    int positions;  /* gmatchPos: offsets instead of captures */
+    MatchState ms;  /* match state */
+    LuaHook hook;
+} GMatchState;
+
+
+static int gmatch_aux(lua_State* L) {
+    GMatchState* gm = (GMatchState*)lua_touserdata(L, lua_upvalueindex(3));
+    const char* src;
+    gm->hook.L = L;
+    if (gm->hook.callback != 0)
+        gm->hook.callback = lua_upvalueindex(4);
+    budget_begin(L, &gm->ms, &gm->hook);
+    const char* last = last_start(gm->ms.prog, gm->ms.src_init, gm->ms.src_end);
+    for (src = gm->src; src <= last; src++) {
+        const char* e;
+        if ((src = next_start(gm->ms.prog, src, gm->ms.src_end)) > last)
+            break;
+        reprepstate(&gm->ms);
+        if ((e = match(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
+            gm->src = gm->lastmatch = e;
+            budget_settle(&gm->ms, &gm->hook);
+            if (gm->positions)
+                return push_positions(L, &gm->ms, src, e);
+            return push_captures(L, &gm->ms, src, e);
+        }
+        check_match_status(L, &gm->ms, &gm->hook);
+    }
+    budget_settle(&gm->ms, &gm->hook);
+    return 0;  /* not found */
+}
+
+
+static int gmatch_start(lua_State* L, int positions) {
+    size_t ls;
+    const char* s = check_subject(L, 1, &ls);
+    const Program* prog = check_program(L, 2, CF_NOANCHOR);
+    size_t init = posrelatI(luaL_optinteger(L, 3, 1), ls) - 1;
+    GMatchState* gm;
+    //lua_settop(L, 2);  /* keep strings on closure to avoid being collected */
+    gm = (GMatchState*)lua_newuserdata(L, sizeof(GMatchState));
+    memset(gm, 0, sizeof(GMatchState));
+    lua_insert(L, 3);
+    setup_lua_hook(L, &gm->ms, &gm->hook, 5);
+    lua_pushvalue(L, 5);  /* the callback or token lives on as upvalue 4 */
+    lua_replace(L, 4);
+    lua_settop(L, 4);
+
+    if (init > ls)  /* start after string's end? */
+        init = ls + 1;  /* avoid overflows in 's + init' */
+    prepstate(&gm->ms, s, ls, prog);
+    gm->src = s + init; gm->p = prog->items.data(); gm->lastmatch = NULL;
+    gm->positions = positions;
+    if (init <= ls && !may_match(prog, gm->src, gm->ms.src_end))
+        gm->src = s + ls + 1;  /* nothing to find */
+    lua_pushcclosure(L, gmatch_aux, 4);
+    return 1;
+}
+
+
+static int gmatch(lua_State* L) {
+    return gmatch_start(L, 0);
+}
+
+
+/*
+** CHADRegex.gmatchPos(string, pattern, startPos = 1, callback or timeOutNS,
+** everySimpleStep, ownerId): gmatch with the positions of 'matchPos'.
+*/
+static int gmatch_pos(lua_State* L) {
+    return gmatch_start(L, 1);
+}
+
+
+/* pushes the captures 'c' of one gmatchAll match as a table */
+static void push_capture_tuple(lua_State* L, const char* s, const Span* c, size_t width) {
+    lua_createtable(L, (int)width, 0);
+    for (size_t k = 0; k < width; k++) {
+        if (c[k].position)
+            lua_pushinteger(L, c[k].begin + 1);
+        else
+            lua_pushlstring(L, s + c[k].begin, c[k].end - c[k].begin);
+        lua_rawseti(L, -2, (int)k + 1);
+    }
+}
+
+
+/*
+** Pushes the gmatchAll result for 'n' matches of 'width' captures each:
+** an array with the capture of each match (a table of them if the
+** pattern has several), or with 'e2' an E2 table holding one array of
+** captures per match.
+*/
+static void push_gmatch_all(lua_State* L, const char* s, const std::vector<Span>& caps,
+    size_t n, size_t width, int e2) {
+    if (!e2) {
+        lua_createtable(L, (int)n, 0);
+        for (size_t i = 0; i < n; i++) {
+            const Span* c = &caps[i * width];
+            if (width > 1)
+                push_capture_tuple(L, s, c, width);
+            else if (c->position)
+                lua_pushinteger(L, c->begin + 1);
+            else
+                lua_pushlstring(L, s + c->begin, c->end - c->begin);
+            lua_rawseti(L, -2, (int)i + 1);
+        }
+        return;
+    }
+    lua_createtable(L, 0, 7);
+    lua_createtable(L, (int)n, 0);  /* n */
+    lua_createtable(L, (int)n, 0);  /* ntypes */
+    for (size_t i = 0; i < n; i++) {
+        push_capture_tuple(L, s, &caps[i * width], width);
+        lua_rawseti(L, -3, (int)i + 1);
+        lua_pushliteral(L, "r");
+        lua_rawseti(L, -2, (int)i + 1);
+    }
+    lua_setfield(L, -3, "ntypes");
+    lua_setfield(L, -2, "n");
+    lua_newtable(L);
+    lua_setfield(L, -2, "s");
+    lua_newtable(L);
+    lua_setfield(L, -2, "stypes");
+    lua_pushinteger(L, (lua_Integer)n);
+    lua_setfield(L, -2, "size");
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "istable");
+    lua_pushinteger(L, 0);
+    lua_setfield(L, -2, "depth");
+}
+
+
+/*
+** CHADRegex.gmatchAll(string, pattern, startPos = 1, maxMatches = nil,
+** e2Table = false, callback or timeOutNS, everySimpleStep, ownerId):
+** every gmatch match in one call, and their count. The captures are
+** gathered first, so the tables are created at their final size.
+*/
+static int gmatch_all(lua_State* L) {
+    size_t ls;
+    const char* s = check_subject(L, 1, &ls);
+    const Program* prog = check_program(L, 2, CF_NOANCHOR);
+    size_t init = posrelatI(luaL_optinteger(L, 3, 1), ls) - 1;
+    lua_Integer max_m = luaL_optinteger(L, 4, ls + 1);
+    int e2 = lua_toboolean(L, 5);
+    size_t width = prog->ncaptures > 0 ? prog->ncaptures : 1;
+    size_t n = 0;
+    MatchState ms;
+    LuaHook hook;
+    prepstate(&ms, s, ls, prog);
+    setup_lua_hook(L, &ms, &hook, 6);
+    {
+        std::vector<Span> caps;
+        const char* src = s + (init > ls ? ls + 1 : init);
+        const char* lastmatch = NULL;
+        const char* last = last_start(prog, s, ms.src_end);
+        if (src <= ms.src_end && !may_match(prog, src, ms.src_end))
+            src = ms.src_end + 1;  /* nothing to find */
+        while (src <= last && (lua_Integer)n < max_m) {
+            const char* e;
+            if ((src = next_start(prog, src, ms.src_end)) > last)
+                break;
+            reprepstate(&ms);
+            if ((e = match(&ms, src, prog->items.data())) != NULL && e != lastmatch) {
+                for (size_t i = 0; i < width; i++) {
+                    Span c;
+                    if (ms.level == 0) {  /* the whole match */
+                        c.begin = src - s;
+                        c.end = e - s;
+                    } else if (ms.capture[i].len == CAP_UNFINISHED) {
+                        ms.status = STATUS_UNFINISHED_CAPTURE;
+                        break;
+                    } else {
+                        c.begin = ms.capture[i].init - s;
+                        c.position = ms.capture[i].len == CAP_POSITION;
+                        c.end = c.begin + (c.position ? 0 : ms.capture[i].len);
+                    }
+                    caps.push_back(c);
+                }
+                if (ms.status != STATUS_OK)
+                    break;
+                n++;
+                src = lastmatch = e;
+            } else if (ms.status != STATUS_OK)
+                break;
+            else src++;
+        }
+        if (ms.status == STATUS_OK) {
+            budget_settle(&ms, &hook);
+            push_gmatch_all(L, s, caps, n, width, e2);
+        }
+    }
+    check_match_status(L, &ms, &hook);  /* after 'caps' is gone */
+    lua_pushinteger(L, (lua_Integer)n);
+    return 2;
+}
+
+
+static void add_s(lua_State* L, MatchState* ms, luaL_Buffer* b, const char* s,
+    const char* e, const Replacement* repl) {
+    if (repl == NULL)  /* malformed, see 'check_template' */
+        luaL_error(L, "invalid use of '%c' in replacement string", L_ESC);
+    for (const ReplacementPart& part : repl->parts) {
+        if (part.capture == REPL_LITERAL)
+            luaL_addlstring(b, repl->text.data() + part.offset, part.len);
+        else if (part.capture == 0)  /* '%0' */
+            luaL_addlstring(b, s, e - s);
+        else {  /* '%n' */
+            const char* cap;
+            ptrdiff_t resl = get_onecapture(L, ms, part.capture - 1, s, e, &cap);
+            if (resl == CAP_POSITION)
+                luaL_addvalue(b);  /* add position to accumulated result */
+            else
+                luaL_addlstring(b, cap, resl);
+        }
     }
-    luaL_addlstring(b, news, l);
 }
 
 
@@ -677,99 +1424,1283 @@ static void add_s(MatchState* ms, luaL_Buffer* b, const char* s,
 ** Return true if the original string was changed. (Function calls and
 ** table indexing resulting in nil or false do not change the subject.)
 */
-static int add_value(MatchState* ms, luaL_Buffer* b, const char* s,
-    const char* e, int tr) {
-    lua_State* L = ms->L;
-    switch (tr) {
-    case LUA_TFUNCTION: {  /* call the function */
-        int n;
-        lua_pushvalue(L, 3);  /* push the function */
-        n = push_captures(ms, s, e);  /* all captures as arguments */
-        lua_call(L, n, 1);  /* call it */
-        break;
+static int add_value(lua_State* L, MatchState* ms, luaL_Buffer* b, const char* s,
+    const char* e, int tr, const Replacement* repl) {
+    switch (tr) {
+    case LUA_TFUNCTION: {  /* call the function */
+        int n;
+        lua_pushvalue(L, 3);  /* push the function */
+        n = push_captures(L, ms, s, e);  /* all captures as arguments */
+        lua_call(L, n, 1);  /* call it */
+        break;
+    }
+    case LUA_TTABLE: {  /* index the table */
+        push_onecapture(L, ms, 0, s, e);  /* first capture is the index */
+        lua_gettable(L, 3);
+        break;
+    }
+    default: {  /* LUA_TNUMBER, LUA_TSTRING or a compiled template */
+        add_s(L, ms, b, s, e, repl);  /* add value to the buffer */
+        return 1;  /* something changed */
+    }
+    }
+    if (!lua_toboolean(L, -1)) {  /* nil or false? */
+        lua_pop(L, 1);  /* remove value */
+        luaL_addlstring(b, s, e - s);  /* keep original text */
+        return 0;  /* no changes */
+    } else if (l_unlikely(!lua_isstring(L, -1)))
+        return luaL_error(L, "invalid replacement value (a %s)",
+            luaL_typename(L, -1));
+    else {
+        luaL_addvalue(b);  /* add result to accumulator */
+        return 1;  /* something changed */
+    }
+}
+
+
+static int str_gsub(lua_State* L) {
+    size_t srcl;
+    const char* src = check_subject(L, 1, &srcl);  /* subject */
+    const Program* prog = check_program(L, 2, CF_NONE);  /* pattern */
+    const char* lastmatch = NULL;  /* end of last match */
+    int tr = lua_type(L, 3);  /* replacement type */
+    const Replacement* repl = NULL;  /* string replacement, parsed */
+    lua_Integer max_s = luaL_optinteger(L, 4, srcl + 1);  /* max replacements */
+    int anchor = prog->anchor;
+    lua_Integer n = 0;  /* replacement count */
+    int changed = 0;  /* change flag */
+    MatchState ms;
+    LuaHook hook;
+    luaL_Buffer b;
+    if (tr != LUA_TNUMBER && tr != LUA_TSTRING && tr != LUA_TUSERDATA &&
+        tr != LUA_TFUNCTION && tr != LUA_TTABLE) {
+        L->luabase->ArgError(3, "string/function/table");
+    }
+    if (tr != LUA_TFUNCTION && tr != LUA_TTABLE)
+        repl = check_template(L, 3);
+    //luaL_argexpected(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
+    //    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
+    //    "string/function/table");
+
+    prepstate(&ms, src, srcl, prog);
+    setup_lua_hook(L, &ms, &hook, 5);
+
+    luaL_buffinit(L, &b);
+    const char* last = last_start(prog, src, ms.src_end);
+    if (!may_match(prog, src, ms.src_end))
+        max_s = 0;  /* the subject comes back as it is */
+    while (n < max_s) {
+        const char* e;
+        if (!anchor) {  /* copy the offsets the match cannot start at */
+            const char* c = next_start(prog, src, ms.src_end);
+            if (c > last)
+                break;
+            luaL_addlstring(&b, src, c - src);
+            src = c;
+        }
+        reprepstate(&ms);  /* (re)prepare state for new match */
+        if ((e = match(&ms, src, prog->items.data())) != NULL && e != lastmatch) {  /* match? */
+            n++;
+            if (tr == LUA_TFUNCTION || tr == LUA_TTABLE)
+                budget_settle(&ms, &hook);  /* Lua code may raise from here */
+            changed = add_value(L, &ms, &b, src, e, tr, repl) | changed;
+            if (tr == LUA_TFUNCTION || tr == LUA_TTABLE)
+                budget_begin(L, &ms, &hook);  /* the Lua code is not charged */
+            src = lastmatch = e;
+        } else {
+            check_match_status(L, &ms, &hook);
+            if (src < ms.src_end)  /* otherwise, skip one character */
+                luaL_addchar(&b, *src++);
+            else break;  /* end of subject */
+        }
+        if (anchor) break;
+    }
+    budget_settle(&ms, &hook);
+    if (!changed) {  /* no changes? */
+        if (lua_type(L, 1) == LUA_TSTRING)
+            lua_pushvalue(L, 1);  /* return original string */
+        else
+            lua_pushlstring(L, ms.src_init, srcl);  /* a view comes back as a string */
+    }
+    else {  /* something changed */
+        luaL_addlstring(&b, src, ms.src_end - src);
+        luaL_pushresult(&b);  /* create and return new string */
+    }
+    lua_pushinteger(L, n);  /* number of substitutions */
+    return 2;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** PATTERN SETS
+** =======================================================
+*/
+
+#define PATTERNSET_MT	"CHADRegex.PatternSet"
+
+
+/* userdata returned by 'CHADRegex.compileSet' */
+typedef struct PatternSetUD {
+    std::shared_ptr<const PatternSet> set;
+} PatternSetUD;
+
+
+/*
+** Compiles the array of patterns at 'idx' (strings or compiled patterns;
+** with 'plain' strings are literals) and pushes the set userdata. On
+** error pushes the message instead and returns NULL.
+*/
+static const PatternSet* set_to_stack(lua_State* L, int idx, int plain) {
+    int n = (int)lua_objlen(L, idx);
+    Status st = STATUS_OK;
+    int bad = 0, arg = 0;
+    std::shared_ptr<const PatternSet> set;
+    {
+        std::vector<SetEntry> entries(n);
+        for (int i = 0; i < n && st == STATUS_OK && bad == 0; i++) {
+            SetEntry& en = entries[i];
+            lua_rawgeti(L, idx, i + 1);
+            if (lua_type(L, -1) == LUA_TUSERDATA) {
+                PatternUD* ud = (PatternUD*)lua_touserdata(L, -1);
+                int same = 0;
+                if (lua_getmetatable(L, -1)) {  /* checked without raising */
+                    luaL_getmetatable(L, PATTERN_MT);
+                    same = lua_rawequal(L, -1, -2);
+                    lua_pop(L, 2);
+                }
+                if (same) {
+                    en.prog = ud->prog;
+                    en.text = ud->prog->source;
+                } else
+                    bad = i + 1;
+            } else if (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER) {
+                size_t lp;
+                const char* p = lua_tolstring(L, -1, &lp);
+                en.text.assign(p, lp);
+                if (!plain && !nospecials(p, lp))
+                    st = compile(p, lp, CF_NONE, en.prog, &arg);
+                if (st != STATUS_OK)
+                    bad = i + 1;
+            } else
+                bad = i + 1;
+            lua_pop(L, 1);
+        }
+        if (bad == 0)
+            set = compile_set(std::move(entries));
+    }
+    if (bad != 0) {
+        char msg[128];
+        if (st != STATUS_OK)
+            format_status(st, arg, msg, sizeof(msg));
+        else
+            snprintf(msg, sizeof(msg), "string or compiled pattern expected");
+        lua_pushfstring(L, "pattern set entry %d: %s", bad, msg);
+        return NULL;
+    }
+    const PatternSet* raw = set.get();
+    PatternSetUD* ud = (PatternSetUD*)lua_newuserdata(L, sizeof(PatternSetUD));
+    new (ud) PatternSetUD{ std::move(set) };
+    luaL_getmetatable(L, PATTERNSET_MT);
+    lua_setmetatable(L, -2);
+    return raw;
+}
+
+
+/*
+** Argument 'idx' may be a compiled set or an array of patterns, which is
+** compiled on the spot (not cached) and replaced by the set.
+*/
+static const PatternSet* check_set(lua_State* L, int idx) {
+    if (lua_type(L, idx) != LUA_TTABLE)
+        return ((PatternSetUD*)luaL_checkudata(L, idx, PATTERNSET_MT))->set.get();
+    const PatternSet* set = set_to_stack(L, idx, 0);
+    if (set == NULL)
+        lua_error(L);
+    lua_replace(L, idx);
+    return set;
+}
+
+
+/* CHADRegex.compileSet(patterns, plain = false) */
+static int module_compile_set(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (set_to_stack(L, 1, lua_toboolean(L, 2)) == NULL)
+        lua_error(L);
+    return 1;
+}
+
+
+/*
+** CHADRegex.findAny(string, set, startPos = 1, callback or timeOutNS, everySimpleStep, ownerId)
+** One pass for every entry of 'set': the index of the entry with the
+** leftmost match (the first listed on a tie), its start and end, and its
+** captures; nil if no entry matches.
+*/
+static int module_find_any(lua_State* L) {
+    size_t ls;
+    const char* s = check_subject(L, 1, &ls);
+    const PatternSet* set = check_set(L, 2);
+    size_t init = posrelatI(luaL_optinteger(L, 3, 1), ls) - 1;
+    if (init > ls || set->entries.empty()) {
+        luaL_pushfail(L);
+        return 1;
+    }
+    MatchState ms;
+    LuaHook hook;
+    const char* start;
+    int entry;
+    prepstate_set(&ms, s, ls);
+    setup_lua_hook(L, &ms, &hook, 4);
+    const char* e = match_any(*set, &ms, s + init, &start, &entry);
+    check_match_status(L, &ms, &hook);
+    budget_settle(&ms, &hook);
+    if (e == NULL) {
+        luaL_pushfail(L);
+        return 1;
+    }
+    lua_pushinteger(L, entry + 1);
+    lua_pushinteger(L, (start - s) + 1);
+    lua_pushinteger(L, e - s);
+    return push_captures(L, &ms, NULL, 0) + 3;
+}
+
+
+static int set_gc(lua_State* L) {
+    PatternSetUD* ud = (PatternSetUD*)luaL_checkudata(L, 1, PATTERNSET_MT);
+    ud->~PatternSetUD();
+    return 0;
+}
+
+
+static int set_tostring(lua_State* L) {
+    PatternSetUD* ud = (PatternSetUD*)luaL_checkudata(L, 1, PATTERNSET_MT);
+    lua_pushfstring(L, PATTERNSET_MT ": %d entries", (int)ud->set->entries.size());
+    return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** TIME-SLICED JOBS
+** =======================================================
+*/
+
+#define JOB_MT	"CHADRegex.Job"
+
+enum JobKind { JOB_FIND, JOB_MATCH, JOB_GSUB };
+
+/*
+** A find/match/gsub that runs in slices: 'job:resume' matches until the
+** slice's deadline (or the owner's budget) runs out and then returns
+** false, keeping everything needed to go on in here. The subject, the
+** pattern and the replacement are pinned by registry references.
+*/
+typedef struct Job {
+    JobKind kind;
+    int busy;  /* a resume is running, or the last one raised an error */
+    int done;
+    int ref_subject, ref_pattern, ref_repl;
+    const Program* prog;
+    MatchState ms;
+    MatchCursor cursor;  /* the attempt in progress */
+    LuaHook hook;
+    const char* src;  /* next start position */
+    const char* lastmatch;  /* gsub: end of last match */
+    const char* res;  /* find/match: end of the match */
+    int tr;  /* gsub: replacement type */
+    const Replacement* repl;  /* gsub: string replacement, parsed */
+    lua_Integer max_s, n;  /* gsub: max and count of replacements */
+    std::string out;  /* gsub: result so far */
+} Job;
+
+
+static Job* check_job(lua_State* L, int idx) {
+    return (Job*)luaL_checkudata(L, idx, JOB_MT);
+}
+
+
+/* pushes a new job over subject 1 and pattern 2 (and replacement 3 for gsub) */
+static Job* new_job(lua_State* L, JobKind kind, size_t init) {
+    size_t ls;
+    const char* s = check_subject(L, 1, &ls);
+    const Program* prog = check_program(L, 2, CF_NONE);
+    Job* j = (Job*)lua_newuserdata(L, sizeof(Job));
+    new (j) Job();
+    luaL_getmetatable(L, JOB_MT);
+    lua_setmetatable(L, -2);
+    j->kind = kind;
+    j->prog = prog;
+    prepstate(&j->ms, s, ls, prog);
+    reprepstate(&j->ms);
+    setup_hook(&j->ms, 0, NULL, NULL);
+    j->src = s + (init > ls ? ls + 1 : init);
+    lua_pushvalue(L, 1);
+    j->ref_subject = lua_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, 2);
+    j->ref_pattern = lua_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, 3);
+    j->ref_repl = lua_ref(L, LUA_REGISTRYINDEX);
+    return j;
+}
+
+
+/* CHADRegex.findJob(s, pattern, init = 1) */
+static int module_find_job(lua_State* L) {
+    size_t ls;
+    check_subject(L, 1, &ls);
+    size_t init = posrelatI(luaL_optinteger(L, 3, 1), ls) - 1;
+    lua_settop(L, 2);
+    lua_pushnil(L);  /* no replacement: 'new_job' refs slot 3 */
+    Job* j = new_job(L, JOB_FIND, init);
+    if (j->src <= j->ms.src_end && !may_match(j->prog, j->src, j->ms.src_end))
+        j->src = j->ms.src_end + 1;  /* nothing to find */
+    return 1;
+}
+
+
+/* CHADRegex.matchJob(s, pattern, init = 1) */
+static int module_match_job(lua_State* L) {
+    int r = module_find_job(L);
+    check_job(L, -1)->kind = JOB_MATCH;
+    return r;
+}
+
+
+/* CHADRegex.gsubJob(s, pattern, replacement, maxReplaces = nil) */
+static int module_gsub_job(lua_State* L) {
+    size_t srcl;
+    check_subject(L, 1, &srcl);
+    int tr = lua_type(L, 3);
+    lua_Integer max_s = luaL_optinteger(L, 4, srcl + 1);
+    const Replacement* repl = NULL;
+    if (tr != LUA_TNUMBER && tr != LUA_TSTRING && tr != LUA_TUSERDATA &&
+        tr != LUA_TFUNCTION && tr != LUA_TTABLE) {
+        L->luabase->ArgError(3, "string/function/table");
+    }
+    if (tr != LUA_TFUNCTION && tr != LUA_TTABLE)
+        repl = check_template(L, 3);  /* pinned with the replacement */
+    lua_settop(L, 3);
+    Job* j = new_job(L, JOB_GSUB, 0);
+    j->tr = tr;
+    j->repl = repl;
+    j->max_s = may_match(j->prog, j->src, j->ms.src_end) ? max_s : 0;
+    return 1;
+}
+
+
+/* true plus the results of a finished job */
+static int job_results(lua_State* L, Job* j) {
+    lua_pushboolean(L, 1);
+    if (j->kind == JOB_GSUB) {
+        lua_pushlstring(L, j->out.data(), j->out.size());
+        lua_pushinteger(L, j->n);
+        return 3;
+    }
+    if (j->res == NULL) {
+        luaL_pushfail(L);
+        return 2;
+    }
+    const char* start = j->cursor.init;
+    if (j->kind == JOB_FIND) {
+        lua_pushinteger(L, (start - j->ms.src_init) + 1);
+        lua_pushinteger(L, j->res - j->ms.src_init);
+        return push_captures(L, &j->ms, NULL, 0) + 3;
+    }
+    return push_captures(L, &j->ms, start, j->res) + 1;
+}
+
+
+/* the hook stopped the slice: is that a pause rather than an error? */
+static int job_paused(const MatchState* ms) {
+    return ms->status == STATUS_TIMEOUT || ms->status == STATUS_STOPPED;
+}
+
+
+/* find/match: returns 1 when finished, 0 when paused */
+static int job_run_find(lua_State* L, Job* j) {
+    MatchState* ms = &j->ms;
+    int anchor = j->prog->anchor;
+    const char* last = last_start(j->prog, ms->src_init, ms->src_end);
+    for (;;) {
+        if (!j->cursor.active) {
+            if (!anchor && j->src <= last)
+                j->src = next_start(j->prog, j->src, ms->src_end);
+            if (j->src > last) {
+                j->res = NULL;  /* not found */
+                return 1;
+            }
+            reprepstate(ms);
+            cursor_start(&j->cursor, j->src, j->prog->items.data());
+        }
+        if ((j->res = match_resume(ms, &j->cursor)) != NULL)
+            return 1;
+        if (job_paused(ms))
+            return 0;
+        check_match_status(L, ms, &j->hook);
+        if (anchor) {
+            j->src = ms->src_end + 1;
+            continue;
+        }
+        j->src++;
+    }
+}
+
+
+/* appends what the buffer on top of the stack gathered to the job output */
+static void job_flush(lua_State* L, Job* j, luaL_Buffer* b) {
+    size_t l;
+    luaL_pushresult(b);
+    const char* r = lua_tolstring(L, -1, &l);
+    j->out.append(r, l);
+    lua_pop(L, 1);
+}
+
+
+/* gsub: same loop as 'str_gsub'; returns 1 when finished, 0 when paused */
+static int job_run_gsub(lua_State* L, Job* j) {
+    MatchState* ms = &j->ms;
+    int anchor = j->prog->anchor;
+    const char* last = last_start(j->prog, ms->src_init, ms->src_end);
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    while (j->n < j->max_s) {
+        const char* e;
+        if (!j->cursor.active) {
+            if (!anchor) {
+                const char* c = next_start(j->prog, j->src, ms->src_end);
+                if (c > last)
+                    break;
+                luaL_addlstring(&b, j->src, c - j->src);
+                j->src = c;
+            }
+            reprepstate(ms);
+            cursor_start(&j->cursor, j->src, j->prog->items.data());
+        }
+        if ((e = match_resume(ms, &j->cursor)) != NULL && e != j->lastmatch) {
+            j->n++;
+            if (j->tr == LUA_TFUNCTION || j->tr == LUA_TTABLE)
+                budget_settle(ms, &j->hook);
+            add_value(L, ms, &b, j->src, e, j->tr, j->repl);
+            if (j->tr == LUA_TFUNCTION || j->tr == LUA_TTABLE)
+                budget_begin(L, ms, &j->hook);  /* the Lua code is not charged */
+            j->src = j->lastmatch = e;
+        } else if (e == NULL && job_paused(ms)) {
+            job_flush(L, j, &b);
+            return 0;
+        } else {
+            check_match_status(L, ms, &j->hook);
+            if (j->src < ms->src_end)
+                luaL_addchar(&b, *j->src++);
+            else break;
+        }
+        if (anchor) break;
+    }
+    luaL_addlstring(&b, j->src, ms->src_end - j->src);
+    job_flush(L, j, &b);
+    return 1;
+}
+
+
+/*
+** job:resume(callback or timeOutNS or token = nil, everySimpleStep = nil, ownerId = nil)
+** Runs the job for one slice. Returns true and the results of the
+** underlying call once it is finished, false if the slice (or the
+** owner's budget) ran out first. A job whose slice raised an error
+** (e.g. from a replacement function) cannot be resumed.
+*/
+static int job_resume(lua_State* L) {
+    Job* j = check_job(L, 1);
+    if (j->done)
+        return job_results(L, j);
+    if (j->busy)
+        return luaL_error(L, "job is running or has failed");
+    lua_settop(L, 4);
+    if (!lua_isnil(L, 4) && budget_available(luaL_checkinteger(L, 4)) == 0) {
+        lua_pushboolean(L, 0);  /* nothing left this time; try again later */
+        return 1;
+    }
+    setup_lua_hook(L, &j->ms, &j->hook, 2);
+    lua_settop(L, 2);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, j->ref_subject);  /* keep 'add_value' layout: */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, j->ref_repl);  /* the replacement at 3 */
+    lua_pushvalue(L, 2);  /* and the callback or token at 4 */
+    lua_remove(L, 2);
+    if (j->hook.callback != 0)
+        j->hook.callback = 4;
+    j->busy = 1;
+    int finished = j->kind == JOB_GSUB ? job_run_gsub(L, j) : job_run_find(L, j);
+    budget_settle(&j->ms, &j->hook);
+    j->busy = 0;
+    if (!finished) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    j->done = 1;
+    return job_results(L, j);
+}
+
+
+/* job:done() */
+static int job_done(lua_State* L) {
+    lua_pushboolean(L, check_job(L, 1)->done);
+    return 1;
+}
+
+
+static int job_gc(lua_State* L) {
+    Job* j = check_job(L, 1);
+    lua_unref(L, j->ref_subject);
+    lua_unref(L, j->ref_pattern);
+    lua_unref(L, j->ref_repl);
+    j->~Job();
+    return 0;
+}
+
+
+static int job_tostring(lua_State* L) {
+    Job* j = check_job(L, 1);
+    static const char* const kinds[] = { "find", "match", "gsub" };
+    lua_pushfstring(L, JOB_MT " (%s, %s)", kinds[j->kind], j->done ? "done" : "running");
+    return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** STREAMS
+** =======================================================
+*/
+
+#define STREAM_MT	"CHADRegex.Stream"
+
+#if !defined(STREAM_MAX_TAIL)
+#define STREAM_MAX_TAIL	(1 << 20)  /* 1 MiB */
+#endif
+
+/*
+** gmatch over input that arrives in chunks. An attempt is decided once
+** it ends without having looked at the end of what has arrived (see
+** MatchState::hit_end): more bytes cannot change it then. Only the bytes
+** from the first undecided attempt on are kept, plus the one before it
+** for '%f'. A tail longer than 'max_tail' loses its oldest bytes, and
+** the attempts that started in them.
+*/
+typedef struct StreamUD {
+    const Program* prog;
+    int ref_pattern, ref_callback;
+    std::string buf;  /* the bytes kept */
+    size_t base;  /* stream offset of buf[0] */
+    size_t next;  /* offset in 'buf' of the next attempt */
+    size_t lastmatch;  /* stream offset of the end of the last match, (size_t)-1 if none */
+    size_t max_tail;
+    size_t dropped;  /* bytes dropped before their attempts were decided */
+    int busy;  /* a scan is running: the callback cannot feed */
+    int closed;
+} StreamUD;
+
+
+static StreamUD* check_stream(lua_State* L, int idx) {
+    return (StreamUD*)luaL_checkudata(L, idx, STREAM_MT);
+}
+
+
+/*
+** CHADRegex.stream(pattern, onMatch, maxTail = 1 MiB): onMatch(start,
+** end, captures...) is called for each match as soon as it is decided,
+** with positions counted from the start of the stream.
+*/
+static int module_stream(lua_State* L) {
+    const Program* prog = check_program(L, 1, CF_NOANCHOR);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_Integer max_tail = luaL_optinteger(L, 3, STREAM_MAX_TAIL);
+    luaL_argcheck(L, max_tail > 0, 3, "tail bound must be positive");
+    StreamUD* st = (StreamUD*)lua_newuserdata(L, sizeof(StreamUD));
+    new (st) StreamUD();
+    luaL_getmetatable(L, STREAM_MT);
+    lua_setmetatable(L, -2);
+    st->prog = prog;
+    st->lastmatch = (size_t)-1;
+    st->max_tail = (size_t)max_tail;
+    lua_pushvalue(L, 1);
+    st->ref_pattern = lua_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, 2);
+    st->ref_callback = lua_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+
+/*
+** Runs the attempts that the bytes kept decide (all of them when
+** 'final'), calling onMatch for each match; returns how many matched.
+** The hook arguments start at 'arg'. 'next' always points at the
+** attempt to run, so an error leaves the stream able to go on.
+*/
+static int stream_scan(lua_State* L, StreamUD* st, int final, int arg) {
+    MatchState ms;
+    LuaHook hook;
+    const char* s = st->buf.data();
+    int n = 0;
+    prepstate(&ms, s, st->buf.size(), st->prog);
+    setup_lua_hook(L, &ms, &hook, arg);
+    st->busy = 1;
+    const char* src = s + st->next;
+    while (src <= ms.src_end) {
+        const char* e;
+        src = next_start(st->prog, src, ms.src_end);
+        st->next = src - s;
+        reprepstate(&ms);
+        e = match(&ms, src, st->prog->items.data());
+        if (ms.status != STATUS_OK) {
+            st->busy = 0;
+            check_match_status(L, &ms, &hook);
+        }
+        if (ms.hit_end && !final)
+            break;  /* more bytes may change it */
+        if (e != NULL && st->base + (e - s) != st->lastmatch) {
+            st->next = e - s;
+            st->lastmatch = st->base + (e - s);
+            n++;
+            budget_settle(&ms, &hook);  /* Lua code runs from here */
+            lua_rawgeti(L, LUA_REGISTRYINDEX, st->ref_callback);
+            lua_pushinteger(L, (lua_Integer)(st->base + (src - s)) + 1);
+            lua_pushinteger(L, (lua_Integer)(st->base + (e - s)));
+            int nargs = push_captures(L, &ms, src, e) + 2;
+            for (int i = 0; i < ms.level; i++) {  /* position captures count from the stream start */
+                if (ms.capture[i].len == CAP_POSITION) {
+                    int slot = lua_gettop(L) - (nargs - 2) + 1 + i;
+                    lua_pushinteger(L, lua_tointeger(L, slot) + (lua_Integer)st->base);
+                    lua_replace(L, slot);
+                }
+            }
+            int failed = lua_pcall(L, nargs, 0, 0) != 0;
+            st->busy = 0;
+            if (failed)
+                lua_error(L);
+            budget_begin(L, &ms, &hook);  /* the callback is not charged; may raise */
+            st->busy = 1;
+            src = e;
+        } else
+            src++;
+        st->next = src - s;
+    }
+    st->busy = 0;
+    budget_settle(&ms, &hook);
+    return n;
+}
+
+
+/* drops what the next attempt no longer needs, and the excess over 'max_tail' */
+static void stream_trim(StreamUD* st) {
+    size_t size = st->buf.size();
+    size_t keep_from = st->next > 0 ? st->next - 1 : 0;  /* '%f' looks one byte back */
+    if (keep_from > size)
+        keep_from = size;
+    if (size - keep_from > st->max_tail + 1) {
+        size_t first = size - st->max_tail;  /* oldest attempt that stays */
+        st->dropped += first - st->next;
+        st->next = first;
+        keep_from = first - 1;
+    }
+    st->buf.erase(0, keep_from);
+    st->base += keep_from;
+    st->next -= keep_from;
+}
+
+
+/* stream:feed(chunk, callback or timeOutNS = nil, everySimpleStep = nil, ownerId = nil) */
+static int stream_feed(lua_State* L) {
+    StreamUD* st = check_stream(L, 1);
+    size_t l;
+    const char* chunk = check_subject(L, 2, &l);
+    if (st->closed)
+        return luaL_error(L, "stream is closed");
+    if (st->busy)
+        return luaL_error(L, "stream is busy");
+    st->buf.append(chunk, l);
+    int n = stream_scan(L, st, 0, 3);
+    stream_trim(st);
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+
+/* stream:close(callback or timeOutNS = nil, everySimpleStep = nil, ownerId = nil) */
+static int stream_close(lua_State* L) {
+    StreamUD* st = check_stream(L, 1);
+    if (st->closed)
+        return luaL_error(L, "stream is closed");
+    if (st->busy)
+        return luaL_error(L, "stream is busy");
+    int n = stream_scan(L, st, 1, 2);
+    st->closed = 1;
+    std::string().swap(st->buf);
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+
+/* stream:pending(): bytes kept, and bytes dropped over maxTail so far */
+static int stream_pending(lua_State* L) {
+    StreamUD* st = check_stream(L, 1);
+    lua_pushinteger(L, (lua_Integer)st->buf.size());
+    lua_pushinteger(L, (lua_Integer)st->dropped);
+    return 2;
+}
+
+
+static int stream_gc(lua_State* L) {
+    StreamUD* st = check_stream(L, 1);
+    lua_unref(L, st->ref_pattern);
+    lua_unref(L, st->ref_callback);
+    st->~StreamUD();
+    return 0;
+}
+
+
+static int stream_tostring(lua_State* L) {
+    StreamUD* st = check_stream(L, 1);
+    if (st->closed)
+        lua_pushliteral(L, STREAM_MT " (closed)");
+    else
+        lua_pushfstring(L, STREAM_MT " (%d bytes kept)", (int)st->buf.size());
+    return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** BATCH MATCHING
+** =======================================================
+*/
+
+/* the string or view on top of the stack, or NULL if it is neither (numbers included) */
+static const char* to_subject(lua_State* L, size_t* len) {
+    if (lua_type(L, -1) == LUA_TSTRING)
+        return lua_tolstring(L, -1, len);
+    if (lua_type(L, -1) == LUA_TUSERDATA && lua_getmetatable(L, -1)) {
+        luaL_getmetatable(L, VIEW_MT);
+        int is_view = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+        if (is_view) {
+            ViewUD* v = (ViewUD*)lua_touserdata(L, -1);
+            *len = v->len;
+            return v->data;
+        }
     }
-    case LUA_TTABLE: {  /* index the table */
-        push_onecapture(ms, 0, s, e);  /* first capture is the index */
-        lua_gettable(L, 3);
-        break;
+    return NULL;
+}
+
+
+/* opts[k] at 'idx' (a table or nil) as a number, 'def' if absent */
+static lua_Number opt_field_number(lua_State* L, int idx, const char* k, lua_Number def) {
+    if (lua_isnoneornil(L, idx))
+        return def;
+    lua_getfield(L, idx, k);
+    if (!lua_isnil(L, -1)) {
+        if (!lua_isnumber(L, -1))
+            luaL_error(L, "option '%s' must be a number", k);
+        def = lua_tonumber(L, -1);
     }
-    default: {  /* LUA_TNUMBER or LUA_TSTRING */
-        add_s(ms, b, s, e);  /* add value to the buffer */
-        return 1;  /* something changed */
+    lua_pop(L, 1);
+    return def;
+}
+
+
+/*
+** CHADRegex.matchMany(pattern, subjects, opts = nil): 'match' on every
+** string or view of the array 'subjects' in one call, the pattern
+** compiled once. opts: startPos (1), threads (1), timeOutNS and ownerId
+** for the whole batch, token. Returns an array with each subject's
+** capture (a table of captures if the pattern has several) or false, and
+** how many subjects were decided; when the timeout, the owner's budget
+** or the token stops the batch first, the subjects left have no entry
+** and the reason comes third. A token's callback is not called.
+*/
+static int module_match_many(lua_State* L) {
+    const Program* prog = check_program(L, 1, CF_NONE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (!lua_isnoneornil(L, 3))
+        luaL_checktype(L, 3, LUA_TTABLE);
+    lua_Integer start = (lua_Integer)opt_field_number(L, 3, "startPos", 1);
+    lua_Integer threads = (lua_Integer)opt_field_number(L, 3, "threads", 1);
+    lua_Number timeout = opt_field_number(L, 3, "timeOutNS", 0);
+    int owned = 0, by_budget = 0;
+    long long owner = 0;
+    Limits limits;
+    luaL_argcheck(L, threads > 0, 3, "threads must be positive");
+    if (!lua_isnoneornil(L, 3)) {
+        lua_getfield(L, 3, "token");
+        if (!lua_isnil(L, -1))
+            limits.cancel = check_token(L, lua_gettop(L))->cancelled.get();
+        lua_pop(L, 1);  /* 'opts' keeps it */
+        lua_getfield(L, 3, "ownerId");
+        if ((owned = !lua_isnil(L, -1)))
+            owner = (long long)luaL_checkinteger(L, lua_gettop(L));
+        lua_pop(L, 1);
     }
+    limits.timeout_ns = timeout > 0 ? (uint64_t)timeout : 0;
+    if (owned) {
+        uint64_t left = budget_available(owner);
+        if (limits.timeout_ns == 0 || left < limits.timeout_ns) {
+            limits.timeout_ns = left > 0 ? left : 1;  /* 0 would be no limit */
+            by_budget = 1;
+        }
     }
-    if (!lua_toboolean(L, -1)) {  /* nil or false? */
-        lua_pop(L, 1);  /* remove value */
-        luaL_addlstring(b, s, e - s);  /* keep original text */
-        return 0;  /* no changes */
-    } else if (l_unlikely(!lua_isstring(L, -1)))
-        return luaL_error(L, "invalid replacement value (a %s)",
-            luaL_typename(L, -1));
-    else {
-        luaL_addvalue(b);  /* add result to accumulator */
-        return 1;  /* something changed */
+    int n = (int)lua_objlen(L, 2);
+    for (int i = 1; i <= n; i++) {  /* every error before anything is allocated */
+        size_t l;
+        lua_rawgeti(L, 2, i);
+        if (to_subject(L, &l) == NULL)
+            return luaL_error(L, "subject %d is not a string or a view", i);
+        lua_pop(L, 1);
+    }
+    Status st;
+    {
+        std::vector<std::string_view> subjects((size_t)n);
+        BatchResults r;
+        for (int i = 0; i < n; i++) {
+            size_t l;
+            lua_rawgeti(L, 2, i + 1);
+            const char* s = to_subject(L, &l);
+            subjects[i] = std::string_view(s, l);  /* the array keeps it */
+            lua_pop(L, 1);
+        }
+        st = find_many(*prog, subjects.data(), subjects.size(),
+            start > 0 ? (ptrdiff_t)start - 1 : start == 0 ? 0 : (ptrdiff_t)start, r,
+            (size_t)threads, limits);
+        if (owned)
+            budget_charge(owner, r.busy_ns);
+        if (st == STATUS_TIMEOUT && by_budget)
+            st = STATUS_BUDGET;
+        if (st == STATUS_OK || st == STATUS_TIMEOUT || st == STATUS_BUDGET || st == STATUS_STOPPED) {
+            lua_createtable(L, n, 0);
+            for (int i = 0; i < n; i++) {
+                const Span* c = &r.spans[(size_t)i * r.width];
+                if (r.outcome[i] == BATCH_UNDECIDED)
+                    continue;
+                if (r.outcome[i] == BATCH_NOMATCH)
+                    lua_pushboolean(L, 0);
+                else if (r.width > 2)
+                    push_capture_tuple(L, subjects[i].data(), c + 1, r.width - 1);
+                else {
+                    if (r.width == 2)
+                        c++;  /* the one capture, else the whole match */
+                    if (c->position)
+                        lua_pushinteger(L, c->begin + 1);
+                    else
+                        lua_pushlstring(L, subjects[i].data() + c->begin, c->end - c->begin);
+                }
+                lua_rawseti(L, -2, i + 1);
+            }
+            lua_pushinteger(L, (lua_Integer)r.decided);
+        }
     }
+    if (st == STATUS_OK)
+        return 2;
+    lua_pushstring(L, status_message(st));
+    if (st == STATUS_TIMEOUT || st == STATUS_BUDGET || st == STATUS_STOPPED)
+        return 3;
+    return lua_error(L);  /* after the vectors are gone */
 }
 
+/* }====================================================== */
 
-static int str_gsub(lua_State* L) {
-    size_t srcl, lp;
-    const char* src = luaL_checklstring(L, 1, &srcl);  /* subject */
-    const char* p = luaL_checklstring(L, 2, &lp);  /* pattern */
-    const char* lastmatch = NULL;  /* end of last match */
-    int tr = lua_type(L, 3);  /* replacement type */
-    lua_Integer max_s = luaL_optinteger(L, 4, srcl + 1);  /* max replacements */
-    int anchor = (*p == '^');
-    lua_Integer n = 0;  /* replacement count */
-    int changed = 0;  /* change flag */
-    MatchState ms;
-    luaL_Buffer b;
-    if (tr != LUA_TNUMBER && tr != LUA_TSTRING &&
-        tr != LUA_TFUNCTION && tr != LUA_TTABLE) {
-        L->luabase->ArgError(3, "string/function/table");
+
+/*
+** {======================================================
+** ASYNC MATCHING
+** =======================================================
+*/
+
+#define ASYNC_INBOX	"CHADRegex.AsyncInbox"
+
+/* registry userdata owning the inbox of this state; closing the state closes it */
+typedef struct AsyncUD {
+    std::shared_ptr<AsyncInbox> inbox;
+} AsyncUD;
+
+
+static AsyncUD* async_of(lua_State* L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, ASYNC_INBOX);
+    AsyncUD* ud = (AsyncUD*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return ud;
+}
+
+
+static int async_inbox_gc(lua_State* L) {
+    AsyncUD* ud = (AsyncUD*)lua_touserdata(L, 1);
+    ud->inbox->closed = true;
+    ud->~AsyncUD();
+    return 0;
+}
+
+
+/* compiled program of pattern argument 'idx', shared with the workers */
+static std::shared_ptr<const Program> async_program(lua_State* L, int idx, unsigned flags) {
+    check_program(L, idx, flags);
+    return ((PatternUD*)lua_touserdata(L, idx))->prog;
+}
+
+
+/*
+** Takes the callback at 'arg', timeOutNS at 'arg' + 1 and a token at
+** 'arg' + 2, then queues 't'. Cancelling the token stops the task where
+** it is (or before it starts); the callback then gets the stop error.
+*/
+static int async_queue(lua_State* L, AsyncTask& t, int arg) {
+    luaL_checktype(L, arg, LUA_TFUNCTION);
+    lua_Number ns = luaL_optnumber(L, arg + 1, 0);
+    t.timeout_ns = ns > 0 ? (uint64_t)ns : 0;
+    if (!lua_isnoneornil(L, arg + 2))
+        t.cancel = check_token(L, arg + 2)->cancelled;
+    lua_pushvalue(L, arg);
+    t.ref = lua_ref(L, LUA_REGISTRYINDEX);
+    async_submit(async_of(L)->inbox, std::move(t));
+    return 0;
+}
+
+
+static int async_find_aux(lua_State* L, int find) {
+    size_t ls, lp;
+    int literal = 0;
+    const char* s = check_subject(L, 1, &ls);
+    const char* p = NULL;
+    AsyncTask t;
+    t.kind = find ? ASYNC_FIND : ASYNC_MATCH;
+    t.init = posrelatI(luaL_optinteger(L, 3, 1), ls) - 1;
+    if (find && lua_isboolean(L, 4))
+        p = pattern_text(L, 2, &lp, &literal);
+    if (p != NULL && (lua_toboolean(L, 4) || literal))
+        t.pattern.assign(p, lp);  /* plain search */
+    else
+        t.prog = async_program(L, 2, CF_NONE);
+    t.subject.assign(s, ls);
+    return async_queue(L, t, find ? 5 : 4);
+}
+
+
+/* CHADRegex.findAsync(haystack, needle, startPos = 1, noPatterns = false, callback, timeOutNS = nil, token = nil) */
+static int async_find(lua_State* L) {
+    return async_find_aux(L, 1);
+}
+
+
+/* CHADRegex.matchAsync(string, pattern, startPos = 1, callback, timeOutNS = nil, token = nil) */
+static int async_match(lua_State* L) {
+    return async_find_aux(L, 0);
+}
+
+
+/* CHADRegex.gmatchAsync(string, pattern, startPos = 1, callback, timeOutNS = nil, token = nil) */
+static int async_gmatch(lua_State* L) {
+    size_t ls;
+    const char* s = check_subject(L, 1, &ls);
+    AsyncTask t;
+    t.kind = ASYNC_GMATCH;
+    t.prog = async_program(L, 2, CF_NOANCHOR);
+    t.init = posrelatI(luaL_optinteger(L, 3, 1), ls) - 1;
+    t.subject.assign(s, ls);
+    return async_queue(L, t, 4);
+}
+
+
+/*
+** CHADRegex.gsubAsync(string, pattern, replacement, maxReplaces = nil, callback, timeOutNS = nil, token = nil)
+** Only string replacements: functions and tables would have to run on
+** the game thread anyway. The replacement is checked here, so a bad '%'
+** raises at the call rather than coming back as an error value.
+*/
+static int async_gsub(lua_State* L) {
+    size_t srcl;
+    const char* src = check_subject(L, 1, &srcl);
+    int tr = lua_type(L, 3);
+    if (tr != LUA_TNUMBER && tr != LUA_TSTRING && tr != LUA_TUSERDATA)
+        L->luabase->ArgError(3, "string");
+    if (check_template(L, 3) == NULL)
+        return luaL_error(L, "invalid use of '%c' in replacement string", L_ESC);
+    lua_Integer max_s = luaL_optinteger(L, 4, srcl + 1);
+    AsyncTask t;
+    t.kind = ASYNC_GSUB;
+    t.prog = async_program(L, 2, CF_NONE);
+    t.max_s = max_s > 0 ? (size_t)max_s : 0;
+    t.repl = ((ReplacementUD*)lua_touserdata(L, 3))->repl;
+    t.subject.assign(src, srcl);
+    return async_queue(L, t, 5);
+}
+
+
+static void push_span(lua_State* L, const std::string& subject, const Span& c) {
+    if (c.position)
+        lua_pushinteger(L, c.begin + 1);
+    else
+        lua_pushlstring(L, subject.data() + c.begin, c.end - c.begin);
+}
+
+
+/* pushes the callback arguments for 'r': true and the results, or false and the error */
+static int push_async_result(lua_State* L, const AsyncResult& r) {
+    if (r.status != STATUS_OK) {
+        char msg[128];
+        format_status(r.status, r.status_arg, msg, sizeof(msg));
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, msg);
+        return 2;
     }
-    //luaL_argexpected(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
-    //    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
-    //    "string/function/table");
+    lua_pushboolean(L, 1);
+    switch (r.kind) {
+    case ASYNC_FIND:
+    case ASYNC_MATCH: {
+        if (!r.found) {
+            luaL_pushfail(L);
+            return 2;
+        }
+        int n = 1;
+        luaL_checkstack(L, (int)r.caps.size() + 2, "too many captures");
+        if (r.kind == ASYNC_FIND) {
+            lua_pushinteger(L, r.whole.begin + 1);
+            lua_pushinteger(L, r.whole.end);
+            n += 2;
+        }
+        for (const Span& c : r.caps)
+            push_span(L, r.subject, c);
+        return n + (int)r.caps.size();
+    }
+    case ASYNC_GMATCH: {  /* one entry per match; a table of captures if there are several */
+        lua_createtable(L, (int)r.n, 0);
+        for (size_t i = 0; i < r.n; i++) {
+            const Span* c = &r.caps[i * r.width];
+            if (r.width == 1)
+                push_span(L, r.subject, c[0]);
+            else {
+                lua_createtable(L, (int)r.width, 0);
+                for (size_t k = 0; k < r.width; k++) {
+                    push_span(L, r.subject, c[k]);
+                    lua_rawseti(L, -2, (int)k + 1);
+                }
+            }
+            lua_rawseti(L, -2, (int)i + 1);
+        }
+        return 2;
+    }
+    default: {
+        lua_pushlstring(L, r.out.data(), r.out.size());
+        lua_pushinteger(L, (lua_Integer)r.n);
+        return 3;
+    }
+    }
+}
+
+
+/*
+** CHADRegex.poll(): runs the callbacks of the async calls that finished,
+** returns how many. Called on every Think; an error in a callback is
+** raised after the result is released, and the rest wait for the next poll.
+*/
+static int module_poll(lua_State* L) {
+    std::shared_ptr<AsyncInbox> inbox = async_of(L)->inbox;
+    int n = 0, failed = 0;
+    {
+        AsyncResult r;
+        while (!failed && async_take(*inbox, r)) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, r.ref);
+            lua_unref(L, r.ref);
+            int nargs = push_async_result(L, r);
+            failed = lua_pcall(L, nargs, 0, 0) != 0;
+            n++;
+        }
+    }
+    inbox.reset();
+    if (failed)
+        lua_error(L);
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+/* }====================================================== */
+
 
-    if (lua_isfunction(L, 5)) {
-        lua_Integer maxIter = luaL_optinteger(L, 6, (size_t)1e5);
-        lua_pushvalue(L, 5);
+/*
+** {======================================================
+** STATISTICS
+** =======================================================
+*/
 
-        ms_setup_hook(ms, lua_ref(L, LUA_REGISTRYINDEX), maxIter, false, 0ns);
-    } else if (lua_isnumber(L, 5)) {
-        lua_Integer maxIter = luaL_optinteger(L, 6, (size_t)1e5);
+#if !defined(STATS_COMMAND_TOP)
+#define STATS_COMMAND_TOP	10
+#endif
 
-        ms_setup_hook(ms, 0, maxIter, true, std::chrono::nanoseconds((long long)(double)lua_tonumber(L, 5)));
-    } else {
-        ms_setup_hook(ms, 0, (size_t)1e5, false, 0ns);
+
+static void set_number_field(lua_State* L, const char* k, double v) {
+    lua_pushnumber(L, (lua_Number)v);
+    lua_setfield(L, -2, k);
+}
+
+
+/*
+** CHADRegex.analyze(pattern, subjectLength = nil): how the worst case of
+** a search grows with the subject, before running anything. With a
+** length, 'steps' estimates the worst case for a subject that long.
+*/
+static int module_analyze(lua_State* L) {
+    const Program* prog = check_program(L, 1, CF_NONE);
+    Analysis a = analyze(*prog);
+    lua_createtable(L, 0, 8);
+    lua_pushstring(L, complexity_class(a.degree));
+    lua_setfield(L, -2, "class");
+    set_number_field(L, "degree", a.degree);
+    set_number_field(L, "memoDegree", a.memo_degree);
+    lua_pushboolean(L, a.memoized);
+    lua_setfield(L, -2, "memoized");
+    set_number_field(L, "repeats", (double)a.repeats);
+    if (!lua_isnoneornil(L, 2)) {
+        lua_Integer n = luaL_checkinteger(L, 2);
+        set_number_field(L, "steps", worst_steps(*prog, a, n > 0 ? (size_t)n : 0));
     }
+    lua_createtable(L, (int)a.findings.size(), 0);
+    for (size_t i = 0; i < a.findings.size(); i++) {
+        const Finding& f = a.findings[i];
+        lua_createtable(L, 0, 5);
+        lua_pushstring(L, finding_name(f.kind));
+        lua_setfield(L, -2, "kind");
+        lua_pushlstring(L, prog->source.data() + f.from, f.to - f.from);
+        lua_setfield(L, -2, "text");
+        set_number_field(L, "from", (double)f.from + 1);  /* 1-based, inclusive */
+        set_number_field(L, "to", (double)f.to);
+        set_number_field(L, "degree", f.degree);
+        lua_rawseti(L, -2, (int)i + 1);
+    }
+    lua_setfield(L, -2, "findings");
+    return 1;
+}
 
-    luaL_buffinit(L, &b);
-    if (anchor) {
-        p++; lp--;  /* skip anchor character */
+
+/*
+** CHADRegex.stats(max = nil): one table per pattern source, the most
+** time first, with the counters of all its compiled copies added up.
+*/
+static int module_stats(lua_State* L) {
+    lua_Integer max = luaL_optinteger(L, 1, 0);
+    std::vector<PatternReport> reports = stats_report(max > 0 ? (size_t)max : 0);
+    lua_createtable(L, (int)reports.size(), 0);
+    for (size_t i = 0; i < reports.size(); i++) {
+        const PatternReport& r = reports[i];
+        lua_createtable(L, 0, 9);
+        lua_pushlstring(L, r.pattern.data(), r.pattern.size());
+        lua_setfield(L, -2, "pattern");
+        set_number_field(L, "programs", (double)r.programs);
+        set_number_field(L, "calls", (double)r.calls);
+        set_number_field(L, "steps", (double)r.steps);
+        set_number_field(L, "backtracks", (double)r.backtracks);
+        set_number_field(L, "peakDepth", (double)r.peak_frames);
+        set_number_field(L, "totalNs", (double)r.total_ns);
+        set_number_field(L, "maxNs", (double)r.max_ns);
+        set_number_field(L, "timeouts", (double)r.timeouts);
+        lua_rawseti(L, -2, (int)i + 1);
     }
-    prepstate(&ms, L, src, srcl, p, lp);
-    while (n < max_s) {
-        const char* e;
-        reprepstate(&ms);  /* (re)prepare state for new match */
-        if ((e = match(&ms, src, p)) != NULL && e != lastmatch) {  /* match? */
-            n++;
-            changed = add_value(&ms, &b, src, e, tr) | changed;
-            src = lastmatch = e;
-        } else if (src < ms.src_end)  /* otherwise, skip one character */
-            luaL_addchar(&b, *src++);
-        else break;  /* end of subject */
-        if (anchor) break;
+    return 1;
+}
+
+
+/* CHADRegex.slowMatches(): the calls past 'slowMatchNs', oldest first */
+static int module_slow_matches(lua_State* L) {
+    std::vector<SlowMatch> log = slow_matches();
+    uint64_t now = clock_ns();
+    lua_createtable(L, (int)log.size(), 0);
+    for (size_t i = 0; i < log.size(); i++) {
+        const SlowMatch& m = log[i];
+        lua_createtable(L, 0, 6);
+        lua_pushlstring(L, m.pattern.data(), m.pattern.size());
+        lua_setfield(L, -2, "pattern");
+        set_number_field(L, "subjectLength", (double)m.subject_len);
+        if (m.owned) {
+            lua_pushinteger(L, (lua_Integer)m.owner);
+            lua_setfield(L, -2, "owner");
+        }
+        set_number_field(L, "ns", (double)m.ns);
+        set_number_field(L, "steps", (double)m.steps);
+        set_number_field(L, "age", (double)(now - m.when) / 1e9);  /* seconds */
+        lua_rawseti(L, -2, (int)i + 1);
     }
-    if (!changed)  /* no changes? */
-        lua_pushvalue(L, 1);  /* return original string */
-    else {  /* something changed */
-        luaL_addlstring(&b, src, ms.src_end - src);
-        luaL_pushresult(&b);  /* create and return new string */
+    return 1;
+}
+
+
+/* CHADRegex.resetStats() */
+static int module_reset_stats(lua_State* L) {
+    (void)L;
+    stats_reset();
+    return 0;
+}
+
+
+static void print_line(lua_State* L, const char* line) {
+    lua_getglobal(L, "print");
+    lua_pushstring(L, line);
+    lua_call(L, 1, 0);
+}
+
+
+/*
+** chadregex_stats [N]: prints the N patterns (default STATS_COMMAND_TOP)
+** that took the most time, then the slow log. Superadmins only when a
+** player runs it.
+*/
+static int stats_command(lua_State* L) {
+    if (!lua_isnoneornil(L, 1)) {
+        lua_getglobal(L, "IsValid");
+        lua_pushvalue(L, 1);
+        lua_call(L, 1, 1);
+        if (lua_toboolean(L, -1)) {
+            lua_getfield(L, 1, "IsSuperAdmin");
+            lua_pushvalue(L, 1);
+            lua_call(L, 1, 1);
+            if (!lua_toboolean(L, -1))
+                return 0;
+        }
     }
-    lua_pushinteger(L, n);  /* number of substitutions */
-    return 2;
+    size_t top = STATS_COMMAND_TOP;
+    if (lua_istable(L, 3)) {
+        lua_rawgeti(L, 3, 1);
+        lua_Integer n = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 0;
+        if (n > 0)
+            top = (size_t)n;
+    }
+    char line[512];
+    std::vector<PatternReport> reports = stats_report(top);
+    snprintf(line, sizeof(line), "%16s %10s %8s %10s %11s %6s %9s  %s", "CHADRegex: calls",
+        "total ms", "max ms", "steps", "backtracks", "depth", "timeouts", "pattern");
+    print_line(L, line);
+    for (const PatternReport& r : reports) {
+        snprintf(line, sizeof(line), "%16llu %10.3f %8.3f %10llu %11llu %6llu %9llu  %.200s",
+            (unsigned long long)r.calls, (double)r.total_ns / 1e6, (double)r.max_ns / 1e6,
+            (unsigned long long)r.steps, (unsigned long long)r.backtracks,
+            (unsigned long long)r.peak_frames, (unsigned long long)r.timeouts, r.pattern.c_str());
+        print_line(L, line);
+    }
+    std::vector<SlowMatch> log = slow_matches();
+    uint64_t now = clock_ns();
+    snprintf(line, sizeof(line), "CHADRegex: %u slow matches (over %.3f ms)",
+        (unsigned)log.size(), (double)get_slow_match_ns() / 1e6);
+    print_line(L, line);
+    for (const SlowMatch& m : log) {
+        char owner[32] = "-";
+        if (m.owned)
+            snprintf(owner, sizeof(owner), "%lld", m.owner);
+        snprintf(line, sizeof(line), "  %8.1fs ago  %10.3f ms  owner %-6s  subject %zu bytes  %.200s",
+            (double)(now - m.when) / 1e9, (double)m.ns / 1e6, owner, m.subject_len, m.pattern.c_str());
+        print_line(L, line);
+    }
+    return 0;
 }
 
 /* }====================================================== */
@@ -778,6 +2709,16 @@ static int str_gsub(lua_State* L) {
 }
 #endif
 
+/* states with the module open; the workers are joined when the last one closes */
+static std::atomic<int> async_states{ 0 };
+
+/* sets field 'name' of the table below the pattern cache to a closure over it */
+static void push_module_function(lua_State* L, lua_CFunction f, const char* name) {
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, f, 1);
+    lua_setfield(L, -3, name);
+}
+
 GMOD_MODULE_OPEN() {
     //LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
     //    LUA->GetField(-1, "print");
@@ -785,25 +2726,203 @@ GMOD_MODULE_OPEN() {
     //    LUA->Call(1, 0);
     //LUA->Pop();
 
-    LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+    luaL_newmetatable(L, PATTERN_MT);
+        LUA->PushCFunction(pattern_gc);
+        LUA->SetField(-2, "__gc");
+
+        LUA->PushCFunction(pattern_tostring);
+        LUA->SetField(-2, "__tostring");
+    LUA->Pop();
+
+    luaL_newmetatable(L, REPLACEMENT_MT);
+        LUA->PushCFunction(replacement_gc);
+        LUA->SetField(-2, "__gc");
+
+        LUA->PushCFunction(replacement_tostring);
+        LUA->SetField(-2, "__tostring");
+    LUA->Pop();
+
+    luaL_newmetatable(L, PATTERNSET_MT);
+        LUA->PushCFunction(set_gc);
+        LUA->SetField(-2, "__gc");
+
+        LUA->PushCFunction(set_tostring);
+        LUA->SetField(-2, "__tostring");
+    LUA->Pop();
+
+    luaL_newmetatable(L, TOKEN_MT);
+        LUA->CreateTable();
+            LUA->PushCFunction(token_cancel);
+            LUA->SetField(-2, "cancel");
+
+            LUA->PushCFunction(token_reset);
+            LUA->SetField(-2, "reset");
+
+            LUA->PushCFunction(token_is_cancelled);
+            LUA->SetField(-2, "isCancelled");
+
+            LUA->PushCFunction(token_release);
+            LUA->SetField(-2, "release");
+        LUA->SetField(-2, "__index");
+
+        LUA->PushCFunction(token_gc);
+        LUA->SetField(-2, "__gc");
+
+        LUA->PushCFunction(token_tostring);
+        LUA->SetField(-2, "__tostring");
+    LUA->Pop();
+
+    luaL_newmetatable(L, VIEW_MT);
+        LUA->CreateTable();
+            LUA->PushCFunction(view_str);
+            LUA->SetField(-2, "str");
+
+            LUA->PushCFunction(module_view);
+            LUA->SetField(-2, "sub");
+
+            LUA->PushCFunction(view_len);
+            LUA->SetField(-2, "len");
+
+            LUA->PushCFunction(view_byte);
+            LUA->SetField(-2, "byte");
+
+            LUA->PushCFunction(view_offsets);
+            LUA->SetField(-2, "offsets");
+
+            LUA->PushCFunction(view_source);
+            LUA->SetField(-2, "source");
+        LUA->SetField(-2, "__index");
+
+        LUA->PushCFunction(view_len);
+        LUA->SetField(-2, "__len");
+
+        LUA->PushCFunction(view_concat);
+        LUA->SetField(-2, "__concat");
+
+        LUA->PushCFunction(view_eq);
+        LUA->SetField(-2, "__eq");
+
+        LUA->PushCFunction(view_gc);
+        LUA->SetField(-2, "__gc");
+
+        LUA->PushCFunction(view_str);
+        LUA->SetField(-2, "__tostring");
+    LUA->Pop();
+
+    luaL_newmetatable(L, STREAM_MT);
+        LUA->CreateTable();
+            LUA->PushCFunction(stream_feed);
+            LUA->SetField(-2, "feed");
+
+            LUA->PushCFunction(stream_close);
+            LUA->SetField(-2, "close");
+
+            LUA->PushCFunction(stream_pending);
+            LUA->SetField(-2, "pending");
+        LUA->SetField(-2, "__index");
+
+        LUA->PushCFunction(stream_gc);
+        LUA->SetField(-2, "__gc");
+
+        LUA->PushCFunction(stream_tostring);
+        LUA->SetField(-2, "__tostring");
+    LUA->Pop();
+
+    luaL_newmetatable(L, JOB_MT);
         LUA->CreateTable();
-            LUA->PushCFunction(str_find);
-            LUA->SetField(-2, "find");
+            LUA->PushCFunction(job_resume);
+            LUA->SetField(-2, "resume");
 
-            LUA->PushCFunction(gmatch);
-            LUA->SetField(-2, "gmatch");
+            LUA->PushCFunction(job_done);
+            LUA->SetField(-2, "done");
+        LUA->SetField(-2, "__index");
 
-            LUA->PushCFunction(str_gsub);
-            LUA->SetField(-2, "gsub");
+        LUA->PushCFunction(job_gc);
+        LUA->SetField(-2, "__gc");
 
-            LUA->PushCFunction(str_match);
-            LUA->SetField(-2, "match");
+        LUA->PushCFunction(job_tostring);
+        LUA->SetField(-2, "__tostring");
+    LUA->Pop();
+
+    LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+        LUA->CreateTable();
+            new (lua_newuserdata(L, sizeof(PatternCache))) PatternCache();
+            LUA->CreateTable();
+                LUA->PushCFunction(cache_gc);
+                LUA->SetField(-2, "__gc");
+            lua_setmetatable(L, -2);
+
+            push_module_function(L, str_find, "find");
+            push_module_function(L, gmatch, "gmatch");
+            push_module_function(L, gmatch_all, "gmatchAll");
+            push_module_function(L, find_all, "findAll");
+            push_module_function(L, count_all, "count");
+            push_module_function(L, str_gsub, "gsub");
+            push_module_function(L, str_match, "match");
+            push_module_function(L, str_match_pos, "matchPos");
+            push_module_function(L, gmatch_pos, "gmatchPos");
+            push_module_function(L, module_view, "view");
+            push_module_function(L, module_compile, "compile");
+            push_module_function(L, module_compile_replacement, "compileReplacement");
+            push_module_function(L, module_compile_set, "compileSet");
+            push_module_function(L, module_find_any, "findAny");
+            push_module_function(L, module_option, "option");
+            push_module_function(L, module_budget, "budget");
+            push_module_function(L, module_token, "token");
+            push_module_function(L, module_find_job, "findJob");
+            push_module_function(L, module_match_job, "matchJob");
+            push_module_function(L, module_gsub_job, "gsubJob");
+            push_module_function(L, module_stream, "stream");
+            push_module_function(L, module_match_many, "matchMany");
+            push_module_function(L, async_find, "findAsync");
+            push_module_function(L, async_match, "matchAsync");
+            push_module_function(L, async_gmatch, "gmatchAsync");
+            push_module_function(L, async_gsub, "gsubAsync");
+            push_module_function(L, module_poll, "poll");
+            push_module_function(L, module_stats, "stats");
+            push_module_function(L, module_slow_matches, "slowMatches");
+            push_module_function(L, module_reset_stats, "resetStats");
+            push_module_function(L, module_analyze, "analyze");
+        LUA->Pop(); /* pattern cache */
         LUA->SetField(-2, "CHADRegex");
+
+        new (lua_newuserdata(L, sizeof(AsyncUD))) AsyncUD{ std::make_shared<AsyncInbox>() };
+        LUA->CreateTable();
+            LUA->PushCFunction(async_inbox_gc);
+            LUA->SetField(-2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_setfield(L, LUA_REGISTRYINDEX, ASYNC_INBOX);
+        async_states++;
+
+        LUA->GetField(-1, "hook");  /* deliver async results every frame */
+        if (lua_istable(L, -1)) {
+            LUA->GetField(-1, "Add");
+            LUA->PushString("Think");
+            LUA->PushString("CHADRegex.poll");
+            LUA->GetField(-5, "CHADRegex");
+            LUA->GetField(-1, "poll");
+            LUA->Remove(-2);
+            LUA->Call(3, 0);
+        }
+        LUA->Pop();
+
+        LUA->GetField(-1, "concommand");  /* top patterns and slow log, server side */
+        LUA->GetField(-2, "SERVER");
+        if (lua_istable(L, -2) && lua_toboolean(L, -1)) {
+            LUA->GetField(-2, "Add");
+            LUA->PushString("chadregex_stats");
+            LUA->PushCFunction(stats_command);
+            LUA->Call(2, 0);
+        }
+        LUA->Pop(2);
     LUA->Pop();
 
     return 0;
 }
 
 GMOD_MODULE_CLOSE() {
+    async_of(L)->inbox->closed = true;  /* stop this state's running tasks now */
+    if (--async_states == 0)
+        async_shutdown();
     return 0;
 }
\ No newline at end of file